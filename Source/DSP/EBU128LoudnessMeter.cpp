@@ -1,55 +1,308 @@
 #include "EBU128LoudnessMeter.h"
+#include <algorithm>
 #include <cmath>
 
+namespace
+{
+    // ITU-R BS.1770-4 channel weights in JUCE channel order for the specialised layouts.
+    // Side surrounds get 1.41 (~+1.5 dB); the LFE is weighted 0 and never filtered.
+    template <int NumChannels> struct LayoutWeights;
+    
+    template <> struct LayoutWeights<1>  // mono
+    {
+        static constexpr std::array<double, 1> values{ { 1.0 } };
+    };
+    
+    template <> struct LayoutWeights<2>  // L R
+    {
+        static constexpr std::array<double, 2> values{ { 1.0, 1.0 } };
+    };
+    
+    template <> struct LayoutWeights<6>  // L R C LFE Ls Rs
+    {
+        static constexpr std::array<double, 6> values{ { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41 } };
+    };
+    
+    template <> struct LayoutWeights<8>  // L R C LFE Lss Rss Lrs Rrs
+    {
+        static constexpr std::array<double, 8> values{ { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41, 1.0, 1.0 } };
+    };
+    
+    template <> struct LayoutWeights<12> // L R C LFE Lss Rss Ltf Rtf Ltr Rtr Lrs Rrs
+    {
+        static constexpr std::array<double, 12> values{ { 1.0, 1.0, 1.0, 0.0, 1.41, 1.41,
+                                                          1.0, 1.0, 1.0, 1.0, 1.0, 1.0 } };
+    };
+    
+    // ITU-R BS.1770-4 Annex 2 polyphase interpolation filter (4 phases x 12 taps)
+    constexpr double truePeakCoeffs[4][12] =
+    {
+        {  0.0017089843750,  0.0109863281250, -0.0196533203125,  0.0332031250000,
+          -0.0594482421875,  0.1373291015625,  0.9721679687500, -0.1022949218750,
+           0.0476074218750, -0.0266113281250,  0.0148925781250, -0.0083007812500 },
+        { -0.0291748046875,  0.0292968750000, -0.0517578125000,  0.0891113281250,
+          -0.1665039062500,  0.4650878906250,  0.7797851562500, -0.2003173828125,
+           0.1015625000000, -0.0582275390625,  0.0330810546875, -0.0189208984375 },
+        { -0.0189208984375,  0.0330810546875, -0.0582275390625,  0.1015625000000,
+          -0.2003173828125,  0.7797851562500,  0.4650878906250, -0.1665039062500,
+           0.0891113281250, -0.0517578125000,  0.0292968750000, -0.0291748046875 },
+        { -0.0083007812500,  0.0148925781250, -0.0266113281250,  0.0476074218750,
+          -0.1022949218750,  0.9721679687500,  0.1373291015625, -0.0594482421875,
+           0.0332031250000, -0.0196533203125,  0.0109863281250,  0.0017089843750 }
+    };
+    
+    template <size_t N>
+    constexpr int countWeightedChannels(const std::array<double, N>& weights)
+    {
+        int count = 0;
+        for (size_t i = 0; i < N; ++i)
+            if (weights[i] != 0.0)
+                ++count;
+        return count;
+    }
+    
+    // Channel order for the lanes: weighted channels first, then zero-weight ones (LFE)
+    template <size_t N>
+    constexpr std::array<int, N> getLaneOrder(const std::array<double, N>& weights)
+    {
+        std::array<int, N> channels{};
+        size_t next = 0;
+        for (size_t i = 0; i < N; ++i)
+            if (weights[i] != 0.0)
+                channels[next++] = static_cast<int>(i);
+        for (size_t i = 0; i < N; ++i)
+            if (weights[i] == 0.0)
+                channels[next++] = static_cast<int>(i);
+        return channels;
+    }
+}
+
 EBU128LoudnessMeter::EBU128LoudnessMeter()
 {
-    meanSquareBlocks.fill(0.0);
-    channelWeights.fill(1.0);
+    configureWindows();
+    applyConfiguration(requestedConfig);
 }
 
-void EBU128LoudnessMeter::prepare(double sampleRate, int /*maxBlockSize*/, int channels)
+void EBU128LoudnessMeter::prepare(double sampleRate, int maxBlockSize, int channels)
 {
-    juce::ScopedLock sl(processLock);
+    requestedConfig.sampleRate = sampleRate;
+    requestedConfig.numChannels = channels;
     
-    currentSampleRate = sampleRate;
-    numChannels = std::min(channels, kMaxChannels);
+    // The audio thread is stopped here, so requests made before prepare() are dropped
+    configMiddleSlot.store(configMiddleSlot.load() & ~kConfigDirty);
+    resetRequested.store(false);
     
-    // Calculate filter coefficients for this sample rate
-    preFilterCoeffs = calculatePreFilterCoeffs(sampleRate);
-    rlbFilterCoeffs = calculateRLBCoeffs(sampleRate);
+    // Size everything for the shortest hop at the lowest sample rate, so any later
+    // configuration fits without reallocating
+    const int minSamplesPerHop = static_cast<int>(kMinSampleRate * kMinHopMilliseconds / 1000.0);
+    completedMeasurements.reserve(static_cast<size_t>(maxBlockSize / minSamplesPerHop + 2));
+    configureWindows();
     
-    // Samples per 100ms block
-    samplesPerBlock = static_cast<int>(sampleRate * 0.1);
+    applyConfiguration(requestedConfig);
+}
+
+void EBU128LoudnessMeter::reset()
+{
+    resetRequested.store(true, std::memory_order_release);
+}
+
+void EBU128LoudnessMeter::setFormat(double sampleRate, int channels)
+{
+    requestedConfig.sampleRate = sampleRate;
+    requestedConfig.numChannels = channels;
+    postConfiguration();
+}
+
+void EBU128LoudnessMeter::postConfiguration()
+{
+    configSlots[static_cast<size_t>(configBackSlot)] = requestedConfig;
+    configBackSlot = configMiddleSlot.exchange(configBackSlot | kConfigDirty, std::memory_order_acq_rel)
+                   & ~kConfigDirty;
+}
+
+void EBU128LoudnessMeter::restoreMeasurementState(const MeasurementState& state)
+{
+    requestedMeasurement = state;
+    
+    auto& slot = restoreSlots[static_cast<size_t>(restoreBackSlot)];
+    slot.state = state;
+    slot.serial = ++requestedRestoreSerial;
+    restoreBackSlot = restoreMiddleSlot.exchange(restoreBackSlot | kConfigDirty, std::memory_order_acq_rel)
+                    & ~kConfigDirty;
+}
+
+const EBU128LoudnessMeter::MeasurementState& EBU128LoudnessMeter::getMeasurementState()
+{
+    if (appliedRestoreSerial.load(std::memory_order_acquire) != requestedRestoreSerial)
+        return requestedMeasurement;
     
-    // Set channel weights per ITU-R BS.1770-4
-    // L, R, C = 1.0; LFE = 0.0; Ls, Rs = 1.41 (~+1.5 dB)
-    channelWeights.fill(1.0);
-    if (numChannels >= 4)
-        channelWeights[3] = 0.0; // LFE
-    if (numChannels >= 5)
-        channelWeights[4] = 1.41; // Ls
-    if (numChannels >= 6)
-        channelWeights[5] = 1.41; // Rs
+    if ((publishedMiddleSlot.load(std::memory_order_relaxed) & kConfigDirty) != 0)
+        publishedFrontSlot = publishedMiddleSlot.exchange(publishedFrontSlot, std::memory_order_acq_rel)
+                           & ~kConfigDirty;
     
-    reset();
+    // The peak changes every hop, so it is read directly rather than published
+    auto& state = publishedStates[static_cast<size_t>(publishedFrontSlot)];
+    state.maxTruePeak = maxTruePeak.load(std::memory_order_relaxed);
+    return state;
 }
 
-void EBU128LoudnessMeter::reset()
+void EBU128LoudnessMeter::publishMeasurementState()
 {
-    juce::ScopedLock sl(processLock);
+    auto& state = publishedStates[static_cast<size_t>(publishedBackSlot)];
+    state.gatingHistogram = gatingHistogram;
+    state.shortTermHistogram = shortTermHistogram;
+    publishedBackSlot = publishedMiddleSlot.exchange(publishedBackSlot | kConfigDirty, std::memory_order_acq_rel)
+                      & ~kConfigDirty;
+}
+
+void EBU128LoudnessMeter::applyPendingRequests()
+{
+    if ((configMiddleSlot.load(std::memory_order_relaxed) & kConfigDirty) != 0)
+    {
+        configFrontSlot = configMiddleSlot.exchange(configFrontSlot, std::memory_order_acq_rel) & ~kConfigDirty;
+        
+        // A new configuration always starts from a clean state
+        resetRequested.store(false, std::memory_order_relaxed);
+        applyConfiguration(configSlots[static_cast<size_t>(configFrontSlot)]);
+    }
+    else if (resetRequested.load(std::memory_order_relaxed)
+             && resetRequested.exchange(false, std::memory_order_acquire))
+    {
+        resetState();
+    }
     
+    // The filters and windows keep running; only the gated measurement is replaced
+    if ((restoreMiddleSlot.load(std::memory_order_relaxed) & kConfigDirty) != 0)
+    {
+        restoreFrontSlot = restoreMiddleSlot.exchange(restoreFrontSlot, std::memory_order_acq_rel) & ~kConfigDirty;
+        const auto& restore = restoreSlots[static_cast<size_t>(restoreFrontSlot)];
+        
+        gatingHistogram = restore.state.gatingHistogram;
+        shortTermHistogram = restore.state.shortTermHistogram;
+        maxTruePeak.store(restore.state.maxTruePeak, std::memory_order_relaxed);
+        updateIntegratedLoudness();
+        updateLoudnessRange();
+        
+        publishMeasurementState();
+        appliedRestoreSerial.store(restore.serial, std::memory_order_release);
+    }
+}
+
+void EBU128LoudnessMeter::applyConfiguration(const Configuration& config)
+{
+    currentSampleRate = config.sampleRate;
+    numChannels = juce::jlimit(1, kMaxChannels, config.numChannels);
+    numLaneGroups = (numChannels + kLanes - 1) / kLanes;
+    
+    // Common layouts get a kernel with the channel count and weights baked in
+    switch (numChannels)
+    {
+        case 1:  segmentProcessor = &EBU128LoudnessMeter::processSegmentForLayout<1>;  break;
+        case 2:  segmentProcessor = &EBU128LoudnessMeter::processSegmentForLayout<2>;  break;
+        case 6:  segmentProcessor = &EBU128LoudnessMeter::processSegmentForLayout<6>;  break;
+        case 8:  segmentProcessor = &EBU128LoudnessMeter::processSegmentForLayout<8>;  break;
+        case 12: segmentProcessor = &EBU128LoudnessMeter::processSegmentForLayout<12>; break;
+        default: segmentProcessor = &EBU128LoudnessMeter::processSegment;              break;
+    }
+    
+    // Calculate filter coefficients for this sample rate
+    preFilterCoeffs.setFrom(calculatePreFilterCoeffs(currentSampleRate));
+    rlbFilterCoeffs.setFrom(calculateRLBCoeffs(currentSampleRate));
+    
+    // Channel weights for the generic kernel; lanes without a channel get 0
+    for (int group = 0; group < kMaxLaneGroups; ++group)
+    {
+        for (int lane = 0; lane < kLanes; ++lane)
+        {
+            const int ch = group * kLanes + lane;
+            channelWeights[static_cast<size_t>(group)].set(static_cast<size_t>(lane),
+                                                           ch < numChannels ? getChannelWeight(ch) : 0.0);
+        }
+    }
+    
+    hopMilliseconds = config.hopMilliseconds;
+    applyHopLength();
+    
+    resetState();
+}
+
+void EBU128LoudnessMeter::resetState()
+{
     for (auto& state : preFilterStates)
-        state = BiquadState{};
+        state.reset();
     for (auto& state : rlbFilterStates)
-        state = BiquadState{};
+        state.reset();
+    for (auto& state : truePeakStates)
+        state.reset();
+    
+    hopWindows.reset();
+    currentHopSum = 0.0;
+    currentHopSamples = 0;
+    currentHopPeak = 0.0;
     
-    meanSquareBlocks.fill(0.0);
-    currentBlockIndex = 0;
-    currentBlockSum = 0.0;
-    currentBlockSamples = 0;
+    gatingHistogram.reset();
+    shortTermHistogram.reset();
+    completedHops = 0;
+    hopsSinceGatingStep = 0;
     
     momentaryLoudness.store(-100.0f, std::memory_order_relaxed);
     shortTermLoudness.store(-100.0f, std::memory_order_relaxed);
+    integratedLoudness.store(-100.0f, std::memory_order_relaxed);
+    loudnessRange.store(0.0f, std::memory_order_relaxed);
+    maxTruePeak.store(-100.0f, std::memory_order_relaxed);
+    
+    publishMeasurementState();
+}
+
+void EBU128LoudnessMeter::setUpdateInterval(int milliseconds)
+{
+    // Hops must divide the 100ms gating step evenly
+    static constexpr std::array<int, 4> supported{ { 10, 20, 50, 100 } };
+    
+    requestedConfig.hopMilliseconds = *std::min_element(supported.begin(), supported.end(), [milliseconds](int a, int b)
+    {
+        return std::abs(a - milliseconds) < std::abs(b - milliseconds);
+    });
+    
+    postConfiguration();
+}
+
+int EBU128LoudnessMeter::getSamplesPerHop(double sampleRate, int hopMilliseconds)
+{
+    return std::max(1, static_cast<int>(std::lround(sampleRate * hopMilliseconds / 1000.0)));
+}
+
+void EBU128LoudnessMeter::configureWindows()
+{
+    // Longest lengths any hop can need; applyHopLength() shortens them in place
+    hopWindows.clearWindows();
+    momentaryWindow = hopWindows.addWindow(kMomentaryMilliseconds / kMinHopMilliseconds);
+    shortTermWindow = hopWindows.addWindow(kShortTermMilliseconds / kMinHopMilliseconds);
+    hopWindows.prepare();
+}
+
+void EBU128LoudnessMeter::applyHopLength()
+{
+    samplesPerHop = getSamplesPerHop(currentSampleRate, hopMilliseconds);
+    
+    hopsPerMomentary = kMomentaryMilliseconds / hopMilliseconds;
+    hopsPerShortTerm = kShortTermMilliseconds / hopMilliseconds;
+    hopsPerGatingStep = kGatingStepMilliseconds / hopMilliseconds;
+    
+    hopWindows.setLength(momentaryWindow, hopsPerMomentary);
+    hopWindows.setLength(shortTermWindow, hopsPerShortTerm);
+}
+
+double EBU128LoudnessMeter::getChannelWeight(int channel)
+{
+    // ITU-R BS.1770-4: L, R, C = 1.0; LFE = 0.0; Ls, Rs = 1.41 (~+1.5 dB)
+    switch (channel)
+    {
+        case 3:  return 0.0;
+        case 4:
+        case 5:  return 1.41;
+        default: return 1.0;
+    }
 }
 
 EBU128LoudnessMeter::BiquadCoeffs EBU128LoudnessMeter::calculatePreFilterCoeffs(double sampleRate)
@@ -94,12 +347,17 @@ EBU128LoudnessMeter::BiquadCoeffs EBU128LoudnessMeter::calculateRLBCoeffs(double
     return coeffs;
 }
 
-float EBU128LoudnessMeter::processBiquad(float input, const BiquadCoeffs& coeffs, BiquadState& state)
+void EBU128LoudnessMeter::updateIntegratedLoudness()
 {
-    double output = coeffs.b0 * input + state.z1;
-    state.z1 = coeffs.b1 * input - coeffs.a1 * output + state.z2;
-    state.z2 = coeffs.b2 * input - coeffs.a2 * output;
-    return static_cast<float>(output);
+    integratedLoudness.store(calculateLoudness(gatingHistogram.getRelativeGatedMeanSquare(kRelativeGateLU)),
+                             std::memory_order_relaxed);
+}
+
+void EBU128LoudnessMeter::updateLoudnessRange()
+{
+    const double range = shortTermHistogram.getPercentileRange(kRangeRelativeGateLU, kRangeLowPercentile,
+                                                               kRangeHighPercentile);
+    loudnessRange.store(static_cast<float>(range), std::memory_order_relaxed);
 }
 
 float EBU128LoudnessMeter::calculateLoudness(double sumMeanSquare)
@@ -113,58 +371,212 @@ float EBU128LoudnessMeter::calculateLoudness(double sumMeanSquare)
 
 void EBU128LoudnessMeter::processBlock(const juce::AudioBuffer<float>& buffer)
 {
+    applyPendingRequests();
+    
     const int numSamples = buffer.getNumSamples();
     const int channels = std::min(buffer.getNumChannels(), numChannels);
+    const float* const* channelData = buffer.getArrayOfReadPointers();
+    
+    completedMeasurements.clear();
+    
+    // The specialised kernels need every channel of their layout to be present
+    const auto process = channels == numChannels ? segmentProcessor : &EBU128LoudnessMeter::processSegment;
+    
+    // Split the host buffer at hop boundaries so the inner loops never branch
+    int position = 0;
+    while (position < numSamples)
+    {
+        const int segmentLength = std::min(numSamples - position, samplesPerHop - currentHopSamples);
+        
+        currentHopSum += (this->*process)(channelData, channels, position, segmentLength);
+        currentHopSamples += segmentLength;
+        position += segmentLength;
+        
+        if (currentHopSamples >= samplesPerHop)
+            completeHop(position);
+    }
+}
+
+double EBU128LoudnessMeter::processSegment(const float* const* channelData, int channels,
+                                           int startSample, int numSamples)
+{
+    SIMDDouble weightedSum = SIMDDouble::expand(0.0);
+    SIMDDouble peak = SIMDDouble::expand(0.0);
+    alignas(16) double laneMask[kLanes];
+    
+    for (int group = 0; group < numLaneGroups && group * kLanes < channels; ++group)
+    {
+        // Lanes without an input channel re-read the group's first channel; their energy is
+        // masked out and the duplicate cannot raise the peak
+        const float* lanes[kLanes];
+        for (int lane = 0; lane < kLanes; ++lane)
+        {
+            const int ch = group * kLanes + lane;
+            const bool present = ch < channels;
+            lanes[lane] = channelData[present ? ch : group * kLanes] + startSample;
+            laneMask[lane] = present ? 1.0 : 0.0;
+        }
+        
+        const auto g = static_cast<size_t>(group);
+        SIMDDouble energy = processLaneGroup(lanes, numSamples, g, peak);
+        
+        // Channel weights are applied once per segment rather than per sample
+        weightedSum += channelWeights[g] * SIMDDouble::fromRawArray(laneMask) * energy;
+    }
+    
+    updateHopPeak(peak);
+    return weightedSum.sum();
+}
+
+template <int NumChannels>
+double EBU128LoudnessMeter::processSegmentForLayout(const float* const* channelData, int /*channels*/,
+                                                    int startSample, int numSamples)
+{
+    constexpr auto& weights = LayoutWeights<NumChannels>::values;
+    constexpr int numWeighted = countWeightedChannels(weights);
+    constexpr auto laneOrder = getLaneOrder(weights);
+    constexpr int numGroups = (NumChannels + kLanes - 1) / kLanes;
+    static_assert(numGroups <= kMaxLaneGroups, "Layout exceeds the filter state capacity");
+    
+    double weightedSum = 0.0;
+    SIMDDouble peak = SIMDDouble::expand(0.0);
+    alignas(16) double laneEnergy[kLanes];
+    
+    for (int group = 0; group < numGroups; ++group)
+    {
+        // A short last group repeats its first lane, which cannot change the peak
+        const float* lanes[kLanes];
+        for (int lane = 0; lane < kLanes; ++lane)
+        {
+            const int slot = group * kLanes + lane;
+            lanes[lane] = channelData[laneOrder[static_cast<size_t>(slot < NumChannels ? slot : group * kLanes)]]
+                          + startSample;
+        }
+        
+        processLaneGroup(lanes, numSamples, static_cast<size_t>(group), peak).copyToRawArray(laneEnergy);
+        
+        // Only weighted slots contribute energy; the rest are resolved at compile time
+        for (int lane = 0; lane < kLanes; ++lane)
+        {
+            const int slot = group * kLanes + lane;
+            if (slot < numWeighted)
+                weightedSum += weights[static_cast<size_t>(laneOrder[static_cast<size_t>(slot)])] * laneEnergy[lane];
+        }
+    }
+    
+    updateHopPeak(peak);
+    return weightedSum;
+}
+
+EBU128LoudnessMeter::SIMDDouble EBU128LoudnessMeter::processLaneGroup(const float* const* lanes, int numSamples,
+                                                                      size_t group, SIMDDouble& peak)
+{
+    SIMDBiquadState preState = preFilterStates[group];
+    SIMDBiquadState rlbState = rlbFilterStates[group];
+    TruePeakState tpState = truePeakStates[group];
+    SIMDDouble energy = SIMDDouble::expand(0.0);
+    const SIMDDouble zero = SIMDDouble::expand(0.0);
+    alignas(16) double frame[kLanes];
     
     for (int sample = 0; sample < numSamples; ++sample)
     {
-        double sampleSum = 0.0;
+        for (int lane = 0; lane < kLanes; ++lane)
+            frame[lane] = static_cast<double>(lanes[lane][sample]);
+        
+        const SIMDDouble input = SIMDDouble::fromRawArray(frame);
+        
+        // Apply K-weighting filters
+        SIMDDouble preFiltered = processBiquad(input, preFilterCoeffs, preState);
+        SIMDDouble kWeighted = processBiquad(preFiltered, rlbFilterCoeffs, rlbState);
+        
+        energy += kWeighted * kWeighted;
         
-        for (int ch = 0; ch < channels; ++ch)
+        // 4x oversampled peak: evaluate every polyphase branch over the last 12 inputs
+        const auto head = static_cast<size_t>(tpState.head);
+        tpState.history[head] = input;
+        tpState.history[head + kTruePeakTaps] = input;
+        const SIMDDouble* taps = tpState.history.data() + head + 1;
+        
+        for (int phase = 0; phase < kTruePeakPhases; ++phase)
         {
-            float input = buffer.getSample(ch, sample);
-            
-            // Apply K-weighting filters
-            float preFiltered = processBiquad(input, preFilterCoeffs, preFilterStates[ch]);
-            float kWeighted = processBiquad(preFiltered, rlbFilterCoeffs, rlbFilterStates[ch]);
+            SIMDDouble interpolated = zero;
+            for (int tap = 0; tap < kTruePeakTaps; ++tap)
+                interpolated += taps[tap] * truePeakCoeffs[phase][tap];
             
-            // Accumulate weighted squared sample
-            sampleSum += channelWeights[ch] * kWeighted * kWeighted;
+            peak = SIMDDouble::max(peak, SIMDDouble::max(interpolated, zero - interpolated));
         }
         
-        currentBlockSum += sampleSum;
-        currentBlockSamples++;
+        tpState.head = tpState.head + 1 < kTruePeakTaps ? tpState.head + 1 : 0;
+    }
+    
+    preFilterStates[group] = preState;
+    rlbFilterStates[group] = rlbState;
+    truePeakStates[group] = tpState;
+    
+    return energy;
+}
+
+void EBU128LoudnessMeter::updateHopPeak(SIMDDouble peak)
+{
+    alignas(16) double lanePeaks[kLanes];
+    peak.copyToRawArray(lanePeaks);
+    
+    for (int lane = 0; lane < kLanes; ++lane)
+        currentHopPeak = std::max(currentHopPeak, lanePeaks[lane]);
+}
+
+void EBU128LoudnessMeter::completeHop(int endSample)
+{
+    // Push this hop's mean square into every sliding window
+    hopWindows.push(currentHopSum / currentHopSamples);
+    
+    // Report this hop's true peak
+    const auto hopTruePeak = juce::Decibels::gainToDecibels(static_cast<float>(currentHopPeak), -100.0f);
+    if (hopTruePeak > maxTruePeak.load(std::memory_order_relaxed))
+        maxTruePeak.store(hopTruePeak, std::memory_order_relaxed);
+    
+    // Reset accumulator
+    currentHopSum = 0.0;
+    currentHopSamples = 0;
+    currentHopPeak = 0.0;
+    
+    // Momentary loudness (last 400ms)
+    const double momentaryMeanSquare = hopWindows.getMean(momentaryWindow);
+    momentaryLoudness.store(calculateLoudness(momentaryMeanSquare), std::memory_order_relaxed);
+    
+    // Short-term loudness (last 3s)
+    const double shortTermMeanSquare = hopWindows.getMean(shortTermWindow);
+    shortTermLoudness.store(calculateLoudness(shortTermMeanSquare), std::memory_order_relaxed);
+    
+    completedHops = std::min(completedHops + 1, hopsPerShortTerm);
+    
+    // Gating blocks and LRA inputs stay on the 100ms grid whatever the hop
+    if (++hopsSinceGatingStep >= hopsPerGatingStep)
+    {
+        hopsSinceGatingStep = 0;
         
-        // Check if we've completed a 100ms block
-        if (currentBlockSamples >= samplesPerBlock)
+        // Each full 400ms momentary window is one gating block for integrated loudness
+        if (completedHops >= hopsPerMomentary)
         {
-            // Store mean square for this block
-            double meanSquare = currentBlockSum / currentBlockSamples;
-            meanSquareBlocks[currentBlockIndex] = meanSquare;
-            currentBlockIndex = (currentBlockIndex + 1) % kBlocksPerShortTerm;
-            
-            // Reset accumulator
-            currentBlockSum = 0.0;
-            currentBlockSamples = 0;
-            
-            // Calculate Momentary loudness (last 400ms = 4 blocks)
-            double momentarySum = 0.0;
-            for (int i = 0; i < kBlocksPerMomentary; ++i)
-            {
-                int idx = (currentBlockIndex - 1 - i + kBlocksPerShortTerm) % kBlocksPerShortTerm;
-                momentarySum += meanSquareBlocks[idx];
-            }
-            momentaryLoudness.store(calculateLoudness(momentarySum / kBlocksPerMomentary), 
-                                   std::memory_order_relaxed);
-            
-            // Calculate Short-term loudness (last 3s = 30 blocks)
-            double shortTermSum = 0.0;
-            for (int i = 0; i < kBlocksPerShortTerm; ++i)
-            {
-                shortTermSum += meanSquareBlocks[i];
-            }
-            shortTermLoudness.store(calculateLoudness(shortTermSum / kBlocksPerShortTerm), 
-                                   std::memory_order_relaxed);
+            gatingHistogram.addBlock(momentaryMeanSquare);
+            updateIntegratedLoudness();
+        }
+        
+        // Only full 3s windows contribute to the loudness range
+        if (completedHops == hopsPerShortTerm)
+        {
+            shortTermHistogram.addBlock(shortTermMeanSquare);
+            updateLoudnessRange();
         }
+        
+        if (completedHops >= hopsPerMomentary)
+            publishMeasurementState();
     }
-}
\ No newline at end of file
+    
+    if (completedMeasurements.size() < completedMeasurements.capacity())
+    {
+        completedMeasurements.push_back({ momentaryLoudness.load(std::memory_order_relaxed),
+                                          shortTermLoudness.load(std::memory_order_relaxed),
+                                          hopTruePeak, endSample });
+    }
+}
@@ -2,8 +2,11 @@
 
 #include <juce_audio_processors/juce_audio_processors.h>
 #include <juce_dsp/juce_dsp.h>
+#include "LoudnessHistogram.h"
+#include "SlidingWindowSums.h"
 #include <array>
 #include <atomic>
+#include <vector>
 
 /**
  * EBU R128 Loudness Meter with true K-weighting
@@ -11,6 +14,20 @@
  * Implements the two-stage K-weighting filter:
  * 1. Pre-filter (shelving): High-frequency boost to account for acoustic effects of the head
  * 2. RLB (Revised Low-frequency B-curve): High-pass to reduce low frequency content
+ *
+ * Channels are filtered in SIMD lanes: channel ch lives in lane (ch % kLanes) of
+ * lane group (ch / kLanes), so stereo fills one register and 5.1/7.1 fill three/four.
+ * Mono, stereo, 5.1, 7.1 and 7.1.4 use a kernel specialised at compile time, where
+ * the LFE only fills what would otherwise be a padding lane and its energy is never
+ * accumulated; other channel counts use the generic kernel.
+ *
+ * True peak (BS.1770-4 Annex 2) is measured in the same pass with a 4x polyphase FIR
+ * interpolator running on the unfiltered input lanes.
+ *
+ * prepare() is the only call that allocates and must not overlap processBlock().
+ * reset(), setUpdateInterval() and setFormat() may be called from the message thread
+ * at any time: they only post a request, which the audio thread applies at the start
+ * of its next block without locking or allocating.
  */
 class EBU128LoudnessMeter
 {
@@ -19,14 +36,66 @@ public:
     ~EBU128LoudnessMeter() = default;
 
     void prepare(double sampleRate, int maxBlockSize, int numChannels);
+    
+    // Clear all measurements (applied at the start of the next block)
     void reset();
+
+    // Update hop for momentary/short-term values: 10, 20, 50 or 100 ms (other values
+    // are rounded to the nearest). Applied, with a reset, at the start of the next block.
+    void setUpdateInterval(int milliseconds);
+    int getUpdateInterval() const { return requestedConfig.hopMilliseconds; }
+    
+    // Length of an update hop in whole samples. Hops are always this long, so anything
+    // placing them in time must use it rather than the nominal interval.
+    static int getSamplesPerHop(double sampleRate, int hopMilliseconds);
+    
+    // Switch sample rate or channel count (up to 12) without a new prepare();
+    // applied, with a reset, at the start of the next block
+    void setFormat(double sampleRate, int numChannels);
+
     void processBlock(const juce::AudioBuffer<float>& buffer);
 
+    // Values of one finished update hop
+    struct Measurement
+    {
+        float momentary{-100.0f};
+        float shortTerm{-100.0f};
+        float truePeak{-100.0f};   // max dBTP within the hop
+        int endSample{0};          // position in the block where the hop ended
+    };
+
+    // Hops finished during the last processBlock call (audio thread only)
+    const std::vector<Measurement>& getCompletedMeasurements() const { return completedMeasurements; }
+    
+    // Length in samples, and rate, of the hops as of the last processBlock call, after
+    // any interval or format change it applied (audio thread only)
+    int getHopLength() const { return samplesPerHop; }
+    double getHopRate() const { return currentSampleRate / samplesPerHop; }
+
     // Thread-safe getters (called from UI thread)
     float getMomentaryLoudness() const { return momentaryLoudness.load(std::memory_order_relaxed); }
     float getShortTermLoudness() const { return shortTermLoudness.load(std::memory_order_relaxed); }
+    float getIntegratedLoudness() const { return integratedLoudness.load(std::memory_order_relaxed); }
+    float getLoudnessRange() const { return loudnessRange.load(std::memory_order_relaxed); }
+    float getMaxTruePeak() const { return maxTruePeak.load(std::memory_order_relaxed); }
+
+    // Everything integrated loudness, loudness range and max true peak are built from,
+    // so a measurement can be saved with the plugin state and continued later
+    struct MeasurementState
+    {
+        LoudnessHistogram gatingHistogram;
+        LoudnessHistogram shortTermHistogram;
+        float maxTruePeak{-100.0f};
+    };
+    
+    // Latest state from the audio thread (published every 100ms gating step), or the
+    // restored one while it waits for the next block. Message thread only; never waits.
+    const MeasurementState& getMeasurementState();
+    
+    // Continue from a saved measurement; applied at the start of the next block, after
+    // any configuration change posted before it. Survives prepare().
+    void restoreMeasurementState(const MeasurementState& state);
 
-private:
     // K-weighting filter coefficients
     struct BiquadCoeffs
     {
@@ -34,55 +103,228 @@ private:
         double a1{0.0}, a2{0.0};
     };
 
-    struct BiquadState
+    // Calculate pre-filter coefficients (high shelf)
+    static BiquadCoeffs calculatePreFilterCoeffs(double sampleRate);
+    
+    // Calculate RLB filter coefficients (high pass)
+    static BiquadCoeffs calculateRLBCoeffs(double sampleRate);
+    
+    // BS.1770 weight of a channel in the generic (L R C LFE Ls Rs ...) order
+    static double getChannelWeight(int channel);
+
+private:
+    using SIMDDouble = juce::dsp::SIMDRegister<double>;
+    static constexpr int kLanes = static_cast<int>(SIMDDouble::SIMDNumElements);
+    
+    // Everything that can be reconfigured while the audio thread is running
+    struct Configuration
     {
-        double z1{0.0}, z2{0.0};
+        double sampleRate{48000.0};
+        int numChannels{2};
+        int hopMilliseconds{100};
     };
 
-    // Calculate pre-filter coefficients (high shelf)
-    BiquadCoeffs calculatePreFilterCoeffs(double sampleRate);
+    // Coefficients broadcast to every lane
+    struct SIMDBiquadCoeffs
+    {
+        SIMDDouble b0, b1, b2, a1, a2;
+
+        void setFrom(const BiquadCoeffs& c)
+        {
+            b0 = SIMDDouble::expand(c.b0);
+            b1 = SIMDDouble::expand(c.b1);
+            b2 = SIMDDouble::expand(c.b2);
+            a1 = SIMDDouble::expand(c.a1);
+            a2 = SIMDDouble::expand(c.a2);
+        }
+    };
+
+    // Filter state for one lane group (kLanes channels)
+    struct SIMDBiquadState
+    {
+        SIMDDouble z1, z2;
+
+        void reset()
+        {
+            z1 = SIMDDouble::expand(0.0);
+            z2 = SIMDDouble::expand(0.0);
+        }
+    };
+
+    // True-peak interpolator history for one lane group. Every sample is written twice
+    // so the newest kTruePeakTaps samples are always contiguous from history[head + 1].
+    static constexpr int kTruePeakPhases = 4;
+    static constexpr int kTruePeakTaps = 12;
+
+    struct TruePeakState
+    {
+        std::array<SIMDDouble, 2 * kTruePeakTaps> history;
+        int head{0};
+
+        void reset()
+        {
+            history.fill(SIMDDouble::expand(0.0));
+            head = 0;
+        }
+    };
+
+    // Process one sample per lane through a biquad filter (transposed direct form II)
+    static SIMDDouble processBiquad(SIMDDouble input, const SIMDBiquadCoeffs& coeffs,
+                                    SIMDBiquadState& state)
+    {
+        SIMDDouble output = coeffs.b0 * input + state.z1;
+        state.z1 = coeffs.b1 * input - coeffs.a1 * output + state.z2;
+        state.z2 = coeffs.b2 * input - coeffs.a2 * output;
+        return output;
+    }
     
-    // Calculate RLB filter coefficients (high pass)
-    BiquadCoeffs calculateRLBCoeffs(double sampleRate);
+    // Filter numSamples samples of every channel; returns the weighted sum of squares
+    // and folds the segment's sample peak into currentHopPeak
+    double processSegment(const float* const* channelData, int channels, int startSample, int numSamples);
+    
+    // Same as processSegment for a fixed layout with compile-time weights
+    template <int NumChannels>
+    double processSegmentForLayout(const float* const* channelData, int channels, int startSample, int numSamples);
+    
+    // Run one lane group's K-weighting filters and true-peak interpolator;
+    // returns the per-lane sum of squares and raises peak to the per-lane true peak
+    SIMDDouble processLaneGroup(const float* const* lanes, int numSamples, size_t group, SIMDDouble& peak);
+    
+    // Fold a segment's per-lane peak into currentHopPeak
+    void updateHopPeak(SIMDDouble peak);
+    
+    using SegmentProcessor = double (EBU128LoudnessMeter::*)(const float* const*, int, int, int);
+    
+    // Close the current hop, ending at endSample of the block, and update momentary/short-term
+    // (and, every 100ms, integrated/LRA)
+    void completeHop(int endSample);
+    
+    // Rebuild the sliding windows for the shortest hop (allocates; never called from processBlock)
+    void configureWindows();
     
-    // Process sample through biquad filter
-    float processBiquad(float input, const BiquadCoeffs& coeffs, BiquadState& state);
+    // Audio-thread side of the requests: switch kernels, coefficients and hop length
+    // inside the preallocated storage, and clear all state
+    void applyPendingRequests();
+    void applyConfiguration(const Configuration& config);
+    void applyHopLength();
+    void resetState();
+    
+    // Hand requestedConfig to the audio thread (message thread only)
+    void postConfiguration();
+    
+    // Hand the histograms to the message thread (audio thread, or while it is stopped)
+    void publishMeasurementState();
+    
+    // Re-gate the histograms and publish integrated loudness / loudness range
+    void updateIntegratedLoudness();
+    void updateLoudnessRange();
     
     // Calculate loudness from mean square values
     float calculateLoudness(double sumMeanSquare);
 
     double currentSampleRate{48000.0};
     int numChannels{2};
+    int numLaneGroups{1};
     
     // Filter coefficients (same for all channels)
-    BiquadCoeffs preFilterCoeffs;
-    BiquadCoeffs rlbFilterCoeffs;
+    SIMDBiquadCoeffs preFilterCoeffs;
+    SIMDBiquadCoeffs rlbFilterCoeffs;
+    
+    // Filter states per lane group (max 12 channels for 7.1.4)
+    static constexpr int kMaxChannels = 12;
+    static constexpr int kMaxLaneGroups = (kMaxChannels + kLanes - 1) / kLanes;
+    std::array<SIMDBiquadState, kMaxLaneGroups> preFilterStates;
+    std::array<SIMDBiquadState, kMaxLaneGroups> rlbFilterStates;
+    std::array<TruePeakState, kMaxLaneGroups> truePeakStates;
+    
+    // Channel weights per ITU-R BS.1770 (zero for unused lanes)
+    std::array<SIMDDouble, kMaxLaneGroups> channelWeights;
+    
+    // Kernel selected in prepare() for the current channel count
+    SegmentProcessor segmentProcessor{&EBU128LoudnessMeter::processSegment};
+    
+    // Running sums over the per-hop mean squares, so a finer hop only adds partial
+    // sums and never re-integrates a whole window:
+    // 400ms for momentary, 3s for short-term, both updated every hop
+    static constexpr int kMomentaryMilliseconds = 400;
+    static constexpr int kShortTermMilliseconds = 3000;
+    static constexpr int kGatingStepMilliseconds = 100; // BS.1770 gating blocks overlap by 75%
+    
+    static constexpr int kMinHopMilliseconds = 10;
+    static constexpr double kMinSampleRate = 8000.0;
     
-    // Filter states per channel (max 8 channels)
-    static constexpr int kMaxChannels = 8;
-    std::array<BiquadState, kMaxChannels> preFilterStates;
-    std::array<BiquadState, kMaxChannels> rlbFilterStates;
+    int hopMilliseconds{100};
+    int hopsPerMomentary{4};
+    int hopsPerShortTerm{30};
+    int hopsPerGatingStep{1};
     
-    // Channel weights per ITU-R BS.1770
-    std::array<double, kMaxChannels> channelWeights;
+    SlidingWindowSums hopWindows;
+    int momentaryWindow{0};
+    int shortTermWindow{0};
     
-    // Ring buffers for gated measurements
-    // 400ms blocks for momentary (updated every 100ms with 75% overlap)
-    // 3s for short-term (updated every 100ms)
-    static constexpr int kBlocksPerMomentary = 4;   // 400ms = 4 x 100ms blocks
-    static constexpr int kBlocksPerShortTerm = 30;  // 3s = 30 x 100ms blocks
+    // Accumulator for the current hop
+    double currentHopSum{0.0};
+    int currentHopSamples{0};
+    int samplesPerHop{4800}; // 100ms at 48kHz
+    double currentHopPeak{0.0}; // linear true peak of the current hop
     
-    std::array<double, kBlocksPerShortTerm> meanSquareBlocks;
-    int currentBlockIndex{0};
+    // Preallocated in prepare() for the shortest hop at the lowest sample rate,
+    // so completeHop() never allocates whatever configuration is applied later
+    std::vector<Measurement> completedMeasurements;
     
-    // Accumulator for current 100ms block
-    double currentBlockSum{0.0};
-    int currentBlockSamples{0};
-    int samplesPerBlock{4800}; // 100ms at 48kHz
+    // Integrated loudness per BS.1770: the 400ms momentary window every 100ms is a gating block,
+    // gated at -70 LUFS absolute and -10 LU relative to the absolute-gated level
+    static constexpr double kRelativeGateLU = -10.0;
+    LoudnessHistogram gatingHistogram;
+    
+    // Loudness range per EBU Tech 3342: distribution of the 3s short-term values,
+    // gated at -70 LUFS absolute and -20 LU relative, from the 10th to 95th percentile
+    static constexpr double kRangeRelativeGateLU = -20.0;
+    static constexpr double kRangeLowPercentile = 0.10;
+    static constexpr double kRangeHighPercentile = 0.95;
+    LoudnessHistogram shortTermHistogram;
+    
+    // Hops completed since reset (saturates once the short-term window is full)
+    int completedHops{0};
+    int hopsSinceGatingStep{0};
     
     // Output values (atomic for thread safety)
     std::atomic<float> momentaryLoudness{-100.0f};
     std::atomic<float> shortTermLoudness{-100.0f};
+    std::atomic<float> integratedLoudness{-100.0f};
+    std::atomic<float> loudnessRange{0.0f};
+    std::atomic<float> maxTruePeak{-100.0f};
+    
+    // Requests from the message thread. Configurations go through a triple buffer: the
+    // writer fills its back slot and swaps it into the middle, and the audio thread swaps
+    // the middle into its front slot when the dirty bit is set, so the newest request is
+    // never lost and neither side waits.
+    static constexpr int kConfigDirty = 4;
+    Configuration requestedConfig;                    // message thread
+    std::array<Configuration, 3> configSlots;
+    int configBackSlot{0};                            // message thread
+    int configFrontSlot{1};                           // audio thread
+    std::atomic<int> configMiddleSlot{2};
+    std::atomic<bool> resetRequested{false};
+    
+    // Measurement state crosses the threads through two more triple buffers, one each
+    // way. A restore carries a serial, so the message thread knows once it has been applied.
+    struct PendingRestore
+    {
+        MeasurementState state;
+        uint32_t serial{0};
+    };
+    
+    std::array<MeasurementState, 3> publishedStates;
+    int publishedBackSlot{0};                         // audio thread
+    int publishedFrontSlot{1};                        // message thread
+    std::atomic<int> publishedMiddleSlot{2};
     
-    juce::CriticalSection processLock;
+    MeasurementState requestedMeasurement;            // message thread
+    uint32_t requestedRestoreSerial{0};               // message thread
+    std::array<PendingRestore, 3> restoreSlots;
+    int restoreBackSlot{0};                           // message thread
+    int restoreFrontSlot{1};                          // audio thread
+    std::atomic<int> restoreMiddleSlot{2};
+    std::atomic<uint32_t> appliedRestoreSerial{0};
 };
\ No newline at end of file
@@ -0,0 +1,150 @@
+#include "LoudnessHistogram.h"
+#include <algorithm>
+#include <cmath>
+
+LoudnessHistogram::LoudnessHistogram()
+{
+    reset();
+}
+
+void LoudnessHistogram::reset()
+{
+    counts.fill(0);
+    energies.fill(0.0);
+    totalCount = 0;
+}
+
+void LoudnessHistogram::writeTo(juce::OutputStream& out) const
+{
+    const auto numUsed = std::count_if(counts.begin(), counts.end(), [](uint64_t count) { return count > 0; });
+    out.writeCompressedInt(static_cast<int>(numUsed));
+
+    for (size_t bin = 0; bin < counts.size(); ++bin)
+    {
+        if (counts[bin] == 0)
+            continue;
+
+        out.writeCompressedInt(static_cast<int>(bin));
+        out.writeInt64(static_cast<juce::int64>(counts[bin]));
+        out.writeDouble(energies[bin]);
+    }
+}
+
+bool LoudnessHistogram::readFrom(juce::InputStream& in)
+{
+    reset();
+
+    const int numUsed = in.readCompressedInt();
+    if (numUsed < 0 || numUsed > kNumBins)
+        return false;
+
+    for (int i = 0; i < numUsed; ++i)
+    {
+        const int bin = in.readCompressedInt();
+        const auto count = in.readInt64();
+        const double energy = in.readDouble();
+
+        // A truncated stream reads as zeros, which fails the count and energy checks
+        if (bin < 0 || bin >= kNumBins || count <= 0 || !(energy > 0.0))
+        {
+            reset();
+            return false;
+        }
+
+        counts[static_cast<size_t>(bin)] = static_cast<uint64_t>(count);
+        energies[static_cast<size_t>(bin)] = energy;
+        totalCount += static_cast<uint64_t>(count);
+    }
+
+    return true;
+}
+
+double LoudnessHistogram::meanSquareToLufs(double meanSquare)
+{
+    return -0.691 + 10.0 * std::log10(meanSquare);
+}
+
+double LoudnessHistogram::lufsToMeanSquare(double lufs)
+{
+    return std::pow(10.0, (lufs + 0.691) / 10.0);
+}
+
+int LoudnessHistogram::getBinForLoudness(double lufs)
+{
+    const int bin = static_cast<int>(std::floor((lufs - kAbsoluteGateLufs) * kBinsPerLU));
+    return std::clamp(bin, 0, kNumBins - 1);
+}
+
+void LoudnessHistogram::addBlock(double meanSquare)
+{
+    if (meanSquare <= 0.0)
+        return;
+
+    const double lufs = meanSquareToLufs(meanSquare);
+    if (lufs < kAbsoluteGateLufs)
+        return;
+
+    const auto bin = static_cast<size_t>(getBinForLoudness(lufs));
+    counts[bin]++;
+    energies[bin] += meanSquare;
+    totalCount++;
+}
+
+double LoudnessHistogram::getGatedMeanSquare(double thresholdLufs) const
+{
+    uint64_t count = 0;
+    double energy = 0.0;
+
+    for (int bin = getBinForLoudness(thresholdLufs); bin < kNumBins; ++bin)
+    {
+        count += counts[static_cast<size_t>(bin)];
+        energy += energies[static_cast<size_t>(bin)];
+    }
+
+    return count > 0 ? energy / static_cast<double>(count) : 0.0;
+}
+
+double LoudnessHistogram::getPercentile(double thresholdLufs, double fraction) const
+{
+    const int firstBin = getBinForLoudness(thresholdLufs);
+
+    uint64_t count = 0;
+    for (int bin = firstBin; bin < kNumBins; ++bin)
+        count += counts[static_cast<size_t>(bin)];
+
+    if (count == 0)
+        return kAbsoluteGateLufs;
+
+    // Nearest-rank percentile over the gated blocks, reported at the bin centre
+    const double rank = std::ceil(std::clamp(fraction, 0.0, 1.0) * static_cast<double>(count));
+    const uint64_t target = std::max<uint64_t>(static_cast<uint64_t>(rank), 1);
+    uint64_t seen = 0;
+
+    for (int bin = firstBin; bin < kNumBins; ++bin)
+    {
+        seen += counts[static_cast<size_t>(bin)];
+        if (seen >= target)
+            return kAbsoluteGateLufs + (bin + 0.5) / kBinsPerLU;
+    }
+
+    return kMaxLufs;
+}
+
+double LoudnessHistogram::getRelativeGatedMeanSquare(double relativeGateLU) const
+{
+    const double absoluteGated = getGatedMeanSquare(kAbsoluteGateLufs);
+    if (absoluteGated <= 0.0)
+        return 0.0;
+
+    return getGatedMeanSquare(meanSquareToLufs(absoluteGated) + relativeGateLU);
+}
+
+double LoudnessHistogram::getPercentileRange(double relativeGateLU, double lowFraction, double highFraction) const
+{
+    const double absoluteGated = getGatedMeanSquare(kAbsoluteGateLufs);
+    if (absoluteGated <= 0.0)
+        return 0.0;
+
+    const double relativeGate = meanSquareToLufs(absoluteGated) + relativeGateLU;
+    return getPercentile(relativeGate, highFraction) - getPercentile(relativeGate, lowFraction);
+}
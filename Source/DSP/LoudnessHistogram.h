@@ -0,0 +1,62 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <array>
+#include <cstdint>
+
+/**
+ * Fixed-size loudness histogram for gated BS.1770 / EBU Tech 3342 measurements
+ *
+ * Blocks are binned by loudness in 0.1 LU steps from the -70 LUFS absolute gate up to
+ * +30 LUFS. Each bin keeps its block count and summed energy, so gated means are exact
+ * apart from blocks that fall in the same 0.1 LU bin as the gate. Memory and update cost
+ * are constant no matter how long the measurement runs.
+ */
+class LoudnessHistogram
+{
+public:
+    static constexpr double kAbsoluteGateLufs = -70.0;
+
+    LoudnessHistogram();
+
+    void reset();
+
+    // Add a block by its mean square energy; blocks below the absolute gate are ignored
+    void addBlock(double meanSquare);
+
+    uint64_t getNumBlocks() const { return totalCount; }
+
+    // Mean energy of all blocks at or above thresholdLufs (0 if there are none)
+    double getGatedMeanSquare(double thresholdLufs) const;
+
+    // Loudness at the given fraction (0..1) of the blocks at or above thresholdLufs
+    double getPercentile(double thresholdLufs, double fraction) const;
+
+    // Mean energy after the absolute gate and a relative gate relativeGateLU below the
+    // absolute-gated level, as for BS.1770 integrated loudness (0 if there are no blocks)
+    double getRelativeGatedMeanSquare(double relativeGateLU) const;
+
+    // Spread in LU between two percentiles of the relatively gated blocks, as for the
+    // EBU Tech 3342 loudness range (0 if there are no blocks)
+    double getPercentileRange(double relativeGateLU, double lowFraction, double highFraction) const;
+
+    // Non-empty bins only, so a programme of any length takes a few KB. readFrom()
+    // replaces the contents and leaves the histogram empty if the data doesn't fit.
+    void writeTo(juce::OutputStream& out) const;
+    bool readFrom(juce::InputStream& in);
+
+    static double meanSquareToLufs(double meanSquare);
+    static double lufsToMeanSquare(double lufs);
+
+private:
+    static constexpr double kMaxLufs = 30.0;
+    static constexpr int kBinsPerLU = 10;
+    static constexpr int kNumBins = static_cast<int>((kMaxLufs - kAbsoluteGateLufs) * kBinsPerLU);
+
+    static int getBinForLoudness(double lufs);
+
+    std::array<uint64_t, kNumBins> counts;
+    std::array<double, kNumBins> energies;
+
+    uint64_t totalCount{0};
+};
@@ -0,0 +1,294 @@
+#include "LoudnessMeterBank.h"
+#include "EBU128LoudnessMeter.h"
+#include <cmath>
+
+void LoudnessMeterBank::prepare(double sampleRate, int streams, int channels)
+{
+    numStreams = std::max(0, streams);
+    channelsPerStream = std::max(1, channels);
+    numLaneGroups = (numStreams + kLanes - 1) / kLanes;
+    samplesPerHop = EBU128LoudnessMeter::getSamplesPerHop(sampleRate, kHopMilliseconds);
+
+    // Same K-weighting and channel weights as the single-stream meter
+    const auto pre = EBU128LoudnessMeter::calculatePreFilterCoeffs(sampleRate);
+    const auto rlb = EBU128LoudnessMeter::calculateRLBCoeffs(sampleRate);
+    coeffs.preB0 = SIMDDouble::expand(pre.b0);
+    coeffs.preB1 = SIMDDouble::expand(pre.b1);
+    coeffs.preB2 = SIMDDouble::expand(pre.b2);
+    coeffs.preA1 = SIMDDouble::expand(pre.a1);
+    coeffs.preA2 = SIMDDouble::expand(pre.a2);
+    coeffs.rlbB0 = SIMDDouble::expand(rlb.b0);
+    coeffs.rlbB1 = SIMDDouble::expand(rlb.b1);
+    coeffs.rlbB2 = SIMDDouble::expand(rlb.b2);
+    coeffs.rlbA1 = SIMDDouble::expand(rlb.a1);
+    coeffs.rlbA2 = SIMDDouble::expand(rlb.a2);
+
+    channelWeights.resize(static_cast<size_t>(channelsPerStream));
+    for (int ch = 0; ch < channelsPerStream; ++ch)
+        channelWeights[static_cast<size_t>(ch)] = EBU128LoudnessMeter::getChannelWeight(ch);
+
+    const auto groups = static_cast<size_t>(numLaneGroups);
+    filterStates.resize(groups * static_cast<size_t>(channelsPerStream));
+    hopSums.resize(groups);
+    momentarySums.resize(groups);
+    shortTermSums.resize(groups);
+
+    size_t historySlots = 1;
+    while (historySlots <= static_cast<size_t>(kHopsPerShortTerm))
+        historySlots <<= 1;
+    hopHistory.resize(historySlots * groups);
+    historyMask = historySlots - 1;
+
+    gatingHistograms.resize(static_cast<size_t>(numStreams));
+    shortTermHistograms.resize(static_cast<size_t>(numStreams));
+    results.reset(new StreamResults[static_cast<size_t>(numStreams)]);
+
+    resetRequested.store(false);
+    resetState();
+}
+
+void LoudnessMeterBank::reset()
+{
+    resetRequested.store(true, std::memory_order_release);
+}
+
+void LoudnessMeterBank::resetState()
+{
+    const SIMDDouble zero = SIMDDouble::expand(0.0);
+
+    for (auto& state : filterStates)
+        state = { zero, zero, zero, zero };
+
+    std::fill(hopSums.begin(), hopSums.end(), zero);
+    std::fill(hopHistory.begin(), hopHistory.end(), zero);
+    std::fill(momentarySums.begin(), momentarySums.end(), zero);
+    std::fill(shortTermSums.begin(), shortTermSums.end(), zero);
+    currentHopSamples = 0;
+    historyHead = 0;
+    pushesSinceMomentaryResum = 0;
+    pushesSinceShortTermResum = 0;
+    completedHops = 0;
+
+    for (auto& histogram : gatingHistograms)
+        histogram.reset();
+    for (auto& histogram : shortTermHistograms)
+        histogram.reset();
+
+    for (int stream = 0; stream < numStreams; ++stream)
+    {
+        auto& r = results[static_cast<size_t>(stream)];
+        r.momentary.store(-100.0f, std::memory_order_relaxed);
+        r.shortTerm.store(-100.0f, std::memory_order_relaxed);
+        r.integrated.store(-100.0f, std::memory_order_relaxed);
+        r.loudnessRange.store(0.0f, std::memory_order_relaxed);
+    }
+}
+
+float LoudnessMeterBank::getMomentaryLoudness(int stream) const
+{
+    if (!juce::isPositiveAndBelow(stream, numStreams))
+        return -100.0f;
+
+    return results[static_cast<size_t>(stream)].momentary.load(std::memory_order_relaxed);
+}
+
+float LoudnessMeterBank::getShortTermLoudness(int stream) const
+{
+    if (!juce::isPositiveAndBelow(stream, numStreams))
+        return -100.0f;
+
+    return results[static_cast<size_t>(stream)].shortTerm.load(std::memory_order_relaxed);
+}
+
+float LoudnessMeterBank::getIntegratedLoudness(int stream) const
+{
+    if (!juce::isPositiveAndBelow(stream, numStreams))
+        return -100.0f;
+
+    return results[static_cast<size_t>(stream)].integrated.load(std::memory_order_relaxed);
+}
+
+float LoudnessMeterBank::getLoudnessRange(int stream) const
+{
+    if (!juce::isPositiveAndBelow(stream, numStreams))
+        return 0.0f;
+
+    return results[static_cast<size_t>(stream)].loudnessRange.load(std::memory_order_relaxed);
+}
+
+float LoudnessMeterBank::calculateLoudness(double meanSquare)
+{
+    if (meanSquare <= 0.0)
+        return -100.0f;
+
+    return static_cast<float>(LoudnessHistogram::meanSquareToLufs(meanSquare));
+}
+
+void LoudnessMeterBank::processBlock(const float* const* streamData, int numSamples)
+{
+    if (resetRequested.load(std::memory_order_relaxed)
+        && resetRequested.exchange(false, std::memory_order_acquire))
+        resetState();
+
+    if (numStreams == 0)
+        return;
+
+    // Split at hop boundaries so the inner loops never branch
+    int position = 0;
+    while (position < numSamples)
+    {
+        const int segmentLength = std::min(numSamples - position, samplesPerHop - currentHopSamples);
+
+        processSegment(streamData, position, segmentLength);
+        currentHopSamples += segmentLength;
+        position += segmentLength;
+
+        if (currentHopSamples >= samplesPerHop)
+            completeHop();
+    }
+}
+
+void LoudnessMeterBank::processSegment(const float* const* streamData, int startSample, int numSamples)
+{
+    for (int group = 0; group < numLaneGroups; ++group)
+    {
+        SIMDDouble weightedSum = SIMDDouble::expand(0.0);
+
+        for (int ch = 0; ch < channelsPerStream; ++ch)
+        {
+            // The LFE carries no weight, so it is never filtered
+            const double weight = channelWeights[static_cast<size_t>(ch)];
+            if (weight == 0.0)
+                continue;
+
+            // Lanes past the last stream re-read the group's first stream and are never reported
+            const float* lanes[kLanes];
+            for (int lane = 0; lane < kLanes; ++lane)
+            {
+                const int stream = group * kLanes + lane < numStreams ? group * kLanes + lane : group * kLanes;
+                lanes[lane] = streamData[stream * channelsPerStream + ch] + startSample;
+            }
+
+            auto& state = filterStates[static_cast<size_t>(group * channelsPerStream + ch)];
+            weightedSum += processChannel(lanes, numSamples, state) * weight;
+        }
+
+        hopSums[static_cast<size_t>(group)] += weightedSum;
+    }
+}
+
+LoudnessMeterBank::SIMDDouble LoudnessMeterBank::processChannel(const float* const* lanes, int numSamples,
+                                                                KWeightingState& state) const
+{
+    KWeightingState s = state;
+    SIMDDouble energy = SIMDDouble::expand(0.0);
+    alignas(16) double frame[kLanes];
+
+    for (int sample = 0; sample < numSamples; ++sample)
+    {
+        for (int lane = 0; lane < kLanes; ++lane)
+            frame[lane] = static_cast<double>(lanes[lane][sample]);
+
+        const SIMDDouble input = SIMDDouble::fromRawArray(frame);
+
+        // Pre-filter (high shelf)
+        const SIMDDouble pre = coeffs.preB0 * input + s.preZ1;
+        s.preZ1 = coeffs.preB1 * input - coeffs.preA1 * pre + s.preZ2;
+        s.preZ2 = coeffs.preB2 * input - coeffs.preA2 * pre;
+
+        // RLB filter (high pass)
+        const SIMDDouble kWeighted = coeffs.rlbB0 * pre + s.rlbZ1;
+        s.rlbZ1 = coeffs.rlbB1 * pre - coeffs.rlbA1 * kWeighted + s.rlbZ2;
+        s.rlbZ2 = coeffs.rlbB2 * pre - coeffs.rlbA2 * kWeighted;
+
+        energy += kWeighted * kWeighted;
+    }
+
+    state = s;
+    return energy;
+}
+
+void LoudnessMeterBank::resumWindow(std::vector<SIMDDouble>& sums, int length)
+{
+    const auto groups = static_cast<size_t>(numLaneGroups);
+
+    for (size_t group = 0; group < groups; ++group)
+    {
+        SIMDDouble sum = SIMDDouble::expand(0.0);
+        for (size_t i = 0; i < static_cast<size_t>(length); ++i)
+            sum += hopHistory[((historyHead - i) & historyMask) * groups + group];
+
+        sums[group] = sum;
+    }
+}
+
+void LoudnessMeterBank::completeHop()
+{
+    const auto groups = static_cast<size_t>(numLaneGroups);
+    const SIMDDouble invHopLength = SIMDDouble::expand(1.0 / currentHopSamples);
+    const size_t momentaryTail = ((historyHead - kHopsPerMomentary) & historyMask) * groups;
+    const size_t shortTermTail = ((historyHead - kHopsPerShortTerm) & historyMask) * groups;
+    const size_t head = historyHead * groups;
+
+    // Push every stream's hop mean square and slide both windows
+    for (size_t group = 0; group < groups; ++group)
+    {
+        const SIMDDouble meanSquare = hopSums[group] * invHopLength;
+        hopHistory[head + group] = meanSquare;
+        momentarySums[group] += meanSquare - hopHistory[momentaryTail + group];
+        shortTermSums[group] += meanSquare - hopHistory[shortTermTail + group];
+        hopSums[group] = SIMDDouble::expand(0.0);
+    }
+
+    currentHopSamples = 0;
+
+    if (++pushesSinceMomentaryResum >= kHopsPerMomentary)
+    {
+        resumWindow(momentarySums, kHopsPerMomentary);
+        pushesSinceMomentaryResum = 0;
+    }
+
+    if (++pushesSinceShortTermResum >= kHopsPerShortTerm)
+    {
+        resumWindow(shortTermSums, kHopsPerShortTerm);
+        pushesSinceShortTermResum = 0;
+    }
+
+    historyHead = (historyHead + 1) & historyMask;
+    completedHops = std::min(completedHops + 1, kHopsPerShortTerm);
+
+    // Publish per stream; every hop is a gating step, as in the single-stream meter
+    alignas(16) double momentary[kLanes];
+    alignas(16) double shortTerm[kLanes];
+
+    for (int group = 0; group < numLaneGroups; ++group)
+    {
+        (momentarySums[static_cast<size_t>(group)] * (1.0 / kHopsPerMomentary)).copyToRawArray(momentary);
+        (shortTermSums[static_cast<size_t>(group)] * (1.0 / kHopsPerShortTerm)).copyToRawArray(shortTerm);
+
+        for (int lane = 0; lane < kLanes && group * kLanes + lane < numStreams; ++lane)
+        {
+            const auto stream = static_cast<size_t>(group * kLanes + lane);
+            auto& r = results[stream];
+
+            r.momentary.store(calculateLoudness(momentary[lane]), std::memory_order_relaxed);
+            r.shortTerm.store(calculateLoudness(shortTerm[lane]), std::memory_order_relaxed);
+
+            if (completedHops >= kHopsPerMomentary)
+            {
+                gatingHistograms[stream].addBlock(momentary[lane]);
+                r.integrated.store(calculateLoudness(gatingHistograms[stream].getRelativeGatedMeanSquare(kRelativeGateLU)),
+                                   std::memory_order_relaxed);
+            }
+
+            if (completedHops == kHopsPerShortTerm)
+            {
+                shortTermHistograms[stream].addBlock(shortTerm[lane]);
+                const double range = shortTermHistograms[stream].getPercentileRange(kRangeRelativeGateLU,
+                                                                                    kRangeLowPercentile,
+                                                                                    kRangeHighPercentile);
+                r.loudnessRange.store(static_cast<float>(range), std::memory_order_relaxed);
+            }
+        }
+    }
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+#include <juce_dsp/juce_dsp.h>
+#include "LoudnessHistogram.h"
+#include <atomic>
+#include <memory>
+#include <vector>
+
+/**
+ * Many EBU R128 loudness meters processed as one struct-of-arrays engine
+ *
+ * All streams (stems) share the sample rate, the channel layout and a 100ms hop, so
+ * their K-weighting filters can run side by side: stream s lives in lane (s % kLanes)
+ * of lane group (s / kLanes), and every per-stream state (filter memories, hop
+ * accumulators, window history) is stored as one SIMD register per lane group. Each
+ * filtered sample advances kLanes streams at once, state for neighbouring streams
+ * shares cache lines, and the cost grows linearly with the number of streams.
+ *
+ * Momentary, short-term and integrated loudness and the loudness range are reported
+ * per stream with the same gating as EBU128LoudnessMeter; true peak is left to the
+ * single-stream meter.
+ *
+ * prepare() is the only call that allocates and must not overlap processBlock();
+ * reset() may be called from any other thread and is applied at the start of the
+ * next block.
+ */
+class LoudnessMeterBank
+{
+public:
+    LoudnessMeterBank() = default;
+    ~LoudnessMeterBank() = default;
+
+    void prepare(double sampleRate, int numStreams, int channelsPerStream);
+
+    // Clear every stream (applied at the start of the next block)
+    void reset();
+
+    // streamData holds numStreams * channelsPerStream pointers, stream by stream:
+    // channel c of stream s is streamData[s * channelsPerStream + c]
+    void processBlock(const float* const* streamData, int numSamples);
+
+    int getNumStreams() const { return numStreams; }
+    int getChannelsPerStream() const { return channelsPerStream; }
+
+    // Thread-safe getters (called from UI thread)
+    float getMomentaryLoudness(int stream) const;
+    float getShortTermLoudness(int stream) const;
+    float getIntegratedLoudness(int stream) const;
+    float getLoudnessRange(int stream) const;
+
+private:
+    using SIMDDouble = juce::dsp::SIMDRegister<double>;
+    static constexpr int kLanes = static_cast<int>(SIMDDouble::SIMDNumElements);
+
+    // K-weighting coefficients broadcast to every lane
+    struct KWeightingCoeffs
+    {
+        SIMDDouble preB0, preB1, preB2, preA1, preA2;
+        SIMDDouble rlbB0, rlbB1, rlbB2, rlbA1, rlbA2;
+    };
+
+    // Both K-weighting biquads (transposed direct form II) of one channel for kLanes streams
+    struct KWeightingState
+    {
+        SIMDDouble preZ1, preZ2, rlbZ1, rlbZ2;
+    };
+
+    // Published values of one stream
+    struct StreamResults
+    {
+        std::atomic<float> momentary{-100.0f};
+        std::atomic<float> shortTerm{-100.0f};
+        std::atomic<float> integrated{-100.0f};
+        std::atomic<float> loudnessRange{0.0f};
+    };
+
+    // Filter one channel of one lane group; returns the per-lane sum of squares
+    SIMDDouble processChannel(const float* const* lanes, int numSamples, KWeightingState& state) const;
+
+    // Filter every weighted channel of every lane group for numSamples samples
+    void processSegment(const float* const* streamData, int startSample, int numSamples);
+
+    // Close the current 100ms hop for all streams
+    void completeHop();
+
+    // Recompute one window's running sums from the history to stop floating-point drift
+    void resumWindow(std::vector<SIMDDouble>& sums, int length);
+
+    void resetState();
+
+    static float calculateLoudness(double meanSquare);
+
+    // Window lengths in 100ms hops; one hop is one BS.1770 gating step
+    static constexpr int kHopMilliseconds = 100;
+    static constexpr int kHopsPerMomentary = 4;
+    static constexpr int kHopsPerShortTerm = 30;
+
+    // BS.1770 integrated gating and EBU Tech 3342 range gating, as in EBU128LoudnessMeter
+    static constexpr double kRelativeGateLU = -10.0;
+    static constexpr double kRangeRelativeGateLU = -20.0;
+    static constexpr double kRangeLowPercentile = 0.10;
+    static constexpr double kRangeHighPercentile = 0.95;
+
+    int numStreams{0};
+    int channelsPerStream{1};
+    int numLaneGroups{0};
+
+    KWeightingCoeffs coeffs;
+    std::vector<double> channelWeights;
+
+    // [group * channelsPerStream + channel]
+    std::vector<KWeightingState> filterStates;
+
+    // Weighted sum of squares of the current hop, [group]
+    std::vector<SIMDDouble> hopSums;
+    int currentHopSamples{0};
+    int samplesPerHop{4800};
+
+    // Per-hop mean squares, [slot * numLaneGroups + group], in a power-of-two ring
+    // longer than the short-term window
+    std::vector<SIMDDouble> hopHistory;
+    size_t historyMask{0};
+    size_t historyHead{0};
+
+    // Running window sums, [group]; every stream pushes at the same time, so the
+    // resum counters are shared
+    std::vector<SIMDDouble> momentarySums;
+    std::vector<SIMDDouble> shortTermSums;
+    int pushesSinceMomentaryResum{0};
+    int pushesSinceShortTermResum{0};
+    int completedHops{0};
+
+    // Per stream
+    std::vector<LoudnessHistogram> gatingHistograms;
+    std::vector<LoudnessHistogram> shortTermHistograms;
+    std::unique_ptr<StreamResults[]> results;
+
+    std::atomic<bool> resetRequested{false};
+};
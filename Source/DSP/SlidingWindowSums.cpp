@@ -0,0 +1,80 @@
+#include "SlidingWindowSums.h"
+#include <algorithm>
+
+void SlidingWindowSums::clearWindows()
+{
+    windows.clear();
+}
+
+int SlidingWindowSums::addWindow(int lengthInValues)
+{
+    Window window;
+    window.length = std::max(1, lengthInValues);
+    windows.push_back(window);
+    return static_cast<int>(windows.size()) - 1;
+}
+
+void SlidingWindowSums::prepare()
+{
+    int longest = 1;
+    for (const auto& window : windows)
+        longest = std::max(longest, window.length);
+
+    // Power-of-two ring, strictly longer than any window, so indices wrap with a mask
+    size_t capacity = 1;
+    while (capacity <= static_cast<size_t>(longest))
+        capacity <<= 1;
+
+    history.assign(capacity, 0.0);
+    mask = capacity - 1;
+
+    reset();
+}
+
+void SlidingWindowSums::setLength(int window, int lengthInValues)
+{
+    windows[static_cast<size_t>(window)].length = std::max(1, std::min(lengthInValues, static_cast<int>(mask)));
+}
+
+void SlidingWindowSums::reset()
+{
+    std::fill(history.begin(), history.end(), 0.0);
+    head = 0;
+
+    for (auto& window : windows)
+    {
+        window.sum = 0.0;
+        window.pushesSinceResum = 0;
+    }
+}
+
+void SlidingWindowSums::push(double value)
+{
+    history[head] = value;
+
+    for (auto& window : windows)
+    {
+        window.sum += value - history[(head - static_cast<size_t>(window.length)) & mask];
+
+        if (++window.pushesSinceResum >= window.length)
+            resum(window);
+    }
+
+    head = (head + 1) & mask;
+}
+
+double SlidingWindowSums::getMean(int window) const
+{
+    const auto& w = windows[static_cast<size_t>(window)];
+    return w.sum / w.length;
+}
+
+void SlidingWindowSums::resum(Window& window) const
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < static_cast<size_t>(window.length); ++i)
+        sum += history[(head - i) & mask];
+
+    window.sum = sum;
+    window.pushesSinceResum = 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * Running sums over the most recent values of a shared history
+ *
+ * Values are pushed once into a ring sized for the longest window, and every window
+ * keeps its own running sum, so a push costs O(1) per window whatever its length.
+ * Each window is re-summed exactly once per `length` pushes to stop floating-point
+ * drift, which keeps the amortised cost O(1) as well.
+ */
+class SlidingWindowSums
+{
+public:
+    // Remove all windows; add new ones and call prepare() before pushing
+    void clearWindows();
+
+    // Register a window over the last lengthInValues pushes; returns its index
+    int addWindow(int lengthInValues);
+
+    // Allocate the history for the longest window and clear everything
+    void prepare();
+
+    // Change a window's length without reallocating (clamped to the prepared history);
+    // call reset() before pushing again
+    void setLength(int window, int lengthInValues);
+
+    void reset();
+
+    void push(double value);
+
+    double getSum(int window) const { return windows[static_cast<size_t>(window)].sum; }
+    double getMean(int window) const;
+    int getLength(int window) const { return windows[static_cast<size_t>(window)].length; }
+
+private:
+    struct Window
+    {
+        int length{1};
+        double sum{0.0};
+        int pushesSinceResum{0};
+    };
+
+    void resum(Window& window) const;
+
+    std::vector<double> history;
+    size_t mask{0};
+    size_t head{0};
+
+    std::vector<Window> windows;
+};
@@ -13,6 +13,9 @@ LoudnessMeterAudioProcessorEditor::LoudnessMeterAudioProcessorEditor(
     historyDisplay = std::make_unique<LoudnessHistoryDisplay>(p.getDataStore());
     addAndMakeVisible(*historyDisplay);
     
+    lastHistoryView = p.getHistoryView();
+    historyDisplay->setViewRange(lastHistoryView.timeRange, lastHistoryView.minLufs, lastHistoryView.maxLufs);
+    
     resizer = std::make_unique<juce::ResizableCornerComponent>(this, &constrainer);
     addAndMakeVisible(*resizer);
     
@@ -51,7 +54,21 @@ void LoudnessMeterAudioProcessorEditor::timerCallback()
     {
         historyDisplay->setCurrentLoudness(
             audioProcessor.getMomentaryLoudness(),
-            audioProcessor.getShortTermLoudness()
+            audioProcessor.getShortTermLoudness(),
+            audioProcessor.getIntegratedLoudness(),
+            audioProcessor.getLoudnessRange(),
+            audioProcessor.getMaxTruePeak()
         );
+        
+        // Keep the zoom with the processor, so it outlives the editor and is saved; a
+        // view the host restored in the meantime wins over the display's
+        const auto storedView = audioProcessor.getHistoryView();
+        if (storedView != lastHistoryView)
+            historyDisplay->setViewRange(storedView.timeRange, storedView.minLufs, storedView.maxLufs);
+        
+        lastHistoryView = { historyDisplay->getViewTimeRange(),
+                            historyDisplay->getViewMinLufs(),
+                            historyDisplay->getViewMaxLufs() };
+        audioProcessor.setHistoryView(lastHistoryView);
     }
 }
\ No newline at end of file
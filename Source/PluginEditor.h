@@ -20,6 +20,7 @@ private:
     LoudnessMeterAudioProcessor& audioProcessor;
     
     std::unique_ptr<LoudnessHistoryDisplay> historyDisplay;
+    LoudnessMeterAudioProcessor::HistoryView lastHistoryView;
     
     juce::ComponentBoundsConstrainer constrainer;
     std::unique_ptr<juce::ResizableCornerComponent> resizer;
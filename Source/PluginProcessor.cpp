@@ -1,11 +1,27 @@
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
 
+namespace
+{
+    // Division rounding towards minus infinity, for positions before the timeline's start
+    juce::int64 floorDivide(juce::int64 value, juce::int64 divisor)
+    {
+        const auto quotient = value / divisor;
+        return (value % divisor != 0 && value < 0) ? quotient - 1 : quotient;
+    }
+}
+
 LoudnessMeterAudioProcessor::LoudnessMeterAudioProcessor()
     : AudioProcessor(BusesProperties()
                      .withInput("Input", juce::AudioChannelSet::stereo(), true)
                      .withOutput("Output", juce::AudioChannelSet::stereo(), true))
 {
+    // Saved states name their journal and backing files; they are only ever looked for here
+    const auto dataDirectory = juce::File::getSpecialLocation(juce::File::userApplicationDataDirectory)
+                                   .getChildFile(JucePlugin_Name);
+    
+    dataStore.setJournalDirectory(dataDirectory.getChildFile("Journals"));
+    dataStore.setBackingRoot(dataDirectory.getChildFile("Histories"));
 }
 
 LoudnessMeterAudioProcessor::~LoudnessMeterAudioProcessor()
@@ -30,16 +46,51 @@ void LoudnessMeterAudioProcessor::changeProgramName(int, const juce::String&) {}
 
 void LoudnessMeterAudioProcessor::prepareToPlay(double sampleRate, int samplesPerBlock)
 {
+    loudnessMeter.setUpdateInterval(updateIntervalMs);
     loudnessMeter.prepare(sampleRate, samplesPerBlock, getTotalNumInputChannels());
-    dataStore.prepare(10.0); // 10 Hz update rate
+    preparedBlockSize = std::max(1, samplesPerBlock);
     
-    // Calculate samples per 100ms update
-    samplesPerUpdate = static_cast<int>(sampleRate * 0.1);
-    sampleCounter = 0;
+    updateHistoryTimebase(sampleRate);
+    
+    // Journal for crash recovery, unless a restored state already picked its own back up.
+    // Journals that crashed sessions left and no project came back for go after a while.
+    if (dataStore.getJournalFile() == juce::File())
+    {
+        const auto journals = dataStore.getJournalDirectory();
+        
+        MeasurementJournal::removeStale(journals, juce::RelativeTime::days(kStaleJournalDays));
+        dataStore.setJournalFile(journals.getChildFile(juce::Uuid().toString() + ".journal"));
+    }
     
     isPrepared = true;
 }
 
+void LoudnessMeterAudioProcessor::setUpdateInterval(int milliseconds)
+{
+    // Lock-free request; the meter switches at the start of its next block, and the
+    // history, cleared for the new rate straight away, takes no points until then
+    loudnessMeter.setUpdateInterval(milliseconds);
+    updateIntervalMs = loudnessMeter.getUpdateInterval();
+    updateHistoryTimebase(getSampleRate());
+}
+
+void LoudnessMeterAudioProcessor::updateHistoryTimebase(double sampleRate)
+{
+    const int interval = loudnessMeter.getUpdateInterval();
+    
+    // One history point per meter hop, so LOD0 has the hop's resolution. The rate comes
+    // from the hop's whole-sample length, as the meter's getHopRate() does, so the history
+    // keeps time with the audio even where the interval is not a whole number of samples;
+    // before the sample rate is known the nominal rate stands in.
+    if (sampleRate <= 0.0)
+    {
+        dataStore.prepare(1000.0 / interval);
+        return;
+    }
+    
+    dataStore.prepare(sampleRate / EBU128LoudnessMeter::getSamplesPerHop(sampleRate, interval));
+}
+
 void LoudnessMeterAudioProcessor::releaseResources()
 {
     isPrepared = false;
@@ -63,6 +114,12 @@ bool LoudnessMeterAudioProcessor::isBusesLayoutSupported(const BusesLayout& layo
         return true;
     if (mainInput == juce::AudioChannelSet::stereo())
         return true;
+    if (mainInput == juce::AudioChannelSet::create5point1())
+        return true;
+    if (mainInput == juce::AudioChannelSet::create7point1())
+        return true;
+    if (mainInput == juce::AudioChannelSet::create7point1point4())
+        return true;
     
     return false;
 }
@@ -75,23 +132,71 @@ void LoudnessMeterAudioProcessor::processBlock(juce::AudioBuffer<float>& buffer,
     if (!isPrepared)
         return;
     
-    // Process through loudness meter (doesn't modify audio)
-    loudnessMeter.processBlock(buffer);
+    // While the host's transport plays, points go to their place on its timeline, so a
+    // loop or a rewind replaces what was recorded there and the history stays as long as
+    // the timeline. A stopped transport only updates the live readings; without a
+    // timeline (standalone) points simply follow each other.
+    bool hasTimeline = false;
+    bool isPlaying = false;
+    juce::int64 blockStart = 0;
+    
+    if (auto* playHead = getPlayHead())
+    {
+        if (const auto position = playHead->getPosition())
+        {
+            if (const auto time = position->getTimeInSamples())
+            {
+                hasTimeline = true;
+                isPlaying = position->getIsPlaying();
+                blockStart = *time;
+            }
+        }
+    }
     
-    // Update cached values and data store periodically
-    sampleCounter += buffer.getNumSamples();
+    // The meter only has room for the hops of a prepared block, so hosts that send more
+    // than they announced are measured in slices of that size
+    const int numSamples = buffer.getNumSamples();
     
-    if (sampleCounter >= samplesPerUpdate)
+    for (int sliceStart = 0; sliceStart < numSamples; sliceStart += preparedBlockSize)
     {
-        sampleCounter -= samplesPerUpdate;
+        const int sliceLength = std::min(preparedBlockSize, numSamples - sliceStart);
+        const juce::AudioBuffer<float> slice(buffer.getArrayOfWritePointers(), buffer.getNumChannels(),
+                                             sliceStart, sliceLength);
         
-        float m = loudnessMeter.getMomentaryLoudness();
-        float s = loudnessMeter.getShortTermLoudness();
-        
-        momentaryLoudness.store(m, std::memory_order_release);
-        shortTermLoudness.store(s, std::memory_order_release);
+        // Process through loudness meter (doesn't modify audio)
+        loudnessMeter.processBlock(slice);
+        publishMeasurements(hasTimeline, isPlaying, blockStart + sliceStart);
+    }
+}
+
+void LoudnessMeterAudioProcessor::publishMeasurements(bool hasTimeline, bool isPlaying, juce::int64 sliceStart)
+{
+    // Points are as long as the hops the meter measured them with, which only match the
+    // history's rate once the meter has applied the interval the history was set up for
+    const juce::int64 samplesPerPoint = loudnessMeter.getHopLength();
+    dataStore.setPointRate(loudnessMeter.getHopRate());
+    
+    // Publish every hop the meter finished during this slice
+    for (const auto& measurement : loudnessMeter.getCompletedMeasurements())
+    {
+        momentaryLoudness.store(measurement.momentary, std::memory_order_release);
+        shortTermLoudness.store(measurement.shortTerm, std::memory_order_release);
+        integratedLoudness.store(loudnessMeter.getIntegratedLoudness(), std::memory_order_release);
+        loudnessRange.store(loudnessMeter.getLoudnessRange(), std::memory_order_release);
+        maxTruePeak.store(loudnessMeter.getMaxTruePeak(), std::memory_order_release);
         
-        dataStore.addPoint(m, s);
+        if (!hasTimeline)
+        {
+            dataStore.addPoint(measurement.momentary, measurement.shortTerm, measurement.truePeak);
+        }
+        else if (isPlaying)
+        {
+            // The point whose interval holds most of the hop that ended here: the one
+            // holding the hop's midpoint, in whole samples
+            const auto hopEnd = sliceStart + measurement.endSample;
+            const auto pointIndex = floorDivide(2 * hopEnd - samplesPerPoint, 2 * samplesPerPoint);
+            dataStore.addPointAt(pointIndex, measurement.momentary, measurement.shortTerm, measurement.truePeak);
+        }
     }
 }
 
@@ -105,12 +210,93 @@ juce::AudioProcessorEditor* LoudnessMeterAudioProcessor::createEditor()
     return new LoudnessMeterAudioProcessorEditor(*this);
 }
 
-void LoudnessMeterAudioProcessor::getStateInformation(juce::MemoryBlock&)
+void LoudnessMeterAudioProcessor::getStateInformation(juce::MemoryBlock& destData)
 {
+    juce::MemoryOutputStream out(destData, false);
+    
+    out.writeInt(kStateMagic);
+    out.writeInt(kStateVersion);
+    out.writeInt(updateIntervalMs);
+    
+    out.writeDouble(historyView.timeRange);
+    out.writeFloat(historyView.minLufs);
+    out.writeFloat(historyView.maxLufs);
+    
+    // The pyramid's shape and retention caps are settings; the history records its shape
+    // too, but only when there is a history to restore
+    const int numLevels = dataStore.getNumLevels();
+    out.writeInt(numLevels);
+    out.writeInt(dataStore.getFanOut());
+    
+    for (int level = 0; level < numLevels; ++level)
+        out.writeInt64(static_cast<juce::int64>(dataStore.getLevelRetention(level)));
+    
+    const auto& measurement = loudnessMeter.getMeasurementState();
+    measurement.gatingHistogram.writeTo(out);
+    measurement.shortTermHistogram.writeTo(out);
+    out.writeFloat(measurement.maxTruePeak);
+    
+    dataStore.writeState(out);
 }
 
-void LoudnessMeterAudioProcessor::setStateInformation(const void*, int)
+void LoudnessMeterAudioProcessor::setStateInformation(const void* data, int sizeInBytes)
 {
+    juce::MemoryInputStream in(data, static_cast<size_t>(sizeInBytes), false);
+    
+    if (in.readInt() != kStateMagic)
+        return;
+    
+    const int version = in.readInt();
+    if (version < 1 || version > kStateVersion)
+        return;
+    
+    const int savedInterval = in.readInt();
+    
+    HistoryView view;
+    view.timeRange = in.readDouble();
+    view.minLufs = in.readFloat();
+    view.maxLufs = in.readFloat();
+    
+    // Version 1 states were recorded with the default pyramid and no retention caps
+    int numLevels = LoudnessDataStore::kDefaultNumLods;
+    int fanOut = LoudnessDataStore::kDefaultLodFactor;
+    std::vector<size_t> retention(static_cast<size_t>(numLevels), 0);
+    
+    if (version >= 2)
+    {
+        numLevels = in.readInt();
+        fanOut = in.readInt();
+        
+        if (numLevels < 1 || numLevels > LoudnessDataStore::kMaxLods)
+            return;
+        
+        retention.assign(static_cast<size_t>(numLevels), 0);
+        for (auto& maxBuckets : retention)
+            maxBuckets = static_cast<size_t>(std::max<juce::int64>(0, in.readInt64()));
+    }
+    
+    // Two histograms come to 32KB, so keep them off the stack
+    auto measurement = std::make_unique<EBU128LoudnessMeter::MeasurementState>();
+    if (!measurement->gatingHistogram.readFrom(in) || !measurement->shortTermHistogram.readFrom(in))
+        return;
+    
+    measurement->maxTruePeak = in.readFloat();
+    
+    // The history needs the update rate it was recorded at, and the interval change
+    // resets the meter, so both come before the restore
+    if (savedInterval != updateIntervalMs && savedInterval >= 10 && savedInterval <= 100)
+        setUpdateInterval(savedInterval);
+    
+    // A new shape clears the history, so it comes before the history is read back
+    if (numLevels != dataStore.getNumLevels() || fanOut != dataStore.getFanOut())
+        dataStore.setLodLayout(numLevels, fanOut);
+    
+    for (int level = 0; level < LoudnessDataStore::kMaxLods; ++level)
+        dataStore.setLevelRetention(level, level < numLevels ? retention[static_cast<size_t>(level)] : 0);
+    
+    historyView = view;
+    loudnessMeter.restoreMeasurementState(*measurement);
+    dataStore.readState(in);
 }
 
 juce::AudioProcessor* JUCE_CALLTYPE createPluginFilter()
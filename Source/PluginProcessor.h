@@ -39,20 +39,62 @@ public:
     // Public accessors - thread safe
     float getMomentaryLoudness() const { return momentaryLoudness.load(std::memory_order_acquire); }
     float getShortTermLoudness() const { return shortTermLoudness.load(std::memory_order_acquire); }
+    float getIntegratedLoudness() const { return integratedLoudness.load(std::memory_order_acquire); }
+    float getLoudnessRange() const { return loudnessRange.load(std::memory_order_acquire); }
+    float getMaxTruePeak() const { return maxTruePeak.load(std::memory_order_acquire); }
     LoudnessDataStore& getDataStore() { return dataStore; }
+    
+    // Meter update hop (10/20/50/100 ms); may be changed while playing (message thread)
+    void setUpdateInterval(int milliseconds);
+    int getUpdateInterval() const { return updateIntervalMs; }
+    
+    // Zoom of the history view, kept here so it outlives the editor (message thread)
+    struct HistoryView
+    {
+        double timeRange{10.0};
+        float minLufs{-60.0f};
+        float maxLufs{0.0f};
+        
+        bool operator==(const HistoryView& other) const
+        {
+            return timeRange == other.timeRange && minLufs == other.minLufs && maxLufs == other.maxLufs;
+        }
+        bool operator!=(const HistoryView& other) const { return !(*this == other); }
+    };
+    
+    HistoryView getHistoryView() const { return historyView; }
+    void setHistoryView(const HistoryView& view) { historyView = view; }
 
 private:
+    // Hand the hops the meter finished in the last slice to the UI, and to the history
+    // unless the host's transport is stopped (audio thread)
+    void publishMeasurements(bool hasTimeline, bool isPlaying, juce::int64 sliceStart);
+    
+    // Match the history's point rate to the meter's hop (message thread)
+    void updateHistoryTimebase(double sampleRate);
+    
     EBU128LoudnessMeter loudnessMeter;
     LoudnessDataStore dataStore;
     
     // Cached loudness values for thread-safe access from UI
     std::atomic<float> momentaryLoudness{-100.0f};
     std::atomic<float> shortTermLoudness{-100.0f};
+    std::atomic<float> integratedLoudness{-100.0f};
+    std::atomic<float> loudnessRange{0.0f};
+    std::atomic<float> maxTruePeak{-100.0f};
+    
+    int updateIntervalMs{100};
+    HistoryView historyView;
+    
+    // State layout: header, update interval, view, history layout (from version 2),
+    // meter histograms and peak, history
+    static constexpr int kStateMagic = 0x4c4d5354;   // "LMST"
+    static constexpr int kStateVersion = 2;
     
-    // Sample counter for 100ms updates
-    int sampleCounter{0};
-    int samplesPerUpdate{4800};
+    // Age after which a journal nobody restored is deleted
+    static constexpr double kStaleJournalDays = 30.0;
     
+    int preparedBlockSize{512};
     bool isPrepared{false};
 
     JUCE_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(LoudnessMeterAudioProcessor)
@@ -0,0 +1,63 @@
+#include "ColumnReductions.h"
+#include <algorithm>
+
+void ColumnReductions::Stats::merge(const Stats& other)
+{
+    minimum = std::min(minimum, other.minimum);
+    maximum = std::max(maximum, other.maximum);
+    sum += other.sum;
+    count += other.count;
+}
+
+void ColumnReductions::accumulate(Stats& stats, const int16_t* values, size_t numValues)
+{
+    size_t i = 0;
+
+    // Scalar head up to the first aligned value
+    while (i < numValues && !SIMDInt16::isSIMDAligned(values + i))
+    {
+        stats.minimum = std::min(stats.minimum, values[i]);
+        stats.maximum = std::max(stats.maximum, values[i]);
+        ++i;
+    }
+
+    if (numValues - i >= kLanes)
+    {
+        SIMDInt16 minimum = SIMDInt16::expand(stats.minimum);
+        SIMDInt16 maximum = SIMDInt16::expand(stats.maximum);
+
+        for (; i + kLanes <= numValues; i += kLanes)
+        {
+            const SIMDInt16 block = SIMDInt16::fromRawArray(values + i);
+            minimum = SIMDInt16::min(minimum, block);
+            maximum = SIMDInt16::max(maximum, block);
+        }
+
+        for (size_t lane = 0; lane < kLanes; ++lane)
+        {
+            stats.minimum = std::min(stats.minimum, minimum.get(lane));
+            stats.maximum = std::max(stats.maximum, maximum.get(lane));
+        }
+    }
+
+    for (; i < numValues; ++i)
+    {
+        stats.minimum = std::min(stats.minimum, values[i]);
+        stats.maximum = std::max(stats.maximum, values[i]);
+    }
+
+    // Branch-free, so it vectorises
+    int64_t sum = 0;
+    size_t count = 0;
+
+    for (size_t j = 0; j < numValues; ++j)
+    {
+        const int32_t value = values[j];
+        const bool isEmpty = value >= kEmptyValue || value <= -kEmptyValue;
+        sum += isEmpty ? 0 : value;
+        count += isEmpty ? 0 : 1;
+    }
+
+    stats.sum += sum;
+    stats.count += count;
+}
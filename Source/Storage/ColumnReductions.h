@@ -0,0 +1,38 @@
+#pragma once
+
+#include <juce_dsp/juce_dsp.h>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Reductions over contiguous runs of quantised history values
+ *
+ * Minimum and maximum run on SIMD registers over the aligned middle of a run; the
+ * sum is widened to 64 bits in a plain loop the compiler vectorises. Empty buckets
+ * hold +/-kEmptyValue and are left out of the sum and count, but not out of the
+ * minimum and maximum: an empty bucket stores +kEmptyValue in minimum columns and
+ * -kEmptyValue in maximum columns, so it never wins the reduction meant for that column.
+ */
+class ColumnReductions
+{
+public:
+    static constexpr int16_t kEmptyValue = 10000;
+
+    struct Stats
+    {
+        int16_t minimum{INT16_MAX};
+        int16_t maximum{INT16_MIN};
+        int64_t sum{0};        // over non-empty values
+        size_t count{0};       // non-empty values
+
+        void merge(const Stats& other);
+        double getMean() const { return count > 0 ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+    };
+
+    // Fold values[0, numValues) into stats
+    static void accumulate(Stats& stats, const int16_t* values, size_t numValues);
+
+private:
+    using SIMDInt16 = juce::dsp::SIMDRegister<int16_t>;
+    static constexpr size_t kLanes = SIMDInt16::SIMDNumElements;
+};
@@ -0,0 +1,27 @@
+#include "DeltaCodec.h"
+
+void DeltaCodec::writeVarint(std::vector<uint8_t>& out, uint64_t value)
+{
+    uint8_t bytes[10];
+    out.insert(out.end(), bytes, putVarint(bytes, value));
+}
+
+uint64_t DeltaCodec::Reader::readVarint()
+{
+    uint64_t value = 0;
+
+    for (int shift = 0; shift < 64 && !failed; shift += 7)
+    {
+        if (position == end)
+            break;
+
+        const uint8_t byte = *position++;
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0)
+            return value;
+    }
+
+    failed = true;
+    return 0;
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * Byte stream of variable-length integers for compact history snapshots
+ *
+ * Runs of integers are stored as zigzag varints of the difference to the previous value,
+ * so a slowly changing column costs about one byte per value and a run of equal values
+ * one byte each. Writing appends to a plain byte vector and reading walks a raw pointer,
+ * so neither goes through a stream call per value.
+ *
+ * A Reader never reads past its end: running out, or a varint longer than 64 bits,
+ * marks it failed and every later read returns 0.
+ */
+class DeltaCodec
+{
+public:
+    static void writeVarint(std::vector<uint8_t>& out, uint64_t value);
+    static void writeSigned(std::vector<uint8_t>& out, int64_t value) { writeVarint(out, zigzag(value)); }
+
+    template <typename T>
+    static void writeRaw(std::vector<uint8_t>& out, T value)
+    {
+        uint8_t bytes[sizeof(T)];
+        std::memcpy(bytes, &value, sizeof(T));
+        out.insert(out.end(), bytes, bytes + sizeof(T));
+    }
+
+    // Append values[0, numValues) as differences; previous carries across calls
+    template <typename T>
+    static void writeDeltas(std::vector<uint8_t>& out, const T* values, size_t numValues, int64_t& previous)
+    {
+        // Room for the longest possible varints, trimmed afterwards, so the loop only
+        // writes through a pointer
+        constexpr size_t maxBytes = (sizeof(T) * 8 + 2 + 6) / 7;
+        const size_t start = out.size();
+        out.resize(start + numValues * maxBytes);
+
+        uint8_t* position = out.data() + start;
+        for (size_t i = 0; i < numValues; ++i)
+        {
+            const auto value = static_cast<int64_t>(values[i]);
+            position = putVarint(position, zigzag(value - previous));
+            previous = value;
+        }
+
+        out.resize(static_cast<size_t>(position - out.data()));
+    }
+
+    class Reader
+    {
+    public:
+        Reader(const void* data, size_t size)
+            : position(static_cast<const uint8_t*>(data)), end(position + size) {}
+
+        uint64_t readVarint();
+        int64_t readSigned() { return unzigzag(readVarint()); }
+
+        template <typename T>
+        T readRaw()
+        {
+            T value{};
+            if (failed || static_cast<size_t>(end - position) < sizeof(T))
+            {
+                failed = true;
+                return value;
+            }
+
+            std::memcpy(&value, position, sizeof(T));
+            position += sizeof(T);
+            return value;
+        }
+
+        // Read numValues differences written by writeDeltas(); previous carries across calls
+        template <typename T>
+        void readDeltas(T* values, size_t numValues, int64_t& previous)
+        {
+            for (size_t i = 0; i < numValues; ++i)
+            {
+                previous += readSigned();
+                values[i] = static_cast<T>(previous);
+            }
+        }
+
+        bool hasFailed() const { return failed; }
+        bool isExhausted() const { return position == end; }
+        size_t getNumRemaining() const { return static_cast<size_t>(end - position); }
+
+    private:
+        const uint8_t* position;
+        const uint8_t* end;
+        bool failed{false};
+    };
+
+private:
+    static uint8_t* putVarint(uint8_t* position, uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            *position++ = static_cast<uint8_t>(value | 0x80);
+            value >>= 7;
+        }
+
+        *position++ = static_cast<uint8_t>(value);
+        return position;
+    }
+
+    static uint64_t zigzag(int64_t value)
+    {
+        return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+    }
+
+    static int64_t unzigzag(uint64_t value)
+    {
+        return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+    }
+};
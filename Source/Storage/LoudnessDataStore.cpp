@@ -1,176 +1,1755 @@
 #include "LoudnessDataStore.h"
 #include <cmath>
+#include <cstring>
 #include <algorithm>
+#include <limits>
+#include <thread>
+
+namespace
+{
+    // A fresh random id for a new history. Uuid draws from its own generator, so this
+    // never touches the shared system Random from the ingestion thread.
+    uint64_t makeHistoryId()
+    {
+        const juce::Uuid uuid;
+        uint64_t id;
+        std::memcpy(&id, uuid.getRawData(), sizeof(id));
+        return id;
+    }
+}
 
 LoudnessDataStore::LoudnessDataStore()
+    : juce::Thread("Loudness history ingestion")
+{
+    for (auto& lod : lodLevels)
+    {
+        for (auto& column : lod.columns)
+            column.setPool(&columnPool, kExpectedPagesPerLod);
+        
+        lod.gatedEnergy.setPool(&energyPool, kExpectedPagesPerLod);
+        lod.gatedBlocks.setPool(&countPool, kExpectedPagesPerLod);
+    }
+    
+    setPageCompression(true);
+    reset();
+    startThread(juce::Thread::Priority::low);
+}
+
+LoudnessDataStore::~LoudnessDataStore()
+{
+    stopThread(1000);
+    
+    std::lock_guard<std::mutex> lock(dataMutex);
+    if (backingDirectory != juce::File())
+        saveIndex();
+    
+    // Only a crash leaves journals behind
+    journal.stop(true);
+    
+    for (const auto& file : retiredJournals)
+        if (!MeasurementJournal::isInUse(file))
+            file.deleteFile();
+}
+
+void LoudnessDataStore::prepare(double updateRateHz)
+{
+    if (updateRateHz == updateRate)
+        return;
+    
+    // LOD0 buckets follow the point interval, so a new rate starts a new history
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+        updateRate = updateRateHz;
+        historyRate.store(updateRate, std::memory_order_relaxed);
+        sampleInterval = 1.0 / updateRate;
+        pointsPerGatingStep = std::max(1, static_cast<int>(std::lround(updateRate * kGatingStepSeconds)));
+    }
+    
+    reset();
+}
+
+void LoudnessDataStore::setLodLayout(int numLevels, int fanOut)
+{
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+        numLods = juce::jlimit(1, kMaxLods, numLevels);
+        lodFactorShift = fanOut <= 2 ? 1 : (fanOut >= 8 ? 3 : 2);
+        lodFactor = 1 << lodFactorShift;
+    }
+    
+    reset();
+}
+
+int LoudnessDataStore::getNumLevels() const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return numLods;
+}
+
+int LoudnessDataStore::getFanOut() const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return lodFactor;
+}
+
+void LoudnessDataStore::setLevelRetention(int level, size_t maxBuckets)
+{
+    if (!juce::isPositiveAndBelow(level, kMaxLods))
+        return;
+    
+    std::lock_guard<std::mutex> lock(dataMutex);
+    lodLevels[static_cast<size_t>(level)].maxBuckets = maxBuckets;
+}
+
+size_t LoudnessDataStore::getLevelRetention(int level) const
+{
+    if (!juce::isPositiveAndBelow(level, kMaxLods))
+        return 0;
+    
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return lodLevels[static_cast<size_t>(level)].maxBuckets;
+}
+
+LoudnessDataStore::LevelStats LoudnessDataStore::getLevelStats(int level) const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    LevelStats stats;
+    if (!juce::isPositiveAndBelow(level, numLods))
+        return stats;
+    
+    const auto& lod = lodLevels[static_cast<size_t>(level)];
+    stats.bucketDuration = lod.bucketDuration;
+    stats.numBuckets = lod.columns[0].size();
+    stats.numPages = lod.columns[0].getNumPages() * kNumColumns + lod.gatedEnergy.getNumPages() + lod.gatedBlocks.getNumPages();
+    stats.numCompressedPages = lod.gatedEnergy.getNumCompressedPages() + lod.gatedBlocks.getNumCompressedPages();
+    stats.bytes = lod.gatedEnergy.getNumBytes() + lod.gatedBlocks.getNumBytes();
+    
+    for (const auto& column : lod.columns)
+    {
+        stats.numCompressedPages += column.getNumCompressedPages();
+        stats.bytes += column.getNumBytes();
+    }
+    
+    return stats;
+}
+
+size_t LoudnessDataStore::getPoolBytes() const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return (columnPool.getNumPages() * sizeof(int16_t)
+            + energyPool.getNumPages() * sizeof(double)
+            + countPool.getNumPages() * sizeof(uint32_t)) * kBucketsPerPage;
+}
+
+void LoudnessDataStore::reset()
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    // Points already queued belong to the old history
+    resumeIndex.store(0, std::memory_order_relaxed);
+    epoch.fetch_add(1, std::memory_order_release);
+    
+    clearHistory();
+    restartJournal();
+    publishSnapshot();
+}
+
+void LoudnessDataStore::clearHistory()
+{
+    double duration = sampleInterval;
+    for (auto& lod : lodLevels)
+    {
+        for (auto& column : lod.columns)
+            column.clear(readerEpochs.getEpoch());
+        
+        lod.gatedEnergy.clear(readerEpochs.getEpoch());
+        lod.gatedBlocks.clear(readerEpochs.getEpoch());
+        
+        lod.indexBase = lod.columns[0].getEndIndex();
+        lod.bucketDuration = duration;
+        lod.currentBucket.reset();
+        lod.currentBucketIndex = -1;
+        lod.samplesInCurrentBucket = 0;
+        lod.droppedBuckets = 0;
+        duration *= lodFactor;
+    }
+    
+    nextPointIndex = 0;
+    lastPointIndex = -1;
+    nextSequence = 0;
+    historyId = makeHistoryId();
+    
+    currentTimestamp.store(0.0, std::memory_order_release);
+}
+
+void LoudnessDataStore::waitForReaders()
+{
+    // Readers hold a ReadView only for the length of a query, so this is a short spin
+    const uint64_t currentEpoch = readerEpochs.getEpoch();
+    while (readerEpochs.getOldestActiveEpoch() < currentEpoch)
+        std::this_thread::yield();
+    
+    reclaimRetired();
+}
+
+bool LoudnessDataStore::setBackingDirectory(const juce::File& directory)
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    if (directory == backingDirectory)
+        return true;
+    
+    if (backingDirectory != juce::File())
+        saveIndex();
+    
+    // Every page has to be back in its pool before the pools change where pages live
+    clearHistory();
+    publishSnapshot();
+    waitForReaders();
+    closeBackingFiles();
+    
+    bool opened = true;
+    
+    if (directory != juce::File())
+    {
+        opened = openBackingFiles(directory);
+        
+        if (opened && !loadIndex())
+        {
+            columnPool.setBacking(&columnFile, {});
+            energyPool.setBacking(&energyFile, {});
+            countPool.setBacking(&countFile, {});
+        }
+    }
+    
+    // File pages are what the index records, so they stay uncompressed; the OS pages
+    // out the ones nobody reads
+    setPageCompression(backingDirectory == juce::File());
+    
+    // The audio thread carries on from the restored history
+    resumeIndex.store(nextPointIndex, std::memory_order_relaxed);
+    epoch.fetch_add(1, std::memory_order_release);
+    
+    restartJournal();
+    publishSnapshot();
+    return opened;
+}
+
+void LoudnessDataStore::setPageCompression(bool enabled)
+{
+    for (auto& lod : lodLevels)
+    {
+        for (auto& column : lod.columns)
+            column.setCompression(enabled);
+        
+        lod.gatedEnergy.setCompression(enabled);
+        lod.gatedBlocks.setCompression(enabled);
+    }
+}
+
+juce::File LoudnessDataStore::getBackingDirectory() const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return backingDirectory;
+}
+
+void LoudnessDataStore::setBackingRoot(const juce::File& directory)
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    backingRoot = directory;
+}
+
+juce::File LoudnessDataStore::findSavedBackingDirectory(const juce::String& relativePath) const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    if (backingRoot == juce::File() || relativePath.isEmpty() || juce::File::isAbsolutePath(relativePath))
+        return {};
+    
+    // Nothing is created or opened unless the directory already holds a history this
+    // store can carry on
+    const auto directory = backingRoot.getChildFile(relativePath);
+    return directory.isAChildOf(backingRoot) && readIndexRate(directory) == updateRate ? directory : juce::File();
+}
+
+bool LoudnessDataStore::setJournalFile(const juce::File& file)
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    // The journal in use is replayed like any other, so restoring a state saved during
+    // this session brings back what was recorded since
+    const bool isCurrent = file != juce::File() && file == journal.getFile();
+    
+    if (!isCurrent && file != juce::File() && MeasurementJournal::isInUse(file))
+        return false;
+    
+    closeJournal(isCurrent);
+    
+    if (file == juce::File())
+        return true;
+    
+    if (!file.exists())
+        return journal.start(file, { historyId, updateRate });
+    
+    MeasurementJournal::Header header;
+    auto isOurs = [&] { return header.historyId == historyId && header.updateRate == updateRate; };
+    bool continuesHistory = true;
+    int64_t latestIndex = -1;
+    
+    // Records up to nextSequence are already in the history, replacements included. A
+    // journal that begins past nextSequence is missing the points in between, so
+    // nothing after the gap applies.
+    const auto intactLength = MeasurementJournal::replay(file, header, [&](const MeasurementJournal::Record& record)
+    {
+        if (!isOurs() || !continuesHistory || record.sequence < nextSequence)
+            return;
+        
+        if (record.sequence > nextSequence)
+        {
+            continuesHistory = false;
+            return;
+        }
+        
+        updateLodLevels(record.momentary, record.shortTerm, record.truePeak, record.index);
+        nextSequence = record.sequence + 1;
+        latestIndex = record.index;
+    });
+    
+    // Whatever else the file holds is left as it is, for whoever wrote it
+    if (intactLength < 0 || !isOurs())
+        return startJournalNextTo(file);
+    
+    if (latestIndex >= 0)
+        currentTimestamp.store(static_cast<double>(latestIndex) * sampleInterval, std::memory_order_release);
+    
+    // The audio thread carries on after the replayed points
+    resumeIndex.store(nextPointIndex, std::memory_order_relaxed);
+    epoch.fetch_add(1, std::memory_order_release);
+    
+    publishSnapshot();
+    
+    if (!continuesHistory)
+        return startJournalNextTo(file);
+    
+    // A state saved before the crash names this journal too
+    journalInState = true;
+    return journal.resume(file, intactLength);
+}
+
+juce::File LoudnessDataStore::getJournalFile() const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return journal.getFile();
+}
+
+void LoudnessDataStore::setJournalDirectory(const juce::File& directory)
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    journalDirectory = directory;
+}
+
+juce::File LoudnessDataStore::getJournalDirectory() const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    return journalDirectory;
+}
+
+bool LoudnessDataStore::isJournalName(const juce::String& name)
+{
+    return name.endsWith(".journal") && !name.startsWithChar('.') && !name.containsAnyOf("/\\:");
+}
+
+void LoudnessDataStore::restartJournal()
+{
+    if (!journal.isActive())
+        return;
+    
+    if (!journalInState)
+    {
+        journal.start(journal.getFile(), { historyId, updateRate });
+        return;
+    }
+    
+    // A saved state names the journal, and needs its points if the session crashes
+    const auto file = journal.getFile();
+    closeJournal(true);
+    startJournalNextTo(file);
+}
+
+bool LoudnessDataStore::startJournalNextTo(const juce::File& file)
+{
+    return journal.start(file.getSiblingFile(juce::Uuid().toString() + ".journal"), { historyId, updateRate });
+}
+
+void LoudnessDataStore::trimJournal() const
+{
+    if (journal.isActive())
+        journal.start(journal.getFile(), { historyId, updateRate });
+}
+
+void LoudnessDataStore::closeJournal(bool keepFile)
+{
+    const auto file = journal.getFile();
+    keepFile = keepFile || journalInState;
+    journal.stop(!keepFile);
+    
+    if (keepFile && file != juce::File() && std::find(retiredJournals.begin(), retiredJournals.end(), file) == retiredJournals.end())
+        retiredJournals.push_back(file);
+    
+    journalInState = false;
+}
+
+bool LoudnessDataStore::openBackingFiles(const juce::File& directory)
+{
+    if (directory.createDirectory().failed()
+        || !columnFile.open(directory.getChildFile("columns.pages"), kBucketsPerPage * sizeof(int16_t))
+        || !energyFile.open(directory.getChildFile("energy.pages"), kBucketsPerPage * sizeof(double))
+        || !countFile.open(directory.getChildFile("counts.pages"), kBucketsPerPage * sizeof(uint32_t)))
+    {
+        columnFile.close();
+        energyFile.close();
+        countFile.close();
+        return false;
+    }
+    
+    backingDirectory = directory;
+    return true;
+}
+
+void LoudnessDataStore::closeBackingFiles()
+{
+    columnPool.setBacking(nullptr, {});
+    energyPool.setBacking(nullptr, {});
+    countPool.setBacking(nullptr, {});
+    
+    columnFile.close();
+    energyFile.close();
+    countFile.close();
+    backingDirectory = juce::File();
+}
+
+namespace
+{
+    // Sizes of the fixed parts of history.index (the header as of version 2)
+    constexpr juce::int64 kIndexHeaderBytes = 48;
+    constexpr juce::int64 kLevelHeaderBytes = 60;
+    constexpr juce::int64 kArrayHeaderBytes = 20;
+    constexpr juce::int64 kPageNumberBytes = 8;
+    
+    // Index entry for one paged array: its extent and the file page of each of its pages
+    template <typename Array, typename Pool>
+    bool writeArray(juce::OutputStream& out, const Array& array, const Pool& pool, size_t pageSize)
+    {
+        out.writeInt64(static_cast<juce::int64>(array.getFirstIndex()));
+        out.writeInt64(static_cast<juce::int64>(array.getEndIndex()));
+        out.writeInt(static_cast<int>(array.getNumPages()));
+        
+        bool allInFile = true;
+        for (size_t page = 0; page < array.getNumPages(); ++page)
+        {
+            const size_t pageNumber = pool.getPageNumber(array.getPageFor(array.getFirstIndex() + page * pageSize));
+            allInFile = allInFile && pageNumber != SIZE_MAX;
+            out.writeInt64(static_cast<juce::int64>(pageNumber));
+        }
+        
+        return allInFile;
+    }
+    
+    struct ArrayEntry
+    {
+        size_t firstIndex{0};
+        size_t endIndex{0};
+        std::vector<size_t> pages;
+    };
+    
+    // Each file page may belong to one array only; pagesInUse has one flag per page in
+    // the file and collects the pages of every array read so far
+    bool readArray(juce::InputStream& in, size_t pageSize, std::vector<bool>& pagesInUse, ArrayEntry& entry)
+    {
+        // A short read gives zeros, so a truncated index must be caught before reading
+        if (in.getNumBytesRemaining() < kArrayHeaderBytes)
+            return false;
+        
+        entry.firstIndex = static_cast<size_t>(in.readInt64());
+        entry.endIndex = static_cast<size_t>(in.readInt64());
+        const int numPages = in.readInt();
+        
+        const size_t expectedPages = entry.endIndex == entry.firstIndex ? 0
+            : (entry.endIndex - 1) / pageSize - entry.firstIndex / pageSize + 1;
+        
+        if (entry.endIndex < entry.firstIndex || numPages < 0 || static_cast<size_t>(numPages) != expectedPages
+            || in.getNumBytesRemaining() < static_cast<juce::int64>(numPages) * kPageNumberBytes)
+            return false;
+        
+        for (int i = 0; i < numPages; ++i)
+        {
+            const auto page = static_cast<size_t>(in.readInt64());
+            if (page >= pagesInUse.size() || pagesInUse[page])
+                return false;
+            
+            pagesInUse[page] = true;
+            entry.pages.push_back(page);
+        }
+        
+        return true;
+    }
+    
+    template <typename Array, typename Pool>
+    void restoreArray(Array& array, const Pool& pool, const ArrayEntry& entry, uint64_t epoch)
+    {
+        std::vector<decltype(pool.getPage(0))> pages;
+        for (auto page : entry.pages)
+            pages.push_back(pool.getPage(page));
+        
+        array.restore(pages, entry.firstIndex, entry.endIndex, epoch);
+    }
+}
+
+double LoudnessDataStore::readIndexRate(const juce::File& directory)
+{
+    juce::FileInputStream in(directory.getChildFile("history.index"));
+    
+    if (!in.openedOk() || in.getTotalLength() < kIndexHeaderBytes || in.readInt() != kIndexMagic)
+        return 0.0;
+    
+    const int version = in.readInt();
+    return version >= 1 && version <= kIndexVersion ? in.readDouble() : 0.0;
+}
+
+bool LoudnessDataStore::saveIndex() const
+{
+    juce::MemoryOutputStream out;
+    out.writeInt(kIndexMagic);
+    out.writeInt(kIndexVersion);
+    out.writeDouble(updateRate);
+    out.writeInt(numLods);
+    out.writeInt(lodFactorShift);
+    out.writeInt64(nextPointIndex);
+    out.writeInt64(lastPointIndex);
+    out.writeInt64(nextSequence);
+    
+    bool allInFile = true;
+    
+    for (size_t level = 0; level < static_cast<size_t>(numLods); ++level)
+    {
+        const auto& lod = lodLevels[level];
+        out.writeInt64(static_cast<juce::int64>(lod.indexBase));
+        out.writeInt64(static_cast<juce::int64>(lod.droppedBuckets));
+        out.writeInt64(lod.currentBucketIndex);
+        out.writeInt(lod.samplesInCurrentBucket);
+        
+        const auto& bucket = lod.currentBucket;
+        out.writeFloat(bucket.momentaryMin);
+        out.writeFloat(bucket.momentaryMax);
+        out.writeFloat(bucket.shortTermMin);
+        out.writeFloat(bucket.shortTermMax);
+        out.writeFloat(bucket.truePeakMax);
+        out.writeDouble(bucket.gatedEnergy);
+        out.writeInt(static_cast<int>(bucket.gatedBlocks));
+        
+        for (const auto& column : lod.columns)
+            allInFile = writeArray(out, column, columnPool, kBucketsPerPage) && allInFile;
+        
+        allInFile = writeArray(out, lod.gatedEnergy, energyPool, kBucketsPerPage) && allInFile;
+        allInFile = writeArray(out, lod.gatedBlocks, countPool, kBucketsPerPage) && allInFile;
+    }
+    
+    // Pages that fell back to the heap can't be restored; keep the last complete index
+    return allInFile && backingDirectory.getChildFile("history.index").replaceWithData(out.getData(), out.getDataSize());
+}
+
+bool LoudnessDataStore::loadIndex()
+{
+    juce::MemoryBlock data;
+    if (!backingDirectory.getChildFile("history.index").loadFileAsData(data))
+        return false;
+    
+    juce::MemoryInputStream in(data, false);
+    
+    if (in.getTotalLength() < kIndexHeaderBytes || in.readInt() != kIndexMagic)
+        return false;
+    
+    const int version = in.readInt();
+    if (version < 1 || version > kIndexVersion || in.readDouble() != updateRate)
+        return false;
+    
+    const int savedLods = in.readInt();
+    const int savedShift = in.readInt();
+    const juce::int64 savedNextPoint = in.readInt64();
+    const juce::int64 savedLastPoint = in.readInt64();
+    
+    // Version 1 histories only ever appended, one point per index
+    const juce::int64 savedSequence = version >= 2 ? in.readInt64() : savedNextPoint;
+    
+    if (savedLods < 1 || savedLods > kMaxLods || savedShift < 1 || savedShift > 3 || savedNextPoint < 0)
+        return false;
+    
+    struct LevelEntry
+    {
+        size_t indexBase{0};
+        size_t droppedBuckets{0};
+        int64_t currentBucketIndex{-1};
+        int samplesInCurrentBucket{0};
+        MinMaxPoint currentBucket;
+        std::array<ArrayEntry, kNumColumns> columns;
+        ArrayEntry gatedEnergy;
+        ArrayEntry gatedBlocks;
+    };
+    
+    std::vector<LevelEntry> levels(static_cast<size_t>(savedLods));
+    std::vector<size_t> columnPages, energyPages, countPages;
+    std::vector<bool> columnPagesInUse(columnFile.getNumPages(), false);
+    std::vector<bool> energyPagesInUse(energyFile.getNumPages(), false);
+    std::vector<bool> countPagesInUse(countFile.getNumPages(), false);
+    
+    for (auto& level : levels)
+    {
+        if (in.getNumBytesRemaining() < kLevelHeaderBytes)
+            return false;
+        
+        level.indexBase = static_cast<size_t>(in.readInt64());
+        level.droppedBuckets = static_cast<size_t>(in.readInt64());
+        level.currentBucketIndex = in.readInt64();
+        level.samplesInCurrentBucket = in.readInt();
+        level.currentBucket.momentaryMin = in.readFloat();
+        level.currentBucket.momentaryMax = in.readFloat();
+        level.currentBucket.shortTermMin = in.readFloat();
+        level.currentBucket.shortTermMax = in.readFloat();
+        level.currentBucket.truePeakMax = in.readFloat();
+        level.currentBucket.gatedEnergy = in.readDouble();
+        level.currentBucket.gatedBlocks = static_cast<uint32_t>(in.readInt());
+        
+        for (auto& column : level.columns)
+        {
+            if (!readArray(in, kBucketsPerPage, columnPagesInUse, column))
+                return false;
+            
+            columnPages.insert(columnPages.end(), column.pages.begin(), column.pages.end());
+        }
+        
+        if (!readArray(in, kBucketsPerPage, energyPagesInUse, level.gatedEnergy)
+            || !readArray(in, kBucketsPerPage, countPagesInUse, level.gatedBlocks))
+            return false;
+        
+        energyPages.insert(energyPages.end(), level.gatedEnergy.pages.begin(), level.gatedEnergy.pages.end());
+        countPages.insert(countPages.end(), level.gatedBlocks.pages.begin(), level.gatedBlocks.pages.end());
+    }
+    
+    if (in.getPosition() != in.getTotalLength())
+        return false;
+    
+    // The index is valid: hand the pools their files and rebuild the levels on them
+    columnPool.setBacking(&columnFile, columnPages);
+    energyPool.setBacking(&energyFile, energyPages);
+    countPool.setBacking(&countFile, countPages);
+    
+    numLods = savedLods;
+    lodFactorShift = savedShift;
+    lodFactor = 1 << lodFactorShift;
+    
+    const uint64_t restoreEpoch = readerEpochs.getEpoch();
+    double duration = sampleInterval;
+    
+    for (size_t i = 0; i < lodLevels.size(); ++i)
+    {
+        auto& lod = lodLevels[i];
+        lod.bucketDuration = duration;
+        duration *= lodFactor;
+        
+        if (i >= levels.size())
+            continue;
+        
+        const auto& level = levels[i];
+        for (size_t column = 0; column < kNumColumns; ++column)
+            restoreArray(lod.columns[column], columnPool, level.columns[column], restoreEpoch);
+        
+        restoreArray(lod.gatedEnergy, energyPool, level.gatedEnergy, restoreEpoch);
+        restoreArray(lod.gatedBlocks, countPool, level.gatedBlocks, restoreEpoch);
+        
+        lod.indexBase = level.indexBase;
+        lod.droppedBuckets = level.droppedBuckets;
+        lod.currentBucketIndex = level.currentBucketIndex;
+        lod.samplesInCurrentBucket = level.samplesInCurrentBucket;
+        lod.currentBucket = level.currentBucket;
+    }
+    
+    nextPointIndex = savedNextPoint;
+    lastPointIndex = savedLastPoint;
+    nextSequence = savedSequence;
+    currentTimestamp.store(static_cast<double>(std::max<int64_t>(0, lastPointIndex)) * sampleInterval,
+                           std::memory_order_release);
+    return true;
+}
+
+void LoudnessDataStore::writeState(juce::OutputStream& out) const
+{
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    out.writeInt(kStateMagic);
+    out.writeInt(kStateVersion);
+    out.writeInt64(static_cast<juce::int64>(historyId));
+    out.writeString(journal.getFile().getFileName());
+    journalInState = journal.isActive();
+    
+    // The files already hold the history; only make sure their index is current. The
+    // blob names them relative to the backing root, so files kept anywhere else are
+    // saved like a history in memory.
+    const bool fileBacked = backingDirectory.isAChildOf(backingRoot);
+    out.writeBool(fileBacked);
+    
+    if (fileBacked)
+    {
+        saveIndex();
+        out.writeString(backingDirectory.getRelativePathFrom(backingRoot));
+        return;
+    }
+    
+    out.writeDouble(updateRate);
+    out.writeInt(numLods);
+    out.writeInt(lodFactorShift);
+    out.writeInt64(nextPointIndex);
+    out.writeInt64(lastPointIndex);
+    out.writeInt64(nextSequence);
+    
+    // Roughly two bytes per bucket and column, so the buffer grows at most once or twice
+    size_t numBuckets = 0;
+    for (size_t level = 0; level < static_cast<size_t>(numLods); ++level)
+        numBuckets += lodLevels[level].columns[0].size();
+    
+    std::vector<uint8_t> levels;
+    levels.reserve(numBuckets * (kNumColumns + 2) * 2 + 256);
+    
+    for (size_t level = 0; level < static_cast<size_t>(numLods); ++level)
+        encodeLevel(levels, lodLevels[level]);
+    
+    out.writeInt64(static_cast<juce::int64>(levels.size()));
+    out.write(levels.data(), levels.size());
+}
+
+bool LoudnessDataStore::readState(juce::InputStream& in)
+{
+    const int magic = in.readInt();
+    const int version = in.readInt();
+    
+    if (magic != kStateMagic || version < 1 || version > kStateVersion)
+    {
+        reset();
+        return false;
+    }
+    
+    // Version 1 had no journal
+    const auto savedHistoryId = version >= 2 ? static_cast<uint64_t>(in.readInt64()) : makeHistoryId();
+    const auto journalName = version >= 2 ? in.readString() : juce::String();
+    bool restored = false;
+    
+    if (in.readBool())
+    {
+        const auto directory = findSavedBackingDirectory(in.readString());
+        restored = directory != juce::File() && setBackingDirectory(directory);
+        
+        if (restored)
+        {
+            std::lock_guard<std::mutex> lock(dataMutex);
+            historyId = savedHistoryId;
+        }
+        else
+        {
+            reset();
+        }
+    }
+    else
+    {
+        restored = readHistory(in, version, savedHistoryId);
+    }
+    
+    // Points the saved journal recorded after the state was written; without them the
+    // journal in use starts over for the restored history. The blob only names the
+    // journal, and it is only looked for among this store's own.
+    if (restored && !(isJournalName(journalName) && setJournalFile(getJournalDirectory().getChildFile(journalName))))
+    {
+        std::lock_guard<std::mutex> lock(dataMutex);
+        restartJournal();
+    }
+    
+    return restored;
+}
+
+bool LoudnessDataStore::readHistory(juce::InputStream& in, int version, uint64_t savedHistoryId)
+{
+    // A history from memory replaces whatever the files held
+    setBackingDirectory(juce::File());
+    
+    const double savedRate = in.readDouble();
+    const int savedLods = in.readInt();
+    const int savedShift = in.readInt();
+    const juce::int64 savedNextPoint = in.readInt64();
+    const juce::int64 savedLastPoint = in.readInt64();
+    
+    // Before version 3 histories only appended, one point per index
+    const juce::int64 savedSequence = version >= 3 ? in.readInt64() : savedNextPoint;
+    const juce::int64 payloadSize = in.readInt64();
+    
+    const bool headerFits = savedLods >= 1 && savedLods <= kMaxLods && savedShift >= 1 && savedShift <= 3
+                         && savedNextPoint >= 0 && payloadSize >= 0 && payloadSize <= in.getNumBytesRemaining()
+                         && payloadSize < std::numeric_limits<int>::max();
+    
+    juce::MemoryBlock payload;
+    if (headerFits)
+    {
+        payload.setSize(static_cast<size_t>(payloadSize));
+        in.read(payload.getData(), static_cast<int>(payloadSize));
+    }
+    
+    std::lock_guard<std::mutex> lock(dataMutex);
+    
+    bool restored = headerFits && savedRate == updateRate;
+    
+    if (restored)
+    {
+        numLods = savedLods;
+        lodFactorShift = savedShift;
+        lodFactor = 1 << lodFactorShift;
+    }
+    
+    clearHistory();
+    
+    if (restored)
+    {
+        DeltaCodec::Reader reader(payload.getData(), payload.getSize());
+        
+        for (size_t level = 0; level < static_cast<size_t>(numLods) && restored; ++level)
+            restored = decodeLevel(reader, lodLevels[level]);
+        
+        restored = restored && reader.isExhausted();
+    }
+    
+    if (restored)
+    {
+        nextPointIndex = savedNextPoint;
+        lastPointIndex = savedLastPoint;
+        nextSequence = savedSequence;
+        historyId = savedHistoryId;
+        currentTimestamp.store(static_cast<double>(std::max<int64_t>(0, lastPointIndex)) * sampleInterval,
+                               std::memory_order_release);
+    }
+    else
+    {
+        clearHistory();
+        restartJournal();
+    }
+    
+    // Points queued before the restore belong to the old history
+    resumeIndex.store(nextPointIndex, std::memory_order_relaxed);
+    epoch.fetch_add(1, std::memory_order_release);
+    
+    publishSnapshot();
+    return restored;
+}
+
+uint32_t LoudnessDataStore::quantiseEnergy(double meanSquare)
+{
+    // Rounded to 20 bits, leaving 11 of the mantissa: under 0.001 LU of error
+    const auto value = static_cast<float>(meanSquare);
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits + (1u << (kEnergyDroppedBits - 1))) >> kEnergyDroppedBits;
+}
+
+double LoudnessDataStore::dequantiseEnergy(uint32_t units)
+{
+    const uint32_t bits = units << kEnergyDroppedBits;
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return static_cast<double>(value);
+}
+
+void LoudnessDataStore::encodeLevel(std::vector<uint8_t>& out, const LodLevel& lod) const
+{
+    const size_t numBuckets = lod.columns[0].size();
+    
+    DeltaCodec::writeSigned(out, static_cast<int64_t>(lod.columns[0].getFirstIndex() - lod.indexBase));
+    DeltaCodec::writeVarint(out, numBuckets);
+    DeltaCodec::writeVarint(out, lod.droppedBuckets);
+    DeltaCodec::writeSigned(out, lod.currentBucketIndex);
+    DeltaCodec::writeVarint(out, static_cast<uint64_t>(lod.samplesInCurrentBucket));
+    
+    // The open bucket is kept exact, since more children will be merged into it
+    const auto& bucket = lod.currentBucket;
+    DeltaCodec::writeRaw(out, bucket.momentaryMin);
+    DeltaCodec::writeRaw(out, bucket.momentaryMax);
+    DeltaCodec::writeRaw(out, bucket.shortTermMin);
+    DeltaCodec::writeRaw(out, bucket.shortTermMax);
+    DeltaCodec::writeRaw(out, bucket.truePeakMax);
+    DeltaCodec::writeRaw(out, bucket.gatedEnergy);
+    DeltaCodec::writeVarint(out, bucket.gatedBlocks);
+    
+    // Column by column, so each delta is taken against the same metric
+    for (const auto& column : lod.columns)
+    {
+        int64_t previous = 0;
+        column.getView().forEachRun(0, numBuckets, [&out, &previous](const int16_t* run, size_t runLength)
+        {
+            DeltaCodec::writeDeltas(out, run, runLength, previous);
+        });
+    }
+    
+    const auto blocksView = lod.gatedBlocks.getView();
+    int64_t previous = 0;
+    
+    blocksView.forEachRun(0, numBuckets, [&out, &previous](const uint32_t* run, size_t runLength)
+    {
+        DeltaCodec::writeDeltas(out, run, runLength, previous);
+    });
+    
+    // Energy as the mean per gated block, quantised to the top bits of its float, which
+    // grow with the logarithm of the energy, so neighbouring buckets give small deltas.
+    // Runs of the two arrays line up, as both have the same pages.
+    previous = 0;
+    size_t first = 0;
+    
+    lod.gatedEnergy.getView().forEachRun(0, numBuckets, [&](const double* energy, size_t runLength)
+    {
+        std::array<uint32_t, kBucketsPerPage> units;
+        size_t numUnits = 0;
+        
+        for (size_t j = 0; j < runLength; ++j)
+        {
+            const uint32_t blocks = blocksView[first + j];
+            if (blocks > 0)
+                units[numUnits++] = quantiseEnergy(energy[j] / blocks);
+        }
+        
+        DeltaCodec::writeDeltas(out, units.data(), numUnits, previous);
+        first += runLength;
+    });
+}
+
+bool LoudnessDataStore::decodeLevel(DeltaCodec::Reader& reader, LodLevel& lod)
+{
+    const int64_t firstBucket = reader.readSigned();
+    const uint64_t numBuckets = reader.readVarint();
+    const uint64_t droppedBuckets = reader.readVarint();
+    const int64_t currentBucketIndex = reader.readSigned();
+    const uint64_t samplesInCurrentBucket = reader.readVarint();
+    
+    MinMaxPoint bucket;
+    bucket.momentaryMin = reader.readRaw<float>();
+    bucket.momentaryMax = reader.readRaw<float>();
+    bucket.shortTermMin = reader.readRaw<float>();
+    bucket.shortTermMax = reader.readRaw<float>();
+    bucket.truePeakMax = reader.readRaw<float>();
+    bucket.gatedEnergy = reader.readRaw<double>();
+    bucket.gatedBlocks = static_cast<uint32_t>(reader.readVarint());
+    
+    // Every value takes at least a byte, which bounds the bucket count before allocating
+    if (reader.hasFailed() || numBuckets > reader.getNumRemaining() / (kNumColumns + 1)
+        || samplesInCurrentBucket > static_cast<uint64_t>(kBucketsPerPage))
+        return false;
+    
+    const auto count = static_cast<size_t>(numBuckets);
+    std::array<std::vector<int16_t>, kNumColumns> columns;
+    std::vector<uint32_t> blocks(count);
+    std::vector<double> energy(count, 0.0);
+    
+    for (auto& column : columns)
+    {
+        column.resize(count);
+        int64_t previous = 0;
+        reader.readDeltas(column.data(), count, previous);
+    }
+    
+    int64_t previous = 0;
+    reader.readDeltas(blocks.data(), count, previous);
+    
+    previous = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (blocks[i] == 0)
+            continue;
+        
+        previous += reader.readSigned();
+        energy[i] = blocks[i] * dequantiseEnergy(static_cast<uint32_t>(previous));
+    }
+    
+    if (reader.hasFailed())
+        return false;
+    
+    // Bucket firstBucket goes where the cleared arrays continue; indices wrap like the
+    // array indices do, so indexBase may wrap below zero
+    lod.indexBase = lod.columns[0].getEndIndex() - static_cast<size_t>(firstBucket);
+    
+    const uint64_t epochNow = readerEpochs.getEpoch();
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (size_t column = 0; column < kNumColumns; ++column)
+            lod.columns[column].push_back(columns[column][i], epochNow);
+        
+        lod.gatedEnergy.push_back(energy[i], epochNow);
+        lod.gatedBlocks.push_back(blocks[i], epochNow);
+    }
+    
+    lod.droppedBuckets = static_cast<size_t>(droppedBuckets);
+    lod.currentBucketIndex = currentBucketIndex;
+    lod.samplesInCurrentBucket = static_cast<int>(samplesInCurrentBucket);
+    lod.currentBucket = bucket;
+    return true;
+}
+
+void LoudnessDataStore::addPoint(float momentary, float shortTerm, float truePeak)
+{
+    const auto currentEpoch = syncProducer();
+    if (!isProducerRateCurrent())
+        return;
+    
+    queuePoint({ momentary, shortTerm, truePeak, currentEpoch, producerIndex++ });
+}
+
+void LoudnessDataStore::addPointAt(int64_t pointIndex, float momentary, float shortTerm, float truePeak)
+{
+    const auto currentEpoch = syncProducer();
+    
+    // Pre-roll before the start of the timeline
+    if (pointIndex < 0 || !isProducerRateCurrent())
+        return;
+    
+    producerIndex = std::max(producerIndex, pointIndex + 1);
+    queuePoint({ momentary, shortTerm, truePeak, currentEpoch, pointIndex });
+}
+
+uint32_t LoudnessDataStore::syncProducer()
 {
-    double duration = 0.1;
-    for (int i = 0; i < kNumLods; ++i)
+    const auto currentEpoch = epoch.load(std::memory_order_acquire);
+    if (currentEpoch != producerEpoch)
     {
-        lodLevels[static_cast<size_t>(i)].bucketDuration = duration;
-        lodLevels[static_cast<size_t>(i)].buckets.reserve(10000);
-        lodLevels[static_cast<size_t>(i)].currentBucket.reset();
-        lodLevels[static_cast<size_t>(i)].currentBucketStart = -1.0;
-        lodLevels[static_cast<size_t>(i)].samplesInCurrentBucket = 0;
-        duration *= 4.0;
+        producerEpoch = currentEpoch;
+        producerIndex = resumeIndex.load(std::memory_order_relaxed);
     }
+    
+    return currentEpoch;
 }
 
-void LoudnessDataStore::prepare(double updateRateHz)
+bool LoudnessDataStore::isProducerRateCurrent() const
 {
-    updateRate = updateRateHz;
-    sampleInterval = 1.0 / updateRate;
+    // A reset seen by syncProducer() is ordered after the rate it starts the history at
+    return producerRate == 0.0 || producerRate == historyRate.load(std::memory_order_relaxed);
 }
 
-void LoudnessDataStore::reset()
+void LoudnessDataStore::queuePoint(const PendingPoint& point)
 {
-    std::lock_guard<std::mutex> lock(dataMutex);
+    int start1, size1, start2, size2;
+    pendingFifo.prepareToWrite(1, start1, size1, start2, size2);
+    
+    if (size1 > 0)
+    {
+        pendingPoints[static_cast<size_t>(start1)] = point;
+        pendingFifo.finishedWrite(1);
+    }
+}
+
+void LoudnessDataStore::run()
+{
+    while (!threadShouldExit())
+    {
+        ingestPendingPoints();
+        
+        {
+            // Readers that were still inside at the last publish may have left since
+            std::lock_guard<std::mutex> lock(dataMutex);
+            reclaimRetired();
+            
+            if (backingDirectory != juce::File() && ++wakesSinceIndexSave >= kWakesPerIndexSave)
+            {
+                // Pages released before this index was written are no longer in it
+                if (saveIndex())
+                {
+                    columnPool.reuseReleasedPages();
+                    energyPool.reuseReleasedPages();
+                    countPool.reuseReleasedPages();
+                    
+                    // A file-backed history is always restored from its latest index, so
+                    // the journal only needs what came after it
+                    trimJournal();
+                }
+                
+                wakesSinceIndexSave = 0;
+            }
+        }
+        
+        wait(kIngestionIntervalMs);
+    }
+}
+
+void LoudnessDataStore::ingestPendingPoints()
+{
+    int start1, size1, start2, size2;
+    pendingFifo.prepareToRead(pendingFifo.getNumReady(), start1, size1, start2, size2);
     
-    totalSampleCount = 0;
+    if (size1 + size2 == 0)
+        return;
     
-    double duration = sampleInterval;
-    for (int i = 0; i < kNumLods; ++i)
     {
-        auto& lod = lodLevels[static_cast<size_t>(i)];
-        lod.buckets.clear();
-        lod.bucketDuration = duration;
-        lod.currentBucket.reset();
-        lod.currentBucketStart = -1.0;
-        lod.samplesInCurrentBucket = 0;
-        duration *= 4.0;
+        std::lock_guard<std::mutex> lock(dataMutex);
+        
+        const auto currentEpoch = epoch.load(std::memory_order_acquire);
+        double latest = -1.0;
+        
+        auto ingest = [&](int start, int size)
+        {
+            for (int i = start; i < start + size; ++i)
+            {
+                const auto& point = pendingPoints[static_cast<size_t>(i)];
+                if (point.epoch != currentEpoch)
+                    continue;
+                
+                const double timestamp = static_cast<double>(point.index) * sampleInterval;
+                updateLodLevels(point.momentary, point.shortTerm, point.truePeak, point.index);
+                journal.append({ nextSequence++, point.index, point.momentary, point.shortTerm, point.truePeak });
+                latest = timestamp;
+            }
+        };
+        
+        ingest(start1, size1);
+        ingest(start2, size2);
+        
+        if (latest >= 0.0)
+            currentTimestamp.store(latest, std::memory_order_release);
+        
+        publishSnapshot();
     }
     
-    currentTimestamp.store(0.0, std::memory_order_release);
+    pendingFifo.finishedRead(size1 + size2);
 }
 
-void LoudnessDataStore::addPoint(float momentary, float shortTerm)
+void LoudnessDataStore::updateLodLevels(float momentary, float shortTerm, float truePeak, int64_t pointIndex)
 {
-    std::lock_guard<std::mutex> lock(dataMutex);
+    MinMaxPoint point;
+    point.addSample(momentary, shortTerm, truePeak, 0.0);
+    
+    // With a hop finer than 100ms consecutive momentary windows overlap by more than
+    // BS.1770's 75%, so only the points on the gating grid count as blocks
+    if ((pointIndex + 1) % pointsPerGatingStep != 0)
+    {
+        point.gatedEnergy = 0.0;
+        point.gatedBlocks = 0;
+    }
+    
+    if (pointIndex < nextPointIndex)
+    {
+        replacePoint(point, pointIndex);
+        return;
+    }
+    
+    // Without gaps every bucket is closed by its own last child; a gap (dropped points,
+    // or the transport jumping ahead) may have skipped that child
+    if (pointIndex != nextPointIndex)
+        closeStaleBuckets(pointIndex);
+    
+    nextPointIndex = pointIndex + 1;
+    lastPointIndex = pointIndex;
+    
+    addToLevel(0, point, pointIndex, true);
+}
+
+void LoudnessDataStore::replacePoint(const MinMaxPoint& point, int64_t pointIndex)
+{
+    auto& finest = lodLevels[0];
+    const size_t arrayIndex = static_cast<size_t>(pointIndex) + finest.indexBase;
+    
+    // Points older than what LOD0 retains have nowhere to go
+    if (arrayIndex - finest.columns[0].getFirstIndex() >= finest.columns[0].size()
+        || !writeBucket(finest, arrayIndex, point))
+        return;
+    
+    for (size_t level = 1; level < static_cast<size_t>(numLods); ++level)
+        if (!rebuildBucket(level, pointIndex >> (static_cast<int>(level) * lodFactorShift)))
+            break;
+}
+
+bool LoudnessDataStore::rebuildBucket(size_t level, int64_t bucketIndex)
+{
+    auto& lod = lodLevels[level];
+    const auto& children = lodLevels[level - 1];
+    const auto& childColumn = children.columns[0];
+    const size_t firstChild = (static_cast<size_t>(bucketIndex) << lodFactorShift) + children.indexBase;
+    
+    // Children dropped by retention can't be merged again, so the bucket keeps what it has
+    if (firstChild - childColumn.getFirstIndex() >= childColumn.size())
+        return false;
+    
+    // Merged in order from an empty bucket, as closeBucket() did, so an unchanged child
+    // gives back exactly the same energy
+    MinMaxPoint merged;
+    const size_t endChild = std::min(firstChild + static_cast<size_t>(lodFactor), childColumn.getEndIndex());
+    
+    for (size_t child = firstChild; child < endChild; ++child)
+        merged.merge(readBucket(children, child));
+    
+    const size_t arrayIndex = static_cast<size_t>(bucketIndex) + lod.indexBase;
+    if (arrayIndex - lod.columns[0].getFirstIndex() < lod.columns[0].size())
+        return writeBucket(lod, arrayIndex, merged);
     
-    double timestamp = static_cast<double>(totalSampleCount) * sampleInterval;
-    totalSampleCount++;
+    // The open bucket holds the children closed so far, and no coarser bucket holds it yet
+    if (lod.samplesInCurrentBucket > 0 && lod.currentBucketIndex == bucketIndex)
+        lod.currentBucket = merged;
     
-    updateLodLevels(momentary, shortTerm, timestamp);
+    return false;
+}
+
+LoudnessDataStore::MinMaxPoint LoudnessDataStore::readBucket(const LodLevel& lod, size_t arrayIndex)
+{
+    EncodedBucket encoded;
+    for (size_t column = 0; column < kNumColumns; ++column)
+        encoded.values[column] = lod.columns[column].get(arrayIndex);
+    
+    auto bucket = encoded.decode(0.0);
+    bucket.gatedEnergy = lod.gatedEnergy.get(arrayIndex);
+    bucket.gatedBlocks = lod.gatedBlocks.get(arrayIndex);
+    return bucket;
+}
+
+bool LoudnessDataStore::writeBucket(LodLevel& lod, size_t arrayIndex, const MinMaxPoint& bucket)
+{
+    // Only columns that change are written, so the others keep their pages
+    const auto encoded = EncodedBucket::encode(bucket);
+    bool changed = false;
+    
+    for (size_t column = 0; column < kNumColumns; ++column)
+    {
+        if (lod.columns[column].get(arrayIndex) != encoded.values[column])
+        {
+            lod.columns[column].set(arrayIndex, encoded.values[column]);
+            changed = true;
+        }
+    }
+    
+    if (lod.gatedEnergy.get(arrayIndex) != bucket.gatedEnergy)
+    {
+        lod.gatedEnergy.set(arrayIndex, bucket.gatedEnergy);
+        changed = true;
+    }
+    
+    if (lod.gatedBlocks.get(arrayIndex) != bucket.gatedBlocks)
+    {
+        lod.gatedBlocks.set(arrayIndex, bucket.gatedBlocks);
+        changed = true;
+    }
+    
+    return changed;
+}
+
+void LoudnessDataStore::addToLevel(size_t level, const MinMaxPoint& child, int64_t bucketIndex, bool isLastChild)
+{
+    auto& lod = lodLevels[level];
+    
+    if (lod.samplesInCurrentBucket > 0 && lod.currentBucketIndex != bucketIndex)
+        closeBucket(level);
+    
+    lod.currentBucketIndex = bucketIndex;
+    lod.currentBucket.merge(child);
+    lod.samplesInCurrentBucket++;
+    
+    if (isLastChild)
+        closeBucket(level);
+}
+
+void LoudnessDataStore::closeBucket(size_t level)
+{
+    auto& lod = lodLevels[level];
+    
+    // A bucket's time is its position, so buckets a gap skipped are stored empty, all in
+    // one go. A gap the retention cap would drop anyway starts the level over instead.
+    const size_t nextIndex = static_cast<size_t>(lod.currentBucketIndex) + lod.indexBase;
+    const auto gap = static_cast<int64_t>(nextIndex - lod.columns[0].getEndIndex());
+    
+    if (lod.maxBuckets > 0 && gap > static_cast<int64_t>(lod.maxBuckets))
+    {
+        lod.droppedBuckets += lod.columns[0].size() + static_cast<size_t>(gap);
+        
+        for (auto& column : lod.columns)
+            column.clear(readerEpochs.getEpoch());
+        
+        lod.gatedEnergy.clear(readerEpochs.getEpoch());
+        lod.gatedBlocks.clear(readerEpochs.getEpoch());
+        lod.indexBase = lod.columns[0].getEndIndex() - static_cast<size_t>(lod.currentBucketIndex);
+    }
+    else if (gap > 0)
+    {
+        appendBucket(lod, MinMaxPoint(), static_cast<size_t>(gap));
+    }
+    
+    const MinMaxPoint finished = lod.currentBucket;
+    appendBucket(lod, finished);
+    
+    // Retention works in whole pages, so the cap is exceeded by less than one page
+    const size_t numBuckets = lod.columns[0].size();
+    if (lod.maxBuckets > 0 && numBuckets >= lod.maxBuckets + kBucketsPerPage)
+    {
+        const size_t pages = (numBuckets - lod.maxBuckets) / kBucketsPerPage;
+        for (auto& column : lod.columns)
+            column.dropFrontPages(pages, readerEpochs.getEpoch());
+        
+        lod.gatedEnergy.dropFrontPages(pages, readerEpochs.getEpoch());
+        lod.gatedBlocks.dropFrontPages(pages, readerEpochs.getEpoch());
+        
+        lod.droppedBuckets += pages * kBucketsPerPage;
+    }
+    
+    const int64_t index = lod.currentBucketIndex;
+    lod.currentBucket.reset();
+    lod.samplesInCurrentBucket = 0;
+    
+    if (level + 1 < static_cast<size_t>(numLods))
+        addToLevel(level + 1, finished, index >> lodFactorShift, (index & (lodFactor - 1)) == lodFactor - 1);
+}
+
+void LoudnessDataStore::appendBucket(LodLevel& lod, const MinMaxPoint& bucket, size_t count)
+{
+    const auto encoded = EncodedBucket::encode(bucket);
+    
+    for (size_t column = 0; column < kNumColumns; ++column)
+        lod.columns[column].append(encoded.values[column], count, readerEpochs.getEpoch());
     
-    currentTimestamp.store(timestamp, std::memory_order_release);
+    lod.gatedEnergy.append(bucket.gatedEnergy, count, readerEpochs.getEpoch());
+    lod.gatedBlocks.append(bucket.gatedBlocks, count, readerEpochs.getEpoch());
 }
 
-void LoudnessDataStore::updateLodLevels(float momentary, float shortTerm, double timestamp)
+void LoudnessDataStore::closeStaleBuckets(int64_t pointIndex)
 {
-    for (int i = 0; i < kNumLods; ++i)
+    // Finest first, so each closed bucket is merged before its parent is checked
+    for (size_t level = 0; level < static_cast<size_t>(numLods); ++level)
     {
-        auto& lod = lodLevels[static_cast<size_t>(i)];
+        const auto& lod = lodLevels[level];
+        const int64_t bucketIndex = pointIndex >> (static_cast<int>(level) * lodFactorShift);
         
-        double bucketIndex = std::floor(timestamp / lod.bucketDuration);
-        double bucketStart = bucketIndex * lod.bucketDuration;
+        if (lod.samplesInCurrentBucket > 0 && lod.currentBucketIndex != bucketIndex)
+            closeBucket(level);
+    }
+}
+
+void LoudnessDataStore::publishSnapshot()
+{
+    // Buckets replaced since the last snapshot go live with this one
+    for (auto& lod : lodLevels)
+    {
+        for (auto& column : lod.columns)
+            column.commitWrites(readerEpochs.getEpoch());
+        
+        lod.gatedEnergy.commitWrites(readerEpochs.getEpoch());
+        lod.gatedBlocks.commitWrites(readerEpochs.getEpoch());
+    }
+    
+    auto snapshot = std::make_unique<Snapshot>();
+    snapshot->numLods = numLods;
+    snapshot->lodFactorShift = lodFactorShift;
+    
+    // The in-progress bucket of a level also holds the current buckets of every finer
+    // level, which have not been merged into it yet
+    MinMaxPoint live;
+    bool hasLive = false;
+    
+    for (size_t level = 0; level < static_cast<size_t>(numLods); ++level)
+    {
+        const auto& lod = lodLevels[level];
+        auto& view = snapshot->levels[level];
+        
+        for (size_t column = 0; column < kNumColumns; ++column)
+            view.columns[column] = lod.columns[column].getView();
         
-        if (bucketStart > lod.currentBucketStart)
+        view.gatedEnergy = lod.gatedEnergy.getView();
+        view.gatedBlocks = lod.gatedBlocks.getView();
+        
+        view.firstBucketIndex = static_cast<int64_t>(view.columns[0].firstIndex - lod.indexBase);
+        view.bucketDuration = lod.bucketDuration;
+        view.droppedBuckets = lod.droppedBuckets;
+        
+        if (lod.samplesInCurrentBucket > 0)
         {
-            if (lod.samplesInCurrentBucket > 0)
-            {
-                lod.buckets.push_back(lod.currentBucket);
-            }
-            
-            lod.currentBucket.reset();
-            lod.currentBucketStart = bucketStart;
-            lod.samplesInCurrentBucket = 0;
+            live.merge(lod.currentBucket);
+            hasLive = true;
+        }
+        
+        if (hasLive)
+        {
+            const int64_t bucketIndex = lastPointIndex >> (static_cast<int>(level) * lodFactorShift);
+            // Quantised like a sealed bucket, so it does not change when it is closed
+            view.liveBucket = EncodedBucket::encode(live).decode((static_cast<double>(bucketIndex) + 0.5) * lod.bucketDuration);
+            view.hasLiveBucket = true;
         }
+    }
+    
+    // Readers that entered before this point may still hold the previous snapshot
+    const uint64_t retireEpoch = readerEpochs.getEpoch();
+    publishedSnapshot.store(snapshot.get());
+    
+    if (currentSnapshot != nullptr)
+        retiredSnapshots.emplace_back(std::move(currentSnapshot), retireEpoch);
+    
+    currentSnapshot = std::move(snapshot);
+    readerEpochs.advance();
+    
+    reclaimRetired();
+}
+
+void LoudnessDataStore::reclaimRetired()
+{
+    const uint64_t safeEpoch = readerEpochs.getOldestActiveEpoch();
+    
+    for (auto& lod : lodLevels)
+    {
+        for (auto& column : lod.columns)
+            column.reclaim(safeEpoch);
+        
+        lod.gatedEnergy.reclaim(safeEpoch);
+        lod.gatedBlocks.reclaim(safeEpoch);
+    }
+    
+    retiredSnapshots.erase(std::remove_if(retiredSnapshots.begin(), retiredSnapshots.end(),
+                                          [safeEpoch](const auto& retired) { return retired.second < safeEpoch; }),
+                           retiredSnapshots.end());
+}
+
+LoudnessDataStore::ReadView::ReadView(const LoudnessDataStore& store)
+    : ReadView(store, ownCaches)
+{
+}
+
+LoudnessDataStore::ReadView::ReadView(const LoudnessDataStore& store, DecodeCaches& caches)
+    : owner(store),
+      slot(store.readerEpochs.enter())
+{
+    const Snapshot* snapshot = store.publishedSnapshot.load();
+    numLevels = snapshot->numLods;
+    fanOutShift = snapshot->lodFactorShift;
+    
+    // The snapshot's views are shared by every reader, so take copies that decode into
+    // this reader's caches
+    for (int level = 0; level < numLevels; ++level)
+    {
+        auto& lod = levels[static_cast<size_t>(level)];
+        lod = snapshot->levels[static_cast<size_t>(level)];
+        
+        for (auto& column : lod.columns)
+            column.cache = &caches.columns;
         
-        double bucketMid = bucketStart + lod.bucketDuration * 0.5;
-        lod.currentBucket.addSample(momentary, shortTerm, bucketMid);
-        lod.samplesInCurrentBucket++;
+        lod.gatedEnergy.cache = &caches.energy;
+        lod.gatedBlocks.cache = &caches.counts;
     }
 }
 
+LoudnessDataStore::ReadView::~ReadView()
+{
+    owner.readerEpochs.exit(slot);
+}
+
 double LoudnessDataStore::getCurrentTime() const
 {
     return currentTimestamp.load(std::memory_order_acquire);
 }
 
-int LoudnessDataStore::selectLodLevel(double timeRange, int targetPoints) const
+int LoudnessDataStore::selectLodLevel(const ReadView& view, double timeRange, int targetPoints)
 {
     if (targetPoints <= 0)
         return 0;
     
     double idealBucketDuration = timeRange / static_cast<double>(targetPoints);
     
-    for (int i = 0; i < kNumLods; ++i)
+    for (int i = 0; i < view.getNumLevels(); ++i)
     {
-        if (lodLevels[static_cast<size_t>(i)].bucketDuration >= idealBucketDuration)
+        if (view.getLevel(i).bucketDuration >= idealBucketDuration)
         {
             return i;
         }
     }
     
-    return kNumLods - 1;
+    return view.getNumLevels() - 1;
+}
+
+int LoudnessDataStore::selectColumnLevel(const ReadView& view, double columnWidth)
+{
+    int level = 0;
+    
+    while (level + 1 < view.getNumLevels() && view.getLevel(level + 1).bucketDuration <= columnWidth)
+        ++level;
+    
+    return level;
+}
+
+int LoudnessDataStore::applyRetention(const ReadView& view, int level, double startTime)
+{
+    while (level + 1 < view.getNumLevels())
+    {
+        const auto& candidate = view.getLevel(level);
+        if (candidate.droppedBuckets == 0 || candidate.getNumSealed() == 0
+            || static_cast<double>(candidate.firstBucketIndex) * candidate.bucketDuration <= startTime)
+            break;
+        
+        ++level;
+    }
+    
+    return level;
+}
+
+void LoudnessDataStore::findBucketIndices(const LevelView& level, double startTime, double endTime,
+                                          size_t& first, size_t& last)
+{
+    // Bucket n is centred on (n + 0.5) durations, so the range is found by arithmetic
+    const auto numSealed = static_cast<double>(level.getNumSealed());
+    const auto firstIndex = static_cast<double>(level.firstBucketIndex);
+    
+    first = static_cast<size_t>(juce::jlimit(0.0, numSealed, std::ceil(startTime / level.bucketDuration - 0.5) - firstIndex));
+    last = static_cast<size_t>(juce::jlimit(static_cast<double>(first), numSealed,
+                                            std::ceil(endTime / level.bucketDuration - 0.5) - firstIndex));
+}
+
+LoudnessDataStore::BucketRange LoudnessDataStore::findBuckets(
+    const ReadView& view, double startTime, double endTime, int targetPoints)
+{
+    BucketRange range;
+    
+    if (endTime <= startTime || targetPoints <= 0)
+        return range;
+    
+    double timeRange = endTime - startTime;
+    
+    // Levels trimmed by their retention cap hand older ranges to a coarser level
+    range.lodLevel = applyRetention(view, selectLodLevel(view, timeRange, targetPoints), startTime);
+    
+    const auto& lod = view.getLevel(range.lodLevel);
+    range.level = &lod;
+    range.bucketDuration = lod.bucketDuration;
+    
+    double searchStart = startTime - lod.bucketDuration;
+    double searchEnd = endTime + lod.bucketDuration;
+    
+    findBucketIndices(lod, searchStart, searchEnd, range.first, range.last);
+    
+    if (lod.hasLiveBucket && lod.liveBucket.timeMid >= searchStart && lod.liveBucket.timeMid <= searchEnd)
+    {
+        range.liveBucket = lod.liveBucket;
+        range.hasLiveBucket = true;
+    }
+    
+    return range;
 }
 
 LoudnessDataStore::QueryResult LoudnessDataStore::getDataForDisplay(
     double startTime, double endTime, int targetPoints) const
 {
-    std::lock_guard<std::mutex> lock(dataMutex);
-    
     QueryResult result;
+    getDataForDisplay(startTime, endTime, targetPoints, result);
+    return result;
+}
+
+void LoudnessDataStore::getDataForDisplay(double startTime, double endTime, int targetPoints,
+                                          QueryResult& result) const
+{
+    result.points.clear();
+    result.lodLevel = 0;
     result.dataStartTime = startTime;
     result.dataEndTime = endTime;
     
     if (endTime <= startTime || targetPoints <= 0)
-        return result;
+        return;
     
-    double timeRange = endTime - startTime;
-    result.lodLevel = selectLodLevel(timeRange, targetPoints);
+    ReadView view(*this, result.decodeCaches);
     
-    const auto& lod = lodLevels[static_cast<size_t>(result.lodLevel)];
-    result.bucketDuration = lod.bucketDuration;
+    const double columnWidth = (endTime - startTime) / static_cast<double>(targetPoints);
+    const double firstColumn = std::floor(startTime / columnWidth);
     
-    if (lod.buckets.empty() && lod.samplesInCurrentBucket == 0)
-        return result;
+    result.lodLevel = applyRetention(view, selectColumnLevel(view, columnWidth), firstColumn * columnWidth);
     
-    double searchStart = startTime - lod.bucketDuration;
-    double searchEnd = endTime + lod.bucketDuration;
+    const auto& lod = view.getLevel(result.lodLevel);
+    result.bucketDuration = lod.bucketDuration;
+    result.dataStartTime = firstColumn * columnWidth;
+    result.dataEndTime = (firstColumn + targetPoints) * columnWidth;
+    result.points.resize(static_cast<size_t>(targetPoints));
     
-    size_t startIdx = 0;
-    size_t endIdx = lod.buckets.size();
+    // Column c covers [(firstColumn + c), (firstColumn + c + 1)) column widths; both
+    // edges come from the same expression so neighbouring columns never overlap
+    double columnStart = result.dataStartTime;
     
-    if (!lod.buckets.empty())
+    for (size_t c = 0; c < result.points.size(); ++c)
     {
-        auto itStart = std::lower_bound(lod.buckets.begin(), lod.buckets.end(), searchStart,
-            [](const MinMaxPoint& bucket, double time) {
-                return bucket.timeMid < time;
-            });
-        startIdx = static_cast<size_t>(std::distance(lod.buckets.begin(), itStart));
+        const double columnEnd = (firstColumn + static_cast<double>(c + 1)) * columnWidth;
+        auto& point = result.points[c];
+        point.reset();
+        point.timeMid = (columnStart + columnEnd) * 0.5;
+        
+        size_t first = 0, last = 0;
+        findBucketIndices(lod, columnStart, columnEnd, first, last);
+        
+        if (first < last)
+        {
+            ColumnReductions::Stats momentaryMin, momentaryMax, shortTermMin, shortTermMax, truePeakMax;
+            reduceColumnRun(lod, momentaryMinColumn, first, last, momentaryMin);
+            reduceColumnRun(lod, momentaryMaxColumn, first, last, momentaryMax);
+            reduceColumnRun(lod, shortTermMinColumn, first, last, shortTermMin);
+            reduceColumnRun(lod, shortTermMaxColumn, first, last, shortTermMax);
+            reduceColumnRun(lod, truePeakMaxColumn, first, last, truePeakMax);
+            
+            point.momentaryMin = EncodedBucket::toUnits(momentaryMin.minimum);
+            point.momentaryMax = EncodedBucket::toUnits(momentaryMax.maximum);
+            point.shortTermMin = EncodedBucket::toUnits(shortTermMin.minimum);
+            point.shortTermMax = EncodedBucket::toUnits(shortTermMax.maximum);
+            point.truePeakMax = EncodedBucket::toUnits(truePeakMax.maximum);
+        }
         
-        auto itEnd = std::upper_bound(lod.buckets.begin(), lod.buckets.end(), searchEnd,
-            [](double time, const MinMaxPoint& bucket) {
-                return time < bucket.timeMid;
-            });
-        endIdx = static_cast<size_t>(std::distance(lod.buckets.begin(), itEnd));
+        columnStart = columnEnd;
     }
     
-    size_t numPoints = (endIdx > startIdx) ? (endIdx - startIdx) : 0;
-    result.points.reserve(numPoints + 1);
-    
-    for (size_t i = startIdx; i < endIdx; ++i)
+    if (lod.hasLiveBucket)
     {
-        result.points.push_back(lod.buckets[i]);
+        const double column = std::floor(lod.liveBucket.timeMid / columnWidth) - firstColumn;
+        if (column >= 0.0 && column < static_cast<double>(targetPoints))
+            result.points[static_cast<size_t>(column)].merge(lod.liveBucket);
     }
+}
+
+LoudnessDataStore::RangeStats LoudnessDataStore::getRangeStats(double startTime, double endTime) const
+{
+    ReadView view(*this);
+    RangeStats stats;
+    
+    // LOD0 points centred in the range, as in findBucketIndices
+    const double pointDuration = view.getLevel(0).bucketDuration;
+    const auto first = static_cast<int64_t>(std::max(0.0, std::ceil(startTime / pointDuration - 0.5)));
+    auto last = static_cast<int64_t>(std::max(0.0, std::ceil(endTime / pointDuration - 0.5)));
+    
+    // Nothing lies past the newest point, so a range reaching into the future costs no more.
+    // LOD0 buckets are sealed as their point arrives, so the newest point is included and
+    // the in-progress buckets of coarser levels are simply split down to it.
+    const auto& finest = view.getLevel(0);
+    last = std::min(last, finest.firstBucketIndex + static_cast<int64_t>(finest.getNumSealed())
+                              + (finest.hasLiveBucket ? 1 : 0));
+    
+    if (last <= first)
+        return stats;
+    
+    // Start from the top level and let accumulateRange split whatever is not covered whole
+    const int top = view.getNumLevels() - 1;
+    const int topShift = top * view.getFanOutShift();
+    
+    auto accumulate = [&](bool useThreshold, float thresholdLufs)
+    {
+        RangeAccumulator result;
+        for (int64_t bucket = first >> topShift; bucket <= (last - 1) >> topShift; ++bucket)
+            accumulateRange(view, top, bucket, first, last, useThreshold, thresholdLufs, result);
+        
+        return result;
+    };
+    
+    // First pass: absolute gate and maxima; second pass: relative gate
+    const RangeAccumulator absolute = accumulate(false, 0.0f);
+    
+    stats.momentaryMax = EncodedBucket::toUnits(absolute.momentaryMax);
+    stats.shortTermMax = EncodedBucket::toUnits(absolute.shortTermMax);
+    stats.truePeakMax = EncodedBucket::toUnits(absolute.truePeakMax);
+    stats.gatedBlocks = absolute.blocks;
+    
+    if (absolute.blocks == 0)
+        return stats;
+    
+    const double absoluteLoudness = LoudnessHistogram::meanSquareToLufs(absolute.energy / static_cast<double>(absolute.blocks));
+    stats.meanLoudness = static_cast<float>(absoluteLoudness);
     
-    if (lod.samplesInCurrentBucket > 0)
+    const RangeAccumulator relative = accumulate(true, static_cast<float>(absoluteLoudness + kRelativeGateLU));
+    
+    if (relative.blocks > 0)
+        stats.integrated = static_cast<float>(LoudnessHistogram::meanSquareToLufs(relative.energy / static_cast<double>(relative.blocks)));
+    
+    return stats;
+}
+
+void LoudnessDataStore::accumulateRange(const ReadView& view, int level, int64_t bucketIndex, int64_t first, int64_t last,
+                                        bool useThreshold, float thresholdLufs, RangeAccumulator& result)
+{
+    const int shift = level * view.getFanOutShift();
+    const int64_t nodeFirst = bucketIndex << shift;
+    const int64_t nodeLast = (bucketIndex + 1) << shift;
+    
+    if (nodeLast <= first || nodeFirst >= last)
+        return;
+    
+    const auto& lod = view.getLevel(level);
+    const int64_t sealedIndex = bucketIndex - lod.firstBucketIndex;
+    const bool isSealed = sealedIndex >= 0 && sealedIndex < static_cast<int64_t>(lod.getNumSealed());
+    const bool isInside = nodeFirst >= first && nodeLast <= last;
+    
+    // Children that were dropped by retention (or a level 0 node) can't be split any further
+    const bool canSplit = level > 0
+        && (bucketIndex << view.getFanOutShift()) >= view.getLevel(level - 1).firstBucketIndex;
+    
+    if (isSealed && (isInside || !canSplit))
     {
-        double currentMid = lod.currentBucketStart + lod.bucketDuration * 0.5;
-        if (currentMid >= searchStart && currentMid <= searchEnd)
+        const auto i = static_cast<size_t>(sealedIndex);
+        bool takeWhole = true;
+        
+        if (useThreshold)
+        {
+            const float momentaryMin = EncodedBucket::toUnits(lod.columns[momentaryMinColumn][i]);
+            const float momentaryMax = EncodedBucket::toUnits(lod.columns[momentaryMaxColumn][i]);
+            
+            if (momentaryMax < thresholdLufs)
+                return;
+            
+            // One block: decide on its exact energy rather than the rounded loudness
+            if (level == 0)
+                takeWhole = lod.gatedBlocks[i] > 0
+                    && lod.gatedEnergy[i] >= LoudnessHistogram::lufsToMeanSquare(thresholdLufs);
+            else
+                takeWhole = momentaryMin >= thresholdLufs || !canSplit;
+            
+            if (level == 0 && !takeWhole)
+                return;
+        }
+        
+        if (takeWhole)
         {
-            MinMaxPoint currentCopy = lod.currentBucket;
-            currentCopy.timeMid = currentMid;
-            result.points.push_back(currentCopy);
+            result.energy += lod.gatedEnergy[i];
+            result.blocks += lod.gatedBlocks[i];
+            
+            if (!useThreshold)
+            {
+                result.momentaryMax = std::max(result.momentaryMax, lod.columns[momentaryMaxColumn][i]);
+                result.shortTermMax = std::max(result.shortTermMax, lod.columns[shortTermMaxColumn][i]);
+                result.truePeakMax = std::max(result.truePeakMax, lod.columns[truePeakMaxColumn][i]);
+            }
+            
+            return;
         }
     }
     
-    if (!result.points.empty())
+    if (level == 0)
+        return;
+    
+    const int64_t fanOut = int64_t{1} << view.getFanOutShift();
+    for (int64_t child = 0; child < fanOut; ++child)
+        accumulateRange(view, level - 1, bucketIndex * fanOut + child, first, last, useThreshold, thresholdLufs, result);
+}
+
+void LoudnessDataStore::reduceColumnRun(const LevelView& level, Column column, size_t first, size_t last,
+                                        ColumnReductions::Stats& stats)
+{
+    // One call per page-sized run of the column
+    level.columns[static_cast<size_t>(column)].forEachRun(first, last, [&stats](const int16_t* run, size_t runLength)
+    {
+        ColumnReductions::accumulate(stats, run, runLength);
+    });
+}
+
+ColumnReductions::Stats LoudnessDataStore::reduceColumn(const BucketRange& range, Column column)
+{
+    ColumnReductions::Stats stats;
+    
+    if (range.level != nullptr)
+        reduceColumnRun(*range.level, column, range.first, range.last, stats);
+    
+    if (range.hasLiveBucket)
     {
-        result.dataStartTime = result.points.front().timeMid - lod.bucketDuration * 0.5;
-        result.dataEndTime = result.points.back().timeMid + lod.bucketDuration * 0.5;
+        const auto live = EncodedBucket::encode(range.liveBucket);
+        ColumnReductions::accumulate(stats, &live.values[static_cast<size_t>(column)], 1);
     }
     
-    return result;
-}
\ No newline at end of file
+    return stats;
+}
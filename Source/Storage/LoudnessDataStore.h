@@ -1,12 +1,56 @@
 #pragma once
 
 #include <juce_core/juce_core.h>
+#include "../DSP/LoudnessHistogram.h"
+#include "ColumnReductions.h"
+#include "DeltaCodec.h"
+#include "MeasurementJournal.h"
+#include "PagedArray.h"
+#include "SnapshotEpochs.h"
 #include <vector>
 #include <array>
 #include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <iterator>
 #include <mutex>
 
-class LoudnessDataStore
+/**
+ * Multi-resolution loudness history
+ *
+ * The audio thread only appends to a wait-free single-producer ring; a background
+ * ingestion thread drains it and owns the LOD update, so the audio thread never
+ * blocks behind a display query and never allocates.
+ *
+ * Points either follow each other (free-running) or sit at their place on the host
+ * timeline. A timeline point at or behind one already held replaces it: its LOD0 bucket
+ * is overwritten and each ancestor rebuilt from its children, O(fan-out x levels), so
+ * looping or re-rendering a region leaves one copy of it and the memory follows the
+ * length of the timeline rather than the time spent monitoring.
+ *
+ * After every batch the ingestion thread publishes an immutable snapshot of all
+ * levels. Readers pin it through a ReadView without taking a lock and see the sealed
+ * buckets in place; replaced snapshots and released pages are only reused once no
+ * reader can still reach them.
+ *
+ * Optionally the pages live in memory-mapped files in a directory instead of the heap,
+ * with a small index rewritten every few seconds, so a later session (or a reopened
+ * project) picks the whole timeline up again without re-ingesting anything.
+ *
+ * Every ingested point can also go to an append-only journal file, which is deleted
+ * when the store is; after a crash the journal is still there to replay the points
+ * recorded since the history was last saved. A saved state blob may be restored long
+ * after later ones were written, so the journal keeps every point of its history; only
+ * the index of a file-backed history, which every restore reads, lets it start over.
+ * A new history moves on to a new journal file once a state has named the old one.
+ *
+ * Each level keeps one contiguous column per metric, so a reduction over a range
+ * (auto-ranging, range maxima, whole-session statistics) streams through a single
+ * column instead of striding over whole buckets. In memory, sealed pages behind the
+ * newest two of each column are compressed (see PageCodec) and decoded on demand by
+ * the readers that touch them.
+ */
+class LoudnessDataStore : private juce::Thread
 {
 public:
     struct MinMaxPoint
@@ -15,10 +59,17 @@ public:
         float momentaryMax{-100.0f};
         float shortTermMin{100.0f};
         float shortTermMax{-100.0f};
+        float truePeakMax{-100.0f};
         double timeMid{0.0};
         
+        // Gating blocks at or above the absolute gate: the momentary points on BS.1770's
+        // 100ms grid (every point at a 100ms hop, every tenth at 10ms)
+        double gatedEnergy{0.0};
+        uint32_t gatedBlocks{0};
+        
         bool hasValidMomentary() const { return momentaryMax > -99.0f; }
         bool hasValidShortTerm() const { return shortTermMax > -99.0f; }
+        bool hasValidTruePeak() const { return truePeakMax > -99.0f; }
         
         void reset()
         {
@@ -26,23 +77,227 @@ public:
             momentaryMax = -100.0f;
             shortTermMin = 100.0f;
             shortTermMax = -100.0f;
+            truePeakMax = -100.0f;
             timeMid = 0.0;
+            gatedEnergy = 0.0;
+            gatedBlocks = 0;
         }
         
-        void addSample(float m, float s, double t)
+        void addSample(float m, float s, float tp, double t)
         {
             if (m > -100.0f)
             {
                 momentaryMin = std::min(momentaryMin, m);
                 momentaryMax = std::max(momentaryMax, m);
             }
+            if (m >= LoudnessHistogram::kAbsoluteGateLufs)
+            {
+                gatedEnergy += LoudnessHistogram::lufsToMeanSquare(m);
+                gatedBlocks++;
+            }
             if (s > -100.0f)
             {
                 shortTermMin = std::min(shortTermMin, s);
                 shortTermMax = std::max(shortTermMax, s);
             }
+            truePeakMax = std::max(truePeakMax, tp);
             timeMid = t;
         }
+        
+        // Fold in a finished bucket of a finer level (timeMid is left to the caller)
+        void merge(const MinMaxPoint& other)
+        {
+            momentaryMin = std::min(momentaryMin, other.momentaryMin);
+            momentaryMax = std::max(momentaryMax, other.momentaryMax);
+            shortTermMin = std::min(shortTermMin, other.shortTermMin);
+            shortTermMax = std::max(shortTermMax, other.shortTermMax);
+            truePeakMax = std::max(truePeakMax, other.truePeakMax);
+            gatedEnergy += other.gatedEnergy;
+            gatedBlocks += other.gatedBlocks;
+        }
+    };
+    
+    // Each metric of a level is stored as its own column
+    enum Column
+    {
+        momentaryMinColumn,
+        momentaryMaxColumn,
+        shortTermMinColumn,
+        shortTermMaxColumn,
+        truePeakMaxColumn,
+        kNumColumns
+    };
+    
+    // Sealed bucket: every value in hundredths of an LU (or dB), mins rounded down and
+    // maxima up so the envelope never shrinks. The time is not stored; bucket n of a
+    // level always covers [n, n + 1) bucket durations.
+    struct EncodedBucket
+    {
+        std::array<int16_t, kNumColumns> values{ ColumnReductions::kEmptyValue, -ColumnReductions::kEmptyValue,
+                                                 ColumnReductions::kEmptyValue, -ColumnReductions::kEmptyValue,
+                                                 -ColumnReductions::kEmptyValue };
+        
+        static EncodedBucket encode(const MinMaxPoint& point)
+        {
+            EncodedBucket bucket;
+            bucket.values[momentaryMinColumn] = roundDown(point.momentaryMin);
+            bucket.values[momentaryMaxColumn] = roundUp(point.momentaryMax);
+            bucket.values[shortTermMinColumn] = roundDown(point.shortTermMin);
+            bucket.values[shortTermMaxColumn] = roundUp(point.shortTermMax);
+            bucket.values[truePeakMaxColumn] = roundUp(point.truePeakMax);
+            return bucket;
+        }
+        
+        MinMaxPoint decode(double timeMid) const
+        {
+            MinMaxPoint point;
+            point.momentaryMin = toUnits(values[momentaryMinColumn]);
+            point.momentaryMax = toUnits(values[momentaryMaxColumn]);
+            point.shortTermMin = toUnits(values[shortTermMinColumn]);
+            point.shortTermMax = toUnits(values[shortTermMaxColumn]);
+            point.truePeakMax = toUnits(values[truePeakMaxColumn]);
+            point.timeMid = timeMid;
+            return point;
+        }
+        
+        static float toUnits(int16_t value) { return value / kStepsPerUnit; }
+        
+    private:
+        static constexpr float kStepsPerUnit = 100.0f;
+        
+        // The tolerance makes decode followed by encode give back the same values
+        static constexpr float kRoundingTolerance = 1.0e-3f;
+        
+        static int16_t roundDown(float value) { return quantise(std::floor(value * kStepsPerUnit + kRoundingTolerance)); }
+        static int16_t roundUp(float value) { return quantise(std::ceil(value * kStepsPerUnit - kRoundingTolerance)); }
+        
+        static int16_t quantise(float steps)
+        {
+            return static_cast<int16_t>(juce::jlimit(-32768.0f, 32767.0f, steps));
+        }
+    };
+    
+    static constexpr int kMaxLods = 16;
+    
+    // Ten levels at fan-out 4 reach 7.3 hour buckets from a 100ms hop, so a 7-day view
+    // needs only a few hundred buckets from LOD7
+    static constexpr int kDefaultNumLods = 10;
+    static constexpr int kDefaultLodFactor = 4;
+    
+    // Columns live in 1024-value pages (2KB) from a shared pool, so appending never
+    // copies the history; 320 pages cover about an hour of every LOD at a 100ms hop
+    static constexpr size_t kBucketsPerPage = 1024;
+    
+    using ColumnArray = PagedArray<int16_t, kBucketsPerPage>;
+    using EnergyArray = PagedArray<double, kBucketsPerPage>;
+    using CountArray = PagedArray<uint32_t, kBucketsPerPage>;
+    
+    // Compressed pages a reader keeps decoded per element type: enough for a display to
+    // walk every column of a level side by side without decoding a page twice
+    static constexpr size_t kReaderCachedPages = 64;
+    
+    // Decoded pages of one reader. A ReadView has its own for the length of a query; a
+    // caller that queries again and again keeps one and passes it in, so pages it still
+    // holds are not decoded again. One thread at a time.
+    struct DecodeCaches
+    {
+        ColumnArray::DecodeCache columns{kReaderCachedPages};
+        EnergyArray::DecodeCache energy{kReaderCachedPages};
+        CountArray::DecodeCache counts{kReaderCachedPages};
+    };
+    
+    // One level as published: sealed buckets in place plus the in-progress bucket
+    struct LevelView
+    {
+        std::array<ColumnArray::View, kNumColumns> columns;
+        EnergyArray::View gatedEnergy;
+        CountArray::View gatedBlocks;
+        int64_t firstBucketIndex{0};    // bucket number of the first sealed bucket
+        double bucketDuration{0.1};
+        size_t droppedBuckets{0};       // released by the retention cap
+        MinMaxPoint liveBucket;
+        bool hasLiveBucket{false};
+        
+        size_t getNumSealed() const { return columns[0].size(); }
+        
+        MinMaxPoint getBucket(size_t i) const
+        {
+            EncodedBucket bucket;
+            for (size_t column = 0; column < kNumColumns; ++column)
+                bucket.values[column] = columns[column][i];
+            
+            const auto bucketIndex = firstBucketIndex + static_cast<int64_t>(i);
+            return bucket.decode((static_cast<double>(bucketIndex) + 0.5) * bucketDuration);
+        }
+    };
+    
+    // Lock-free, consistent view of the whole history. Everything it shows stays valid
+    // and unchanged until the ReadView is destroyed, so keep it short-lived. Compressed
+    // pages are decoded into the view's own caches, or the caller's.
+    class ReadView
+    {
+    public:
+        explicit ReadView(const LoudnessDataStore& store);
+        ReadView(const LoudnessDataStore& store, DecodeCaches& caches);
+        ~ReadView();
+        
+        ReadView(const ReadView&) = delete;
+        ReadView& operator=(const ReadView&) = delete;
+        
+        int getNumLevels() const { return numLevels; }
+        int getFanOutShift() const { return fanOutShift; }
+        const LevelView& getLevel(int level) const { return levels[static_cast<size_t>(level)]; }
+        
+    private:
+        const LoudnessDataStore& owner;
+        int slot;
+        DecodeCaches ownCaches;
+        std::array<LevelView, kMaxLods> levels;
+        int numLevels;
+        int fanOutShift;
+    };
+    
+    // Buckets covering a time range at one level, read in place from a ReadView: the
+    // sealed buckets [begin, end), decoded as they are visited, followed by the
+    // in-progress bucket if there is one. Valid only as long as the ReadView it came from.
+    struct BucketRange
+    {
+        class const_iterator
+        {
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = MinMaxPoint;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const MinMaxPoint*;
+            using reference = MinMaxPoint;
+            
+            const_iterator() = default;
+            const_iterator(const LevelView* l, size_t i) : level(l), index(i) {}
+            
+            MinMaxPoint operator*() const { return level->getBucket(index); }
+            const_iterator& operator++() { ++index; return *this; }
+            const_iterator operator++(int) { auto old = *this; ++index; return old; }
+            bool operator==(const const_iterator& other) const { return index == other.index; }
+            bool operator!=(const const_iterator& other) const { return index != other.index; }
+            
+        private:
+            const LevelView* level{nullptr};
+            size_t index{0};
+        };
+        
+        const LevelView* level{nullptr};
+        size_t first{0};
+        size_t last{0};
+        MinMaxPoint liveBucket;
+        bool hasLiveBucket{false};
+        int lodLevel{0};
+        double bucketDuration{0.1};
+        
+        const_iterator begin() const { return { level, first }; }
+        const_iterator end() const { return { level, last }; }
+        size_t getNumSealed() const { return last - first; }
+        size_t size() const { return getNumSealed() + (hasLiveBucket ? 1 : 0); }
+        bool empty() const { return size() == 0; }
     };
     
     struct QueryResult
@@ -52,41 +307,390 @@ public:
         double bucketDuration{0.1};
         double dataStartTime{0.0};
         double dataEndTime{0.0};
+        DecodeCaches decodeCaches;      // kept for the next query into this result
     };
 
     LoudnessDataStore();
-    ~LoudnessDataStore() = default;
+    ~LoudnessDataStore() override;
 
     void prepare(double updateRateHz);
     void reset();
     
-    void addPoint(float momentary, float shortTerm);
+    // Audio thread only; wait-free. Points that find the ring full are dropped and
+    // leave a gap in the history rather than shifting later points. A point goes after
+    // the furthest one added so far by either call.
+    void addPoint(float momentary, float shortTerm, float truePeak);
     
+    // Same, for the point at pointIndex on the host timeline (point n covers [n, n + 1)
+    // update intervals from the timeline's start). A point behind the newest one replaces
+    // what was recorded there; negative indices and points before what LOD0 retains are
+    // dropped.
+    void addPointAt(int64_t pointIndex, float momentary, float shortTerm, float truePeak);
+    
+    // Audio thread only. Rate the points added from now on were measured at: until the
+    // history is prepare()d for that rate they are dropped, so a rate change takes
+    // effect with the producer's own switch. Never set, points are taken to match.
+    void setPointRate(double updateRateHz) { producerRate = updateRateHz; }
+    
+    // Time of the point ingested last: the newest one, or on the timeline wherever the
+    // transport last played
     double getCurrentTime() const;
     
+    // Changes whenever a new snapshot is published, so a reader can tell whether a result
+    // it kept may be stale
+    uint64_t getSnapshotEpoch() const { return readerEpochs.getEpoch(); }
+    
+    // Exactly targetPoints columns of equal width, each holding the min/max envelope of
+    // every bucket centred in it. Columns sit on a fixed grid of multiples of their width
+    // (the first one starts at or up to one column before startTime), so scrolling does
+    // not reshuffle buckets between columns; empty columns have no valid values. Buckets
+    // come from the coarsest level that is no wider than a column, so the cost stays
+    // below fan-out x targetPoints buckets at every zoom.
     QueryResult getDataForDisplay(double startTime, double endTime, int targetPoints) const;
+    
+    // Statistics of the points centred in [startTime, endTime)
+    struct RangeStats
+    {
+        float integrated{-100.0f};      // BS.1770 gated loudness
+        float meanLoudness{-100.0f};    // energy mean of the blocks above the absolute gate
+        float momentaryMax{-100.0f};
+        float shortTermMax{-100.0f};
+        float truePeakMax{-100.0f};
+        uint64_t gatedBlocks{0};
+    };
+    
+    // Every bucket carries the summed energy of its gating blocks, so the maxima and the
+    // absolute gate cover the range with O(fan-out x levels) buckets of the pyramid. The
+    // relative gate can only take a bucket whole when its momentary min and max lie on
+    // one side of the gate, and splits every bucket that straddles it, down to LOD0 if
+    // need be: a few buckets for steady material, but programme material crosses the
+    // gate all the time and that pass costs up to O(points in the range). Ranges older
+    // than a level's retention use the coarser buckets whole.
+    RangeStats getRangeStats(double startTime, double endTime) const;
+    
+    // Same query, written into a caller-owned result whose point storage is reused, so a
+    // caller that keeps the result around does not allocate once it has grown
+    void getDataForDisplay(double startTime, double endTime, int targetPoints, QueryResult& result) const;
+    
+    // Raw buckets of the level nearest to targetPoints buckets over the range, straight
+    // from the view's pages
+    static BucketRange findBuckets(const ReadView& view, double startTime, double endTime, int targetPoints);
+    
+    // Reduce one column over a range's sealed buckets and its in-progress bucket, in
+    // hundredths (EncodedBucket::toUnits converts)
+    static ColumnReductions::Stats reduceColumn(const BucketRange& range, Column column);
+    
+    // Pyramid shape: numLevels levels (1-16), each fanOut (2, 4 or 8) times coarser than
+    // the one below. Clears the history.
+    void setLodLayout(int numLevels, int fanOut);
+    int getNumLevels() const;
+    int getFanOut() const;
+    
+    // Keep at most maxBuckets buckets (rounded up to whole pages) at a level, releasing
+    // the oldest pages; 0 keeps everything. Queries before the retained range fall back
+    // to the next coarser level.
+    void setLevelRetention(int level, size_t maxBuckets);
+    size_t getLevelRetention(int level) const;
+    
+    struct LevelStats
+    {
+        double bucketDuration{0.0};
+        size_t numBuckets{0};
+        size_t numPages{0};
+        size_t numCompressedPages{0};
+        size_t bytes{0};    // compressed pages count at their compressed size
+    };
+    
+    LevelStats getLevelStats(int level) const;
+    
+    // Memory held by the bucket pools, including pages not in use (compressed pages are
+    // not pool pages; getLevelStats() counts them)
+    size_t getPoolBytes() const;
+    
+    // Keep the history in memory-mapped files in directory, continuing the history a
+    // previous session left there if its update rate matches (otherwise starting a new
+    // one); an empty File goes back to memory with a new history. Returns false, and
+    // stays in memory, if the files can't be opened.
+    bool setBackingDirectory(const juce::File& directory);
+    juce::File getBackingDirectory() const;
+    
+    // Directory that state blobs name backing directories relative to; without a root,
+    // a file-backed history is saved like one in memory and readState() opens no files
+    void setBackingRoot(const juce::File& directory);
+    
+    // Journal every ingested point to file (an empty File stops journaling). A journal
+    // left there by this same history, e.g. by a session that crashed after the history
+    // was saved, is replayed first: its points past the newest one held are added, and
+    // the journal carries on from there; the journal in use is replayed the same way.
+    // A file holding anything else is left alone, and the journal goes to a new file
+    // next to it. Returns false if the file can't be written or another store (in any
+    // process) is using it.
+    bool setJournalFile(const juce::File& file);
+    juce::File getJournalFile() const;
+    
+    // Where the journals named by state blobs are looked for; without a directory,
+    // readState() replays no journal
+    void setJournalDirectory(const juce::File& directory);
+    juce::File getJournalDirectory() const;
+    
+    // Whole history as a compact blob for plugin state: columns are delta-coded and
+    // gated energy is kept as a mean per block to within 0.001 LU. A file-backed history
+    // under the backing root only records its directory (and saves its index); restoring
+    // it needs the directory to hold an index at the same rate. readState() replaces the
+    // history and needs the update rate it was written with; returns false and leaves an
+    // empty history if the blob doesn't fit. The blob names the journal (by file name, in
+    // the journal directory), so restoring it also replays whatever the journal recorded
+    // after the blob was written.
+    void writeState(juce::OutputStream& out) const;
+    bool readState(juce::InputStream& in);
 
 private:
-    void updateLodLevels(float momentary, float shortTerm, double timestamp);
+    // One measurement on its way from the audio thread to the ingestion thread
+    struct PendingPoint
+    {
+        float momentary{-100.0f};
+        float shortTerm{-100.0f};
+        float truePeak{-100.0f};
+        uint32_t epoch{0};
+        int64_t index{0};   // position in the history, counted by the audio thread or from the timeline
+    };
+    
+    void run() override;
+    
+    // Producer side of the pending ring (audio thread)
+    void queuePoint(const PendingPoint& point);
+    
+    // Restart producerIndex after a reset; returns the current epoch (audio thread)
+    uint32_t syncProducer();
+    
+    // Whether points at producerRate belong in the current history; call after
+    // syncProducer() (audio thread)
+    bool isProducerRateCurrent() const;
+    
+    // Move every pending point into the LOD levels (ingestion thread)
+    void ingestPendingPoints();
+    
+    // LOD0 holds one bucket per point; every coarser level is fed only when the level
+    // below closes a bucket, so a point costs amortised O(1) whatever the level count.
+    // A point behind the newest one goes to replacePoint().
+    void updateLodLevels(float momentary, float shortTerm, float truePeak, int64_t pointIndex);
+    
+    // Overwrite a sealed LOD0 bucket and rebuild its ancestors, stopping at the first one
+    // that comes out unchanged
+    void replacePoint(const MinMaxPoint& point, int64_t pointIndex);
+    
+    // Rebuild a bucket of level (> 0) from its children; true if a sealed bucket changed,
+    // so its own parent needs rebuilding too
+    bool rebuildBucket(size_t level, int64_t bucketIndex);
+    
+    // Merge a finished child bucket into a level, closing the level's bucket after its last child
+    void addToLevel(size_t level, const MinMaxPoint& child, int64_t bucketIndex, bool isLastChild);
+    
+    // Store a level's current bucket and pass it up to the next level
+    void closeBucket(size_t level);
+    
+    // After a gap in the point indices, close every bucket the new point is not part of
+    void closeStaleBuckets(int64_t pointIndex);
+    
+    // Empty every level (writer, under dataMutex)
+    void clearHistory();
+    
+    // Return after every reader that might still see retired data has left, with all
+    // retired pages back in their pools
+    void waitForReaders();
+    
+    // Backing files: the index records the pyramid and which file pages each level uses
+    bool openBackingFiles(const juce::File& directory);
+    void closeBackingFiles();
+    
+    // Compress sealed pages of every array (on unless the history is file-backed)
+    void setPageCompression(bool enabled);
+    
+    // Returns false if the index could not be written; the previous one then stays
+    bool saveIndex() const;
+    bool loadIndex();
+    
+    // Update rate recorded in the header of directory's index, or 0 if it has no valid one
+    static double readIndexRate(const juce::File& directory);
+    
+    // Backing directory a state blob names, if it is under the backing root and holds a
+    // history at this rate; otherwise an empty File
+    juce::File findSavedBackingDirectory(const juce::String& relativePath) const;
+    
+    // Start the journal over for a new current history, if there is one, in a new file
+    // if a saved state may still need the old one (writer, under dataMutex)
+    void restartJournal();
     
-    static constexpr int kNumLods = 6;
+    // Start the journal over once the index holds every point it recorded (writer, under
+    // dataMutex)
+    void trimJournal() const;
+    
+    // Start the journal in a new file in the same directory as file (writer, under dataMutex)
+    bool startJournalNextTo(const juce::File& file);
+    
+    // Stop journaling, keeping the file until the store goes if asked to or if a state
+    // names it (writer, under dataMutex)
+    void closeJournal(bool keepFile);
+    
+    // A journal name from a state blob: a plain file name, which can't lead out of the
+    // journal directory
+    static bool isJournalName(const juce::String& name);
+    
+    // Publish the current state of every level to readers and reclaim what no reader
+    // can reach any more (writer, under dataMutex)
+    void publishSnapshot();
+    void reclaimRetired();
+    
+    static constexpr size_t kInitialPoolPages = 64 * kNumColumns;
+    
+    // BS.1770 relative gate for range statistics, as in the meter, and the step between
+    // gating blocks
+    static constexpr double kRelativeGateLU = -10.0;
+    static constexpr double kGatingStepSeconds = 0.1;
+    static constexpr size_t kExpectedPagesPerLod = 4096;
     
     struct LodLevel
     {
-        std::vector<MinMaxPoint> buckets;
+        std::array<ColumnArray, kNumColumns> columns;
+        EnergyArray gatedEnergy;
+        CountArray gatedBlocks;
+        size_t indexBase{0};             // array index of bucket 0 in the current history
         double bucketDuration{0.1};
-        double currentBucketStart{-1.0};
+        int64_t currentBucketIndex{-1};
         MinMaxPoint currentBucket;
-        int samplesInCurrentBucket{0};
+        int samplesInCurrentBucket{0};   // children (points at LOD0) merged so far
+        size_t maxBuckets{0};            // retention cap, 0 = unlimited
+        size_t droppedBuckets{0};        // released by the retention cap since reset
     };
     
+    // Append count copies of a sealed bucket to every column of a level
+    void appendBucket(LodLevel& lod, const MinMaxPoint& bucket, size_t count = 1);
+    
+    // Sealed bucket at an array index as the writer holds it, and its replacement (false
+    // if nothing changed)
+    static MinMaxPoint readBucket(const LodLevel& lod, size_t arrayIndex);
+    bool writeBucket(LodLevel& lod, size_t arrayIndex, const MinMaxPoint& bucket);
+    
+    // ~40s of points at the finest (10ms) hop; the ingestion thread drains it every 20ms
+    static constexpr int kPendingCapacity = 4096;
+    static constexpr int kIngestionIntervalMs = 20;
+    
+    // The backing index is rewritten every ~2s. After a crash the files come back as of
+    // the last save, plus whatever the journal replays; pages released since that save
+    // are not reused until the next one, so the index never points at overwritten data.
+    static constexpr int kWakesPerIndexSave = 100;
+    static constexpr int kIndexMagic = 0x4c445349;   // "LDSI"
+    static constexpr int kIndexVersion = 2;
+    
+    static constexpr int kStateMagic = 0x4c445348;   // "LDSH"
+    static constexpr int kStateVersion = 3;
+    
+    // Non-file-backed part of readState()
+    bool readHistory(juce::InputStream& in, int version, uint64_t savedHistoryId);
+    
+    // Level contents for writeState()/readState()
+    static constexpr int kEnergyDroppedBits = 12;
+    static uint32_t quantiseEnergy(double meanSquare);
+    static double dequantiseEnergy(uint32_t units);
+    void encodeLevel(std::vector<uint8_t>& out, const LodLevel& lod) const;
+    bool decodeLevel(DeltaCodec::Reader& reader, LodLevel& lod);
+    
+    juce::AbstractFifo pendingFifo{kPendingCapacity};
+    std::array<PendingPoint, kPendingCapacity> pendingPoints;
+    
+    // reset() bumps the epoch; the audio thread then restarts its point index (at
+    // resumeIndex, non-zero after a restored history) and the ingestion thread discards
+    // points queued before the reset
+    std::atomic<uint32_t> epoch{0};
+    std::atomic<int64_t> resumeIndex{0};
+    uint32_t producerEpoch{0};      // audio thread
+    int64_t producerIndex{0};       // audio thread: one past the furthest point queued
+    double producerRate{0.0};       // audio thread: rate of the points being added
+    
+    // updateRate for the audio thread, set ahead of the epoch bump of the reset that
+    // starts a history at that rate
+    std::atomic<double> historyRate{10.0};
+    
+    // Serialises the writers (ingestion thread, reset and layout changes); readers never take it
     mutable std::mutex dataMutex;
-    std::array<LodLevel, kNumLods> lodLevels;
+    
+    // Declared before the pools, which hand out their pages
+    juce::File backingDirectory;
+    juce::File backingRoot;
+    MappedPageFile columnFile;
+    MappedPageFile energyFile;
+    MappedPageFile countFile;
+    int wakesSinceIndexSave{0};
+    
+    // A history gets a new random id whenever it is cleared; a journal is only replayed
+    // into the history it was written for. Trimming the journal after an index save
+    // leaves the history as it was, so saves that are const may do it.
+    mutable MeasurementJournal journal;
+    uint64_t historyId{0};
+    
+    // Whether a state blob written (or restored) may name the journal, and the journals
+    // left behind for such states by earlier histories
+    mutable bool journalInState{false};
+    std::vector<juce::File> retiredJournals;
+    juce::File journalDirectory;
+    
+    ColumnArray::Pool columnPool{kInitialPoolPages};
+    EnergyArray::Pool energyPool{kInitialPoolPages / kNumColumns};
+    CountArray::Pool countPool{kInitialPoolPages / kNumColumns};
+    std::array<LodLevel, kMaxLods> lodLevels;
+    int numLods{kDefaultNumLods};
+    int lodFactor{kDefaultLodFactor};
+    int lodFactorShift{2};
     
     double updateRate{10.0};
     double sampleInterval{0.1};
-    size_t totalSampleCount{0};
+    int pointsPerGatingStep{1};
+    int64_t nextPointIndex{0};
+    int64_t lastPointIndex{-1};
+    
+    // Points ingested into the history, replacements included: the sequence number of
+    // the next journal record
+    int64_t nextSequence{0};
     std::atomic<double> currentTimestamp{0.0};
     
-    int selectLodLevel(double timeRange, int targetPoints) const;
+    struct Snapshot
+    {
+        std::array<LevelView, kMaxLods> levels;
+        int numLods{0};
+        int lodFactorShift{0};
+    };
+    
+    std::unique_ptr<Snapshot> currentSnapshot;
+    std::atomic<const Snapshot*> publishedSnapshot{nullptr};
+    std::vector<std::pair<std::unique_ptr<Snapshot>, uint64_t>> retiredSnapshots;
+    mutable SnapshotEpochs readerEpochs;
+    
+    static int selectLodLevel(const ReadView& view, double timeRange, int targetPoints);
+    
+    // Coarsest level whose buckets fit in a column
+    static int selectColumnLevel(const ReadView& view, double columnWidth);
+    
+    // Move to coarser levels while the level's retained range starts after startTime
+    static int applyRetention(const ReadView& view, int level, double startTime);
+    
+    // Sealed buckets centred in [startTime, endTime) at a level, as relative indices
+    static void findBucketIndices(const LevelView& level, double startTime, double endTime,
+                                  size_t& first, size_t& last);
+    
+    // Sums over the blocks of one pyramid node that fall in LOD0 points [first, last)
+    struct RangeAccumulator
+    {
+        double energy{0.0};
+        uint64_t blocks{0};
+        int16_t momentaryMax{-ColumnReductions::kEmptyValue};
+        int16_t shortTermMax{-ColumnReductions::kEmptyValue};
+        int16_t truePeakMax{-ColumnReductions::kEmptyValue};
+    };
+    
+    // With a threshold only blocks at or above it are summed and maxima are left alone
+    static void accumulateRange(const ReadView& view, int level, int64_t bucketIndex, int64_t first, int64_t last,
+                                bool useThreshold, float thresholdLufs, RangeAccumulator& result);
+    
+    static void reduceColumnRun(const LevelView& level, Column column, size_t first, size_t last,
+                                ColumnReductions::Stats& stats);
 };
\ No newline at end of file
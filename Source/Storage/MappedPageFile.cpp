@@ -0,0 +1,123 @@
+#include "MappedPageFile.h"
+#include <iterator>
+
+bool MappedPageFile::open(const juce::File& newFile, size_t newPageBytes)
+{
+    close();
+
+    if (!newFile.existsAsFile() && !newFile.create().wasOk())
+        return false;
+
+    file = newFile;
+    pageBytes = newPageBytes;
+
+    const auto segmentBytes = static_cast<juce::int64>(pageBytes * kPagesPerSegment);
+    const auto numSegments = static_cast<size_t>(file.getSize() / segmentBytes);
+
+    // A crash while the file grew can leave part of a segment at the end; it holds no
+    // pages, and segments added later must start where the whole ones end
+    if (!truncateTo(static_cast<juce::int64>(numSegments) * segmentBytes))
+    {
+        close();
+        return false;
+    }
+
+    for (size_t segment = 0; segment < numSegments; ++segment)
+    {
+        if (!mapSegment(segment))
+        {
+            close();
+            return false;
+        }
+    }
+
+    numPages = numSegments * kPagesPerSegment;
+    return true;
+}
+
+void MappedPageFile::close()
+{
+    segments.clear();
+    segmentsByAddress.clear();
+    file = juce::File();
+    pageBytes = 0;
+    numPages = 0;
+}
+
+bool MappedPageFile::mapSegment(size_t segment)
+{
+    const auto segmentBytes = static_cast<juce::int64>(pageBytes * kPagesPerSegment);
+    const auto start = static_cast<juce::int64>(segment) * segmentBytes;
+
+    auto mapping = std::make_unique<juce::MemoryMappedFile>(file, juce::Range<juce::int64>(start, start + segmentBytes),
+                                                            juce::MemoryMappedFile::readWrite);
+
+    if (mapping->getData() == nullptr || mapping->getSize() < static_cast<size_t>(segmentBytes))
+        return false;
+
+    segmentsByAddress[static_cast<const char*>(mapping->getData())] = segment;
+    segments.push_back(std::move(mapping));
+    return true;
+}
+
+bool MappedPageFile::truncateTo(juce::int64 length)
+{
+    if (file.getSize() == length)
+        return true;
+
+    juce::FileOutputStream out(file);
+    return out.openedOk() && out.setPosition(length) && out.truncate().wasOk();
+}
+
+void* MappedPageFile::addPage()
+{
+    if (!isOpen())
+        return nullptr;
+
+    if (numPages == segments.size() * kPagesPerSegment)
+    {
+        // Extend by a zeroed segment, then map it. It goes straight after the mapped
+        // segments, over anything a failed extension left there.
+        const auto end = static_cast<juce::int64>(segments.size() * kPagesPerSegment * pageBytes);
+
+        juce::FileOutputStream out(file);
+        if (out.failedToOpen() || !out.setPosition(end))
+            return nullptr;
+
+        const std::vector<char> zeros(pageBytes, 0);
+        for (size_t i = 0; i < kPagesPerSegment; ++i)
+            if (!out.write(zeros.data(), zeros.size()))
+                return nullptr;
+
+        out.flush();
+
+        if (!mapSegment(segments.size()))
+            return nullptr;
+    }
+
+    return getPage(numPages++);
+}
+
+void* MappedPageFile::getPage(size_t pageNumber) const
+{
+    const size_t segment = pageNumber / kPagesPerSegment;
+    if (segment >= segments.size())
+        return nullptr;
+
+    return static_cast<char*>(segments[segment]->getData()) + (pageNumber % kPagesPerSegment) * pageBytes;
+}
+
+size_t MappedPageFile::getPageNumber(const void* page) const
+{
+    const auto* address = static_cast<const char*>(page);
+
+    // The segment mapped at the highest address not above the page
+    auto next = segmentsByAddress.upper_bound(address);
+    if (next == segmentsByAddress.begin())
+        return SIZE_MAX;
+
+    const auto segment = std::prev(next);
+    const auto offset = static_cast<size_t>(address - segment->first);
+
+    return offset < pageBytes * kPagesPerSegment ? segment->second * kPagesPerSegment + offset / pageBytes : SIZE_MAX;
+}
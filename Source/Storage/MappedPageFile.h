@@ -0,0 +1,57 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <vector>
+
+/**
+ * File of fixed-size pages, mapped into memory a segment at a time
+ *
+ * The file only ever grows, by whole segments, and every segment stays mapped while
+ * the file is open, so page pointers handed out stay valid. Pages are written through
+ * the mapping; the OS decides what stays resident and when it reaches the disk.
+ *
+ * Page numbers are the page's position in the file and are what callers persist. The
+ * file does not record which pages are in use; that is up to its owner.
+ */
+class MappedPageFile
+{
+public:
+    MappedPageFile() = default;
+    ~MappedPageFile() = default;
+
+    // Open (creating if needed) and map every whole segment already in the file; the
+    // pages in them count as allocated, and a partial segment at the end is cut off
+    bool open(const juce::File& file, size_t pageBytes);
+    void close();
+    bool isOpen() const { return pageBytes > 0; }
+
+    size_t getNumPages() const { return numPages; }
+
+    // Grow by one page; returns nullptr if the file can't be extended or mapped
+    void* addPage();
+
+    void* getPage(size_t pageNumber) const;
+
+    // Position of a page returned by addPage() or getPage(), or SIZE_MAX if it isn't one
+    size_t getPageNumber(const void* page) const;
+
+private:
+    bool mapSegment(size_t segment);
+    bool truncateTo(juce::int64 length);
+
+    // 256 pages: 512KB to 2MB segments for the history's page sizes
+    static constexpr size_t kPagesPerSegment = 256;
+
+    juce::File file;
+    size_t pageBytes{0};
+    size_t numPages{0};
+    std::vector<std::unique_ptr<juce::MemoryMappedFile>> segments;
+
+    // Segment number by mapped address, so a page's number is found in O(log segments)
+    std::map<const char*, size_t> segmentsByAddress;
+
+    JUCE_DECLARE_NON_COPYABLE(MappedPageFile)
+};
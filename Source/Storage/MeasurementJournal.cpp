@@ -0,0 +1,414 @@
+#include "MeasurementJournal.h"
+#include <algorithm>
+#include <cstring>
+#include <limits>
+
+namespace
+{
+    // CRC-32 (IEEE 802.3, reflected)
+    struct Crc32Table
+    {
+        std::array<uint32_t, 256> entries{};
+
+        Crc32Table()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t value = i;
+                for (int bit = 0; bit < 8; ++bit)
+                    value = (value & 1) != 0 ? 0xedb88320u ^ (value >> 1) : value >> 1;
+
+                entries[i] = value;
+            }
+        }
+    };
+
+    uint32_t crc32(const uint8_t* data, size_t numBytes)
+    {
+        static const Crc32Table table;
+
+        uint32_t crc = 0xffffffffu;
+        for (size_t i = 0; i < numBytes; ++i)
+            crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+        return crc ^ 0xffffffffu;
+    }
+
+    // Files open in some journal of this process, e.g. when a host copies one plugin
+    // instance's state into another
+    struct OpenFiles
+    {
+        std::mutex lock;
+        std::vector<juce::File> files;
+    };
+
+    OpenFiles& getOpenFiles()
+    {
+        static OpenFiles openFiles;
+        return openFiles;
+    }
+
+    bool isOpenInProcess(const OpenFiles& openFiles, const juce::File& file)
+    {
+        return std::find(openFiles.files.begin(), openFiles.files.end(), file) != openFiles.files.end();
+    }
+
+    // Lock names have to be plain file names on every platform, so the path is hashed
+    juce::String getLockName(const juce::File& file)
+    {
+        return "LoudnessJournal_" + juce::String::toHexString(file.getFullPathName().hashCode64());
+    }
+
+    // Whether another process holds file's lock (under the open files lock). POSIX record
+    // locks belong to the process, so a probe can't see the process's own locks and
+    // releasing it would drop them: files the process has open are checked first.
+    bool isLockedByOtherProcess(const juce::File& file)
+    {
+        juce::InterProcessLock probe(getLockName(file));
+        if (!probe.enter(0))
+            return true;
+
+        probe.exit();
+        return false;
+    }
+
+    template <typename T>
+    uint8_t* put(uint8_t* out, T value)
+    {
+        std::memcpy(out, &value, sizeof(T));
+        return out + sizeof(T);
+    }
+
+    template <typename T>
+    T get(const uint8_t* in)
+    {
+        T value;
+        std::memcpy(&value, in, sizeof(T));
+        return value;
+    }
+}
+
+MeasurementJournal::MeasurementJournal()
+    : juce::Thread("Loudness journal writer")
+{
+    block.reserve(kBlockHeaderBytes + kQueueCapacity * kRecordBytes);
+    startThread(juce::Thread::Priority::background);
+}
+
+MeasurementJournal::~MeasurementJournal()
+{
+    stopThread(2000);
+    stop(false);
+}
+
+bool MeasurementJournal::start(const juce::File& newFile, const Header& header)
+{
+    std::lock_guard<std::mutex> lock(writerMutex);
+
+    closeStream();
+    discardPending();
+
+    if (!openStream(newFile))
+        return false;
+
+    std::array<uint8_t, kHeaderBytes> bytes;
+    auto* out = put(bytes.data(), kFileMagic);
+    out = put(out, kVersion);
+    out = put(out, header.historyId);
+    out = put(out, header.updateRate);
+    put(out, crc32(bytes.data(), kHeaderBytes - 4));
+
+    // The header is synced straight away, so replay can always tell whose records follow
+    if (!stream->setPosition(0) || stream->truncate().failed()
+        || !stream->write(bytes.data(), bytes.size()) || !stream->flush())
+    {
+        closeStream();
+        return false;
+    }
+
+    return true;
+}
+
+bool MeasurementJournal::resume(const juce::File& newFile, juce::int64 intactLength)
+{
+    std::lock_guard<std::mutex> lock(writerMutex);
+
+    closeStream();
+    discardPending();
+
+    if (intactLength < static_cast<juce::int64>(kHeaderBytes) || !openStream(newFile))
+        return false;
+
+    // A torn block at the end would hide every block written after it
+    if (!stream->setPosition(intactLength) || stream->truncate().failed())
+    {
+        closeStream();
+        return false;
+    }
+
+    return true;
+}
+
+void MeasurementJournal::stop(bool deleteFile)
+{
+    std::lock_guard<std::mutex> lock(writerMutex);
+
+    if (stream != nullptr)
+    {
+        writePending();
+        stream->flush();
+    }
+
+    const auto oldFile = file;
+    closeStream();
+
+    if (deleteFile && oldFile != juce::File())
+        oldFile.deleteFile();
+}
+
+bool MeasurementJournal::isInUse(const juce::File& file)
+{
+    auto& openFiles = getOpenFiles();
+    std::lock_guard<std::mutex> lock(openFiles.lock);
+    return isOpenInProcess(openFiles, file) || isLockedByOtherProcess(file);
+}
+
+int MeasurementJournal::removeStale(const juce::File& directory, juce::RelativeTime maxAge)
+{
+    const auto cutoff = juce::Time::getCurrentTime() - maxAge;
+    int numRemoved = 0;
+
+    for (const auto& journalFile : directory.findChildFiles(juce::File::findFiles, false, "*.journal"))
+    {
+        if (journalFile.getLastModificationTime() >= cutoff)
+            continue;
+
+        auto& openFiles = getOpenFiles();
+        std::lock_guard<std::mutex> lock(openFiles.lock);
+
+        if (isOpenInProcess(openFiles, journalFile))
+            continue;
+
+        // Held while deleting, so no other process opens the journal in between
+        juce::InterProcessLock journalLock(getLockName(journalFile));
+        if (!journalLock.enter(0))
+            continue;
+
+        if (journalFile.deleteFile())
+            ++numRemoved;
+
+        journalLock.exit();
+    }
+
+    return numRemoved;
+}
+
+bool MeasurementJournal::openStream(const juce::File& newFile)
+{
+    auto& openFiles = getOpenFiles();
+    std::lock_guard<std::mutex> lock(openFiles.lock);
+
+    if (isOpenInProcess(openFiles, newFile) || newFile.getParentDirectory().createDirectory().failed())
+        return false;
+
+    // Keeps other processes out, e.g. a second instance of the host restoring the same project
+    auto newLock = std::make_unique<juce::InterProcessLock>(getLockName(newFile));
+    if (!newLock->enter(0))
+        return false;
+
+    // Unbuffered: each block goes to the OS in a single write as soon as it is built
+    auto newStream = std::make_unique<juce::FileOutputStream>(newFile, 0);
+    if (newStream->failedToOpen())
+        return false;
+
+    openFiles.files.push_back(newFile);
+    file = newFile;
+    fileLock = std::move(newLock);
+    stream = std::move(newStream);
+    needsSync = false;
+    lastSyncTime = juce::Time::getMillisecondCounter();
+    active.store(true, std::memory_order_release);
+    return true;
+}
+
+void MeasurementJournal::closeStream()
+{
+    active.store(false, std::memory_order_release);
+    stream.reset();
+
+    if (file != juce::File())
+    {
+        auto& openFiles = getOpenFiles();
+        std::lock_guard<std::mutex> lock(openFiles.lock);
+
+        // Released under the open files lock, so it can't take down a lock that a new
+        // journal of this process has just taken on the same file
+        fileLock.reset();
+        openFiles.files.erase(std::remove(openFiles.files.begin(), openFiles.files.end(), file), openFiles.files.end());
+        file = juce::File();
+    }
+}
+
+bool MeasurementJournal::append(const Record& record)
+{
+    if (!active.load(std::memory_order_acquire))
+        return false;
+
+    int start1, size1, start2, size2;
+    fifo.prepareToWrite(1, start1, size1, start2, size2);
+
+    if (size1 == 0)
+        return false;
+
+    queue[static_cast<size_t>(start1)] = record;
+    fifo.finishedWrite(1);
+    return true;
+}
+
+void MeasurementJournal::discardPending()
+{
+    fifo.finishedRead(fifo.getNumReady());
+}
+
+void MeasurementJournal::run()
+{
+    while (!threadShouldExit())
+    {
+        wait(kWriteIntervalMs);
+
+        std::lock_guard<std::mutex> lock(writerMutex);
+        if (stream == nullptr)
+            continue;
+
+        writePending();
+
+        // fsync is the expensive part, so blocks in between only reach the OS cache
+        const auto now = juce::Time::getMillisecondCounter();
+        if (needsSync && now - lastSyncTime >= kSyncIntervalMs)
+        {
+            stream->flush();
+            needsSync = false;
+            lastSyncTime = now;
+        }
+    }
+}
+
+void MeasurementJournal::writePending()
+{
+    int start1, size1, start2, size2;
+    fifo.prepareToRead(fifo.getNumReady(), start1, size1, start2, size2);
+
+    if (size1 + size2 == 0)
+        return;
+
+    block.resize(kBlockHeaderBytes + static_cast<size_t>(size1 + size2) * kRecordBytes);
+
+    auto* const blockStart = block.data();
+    auto* out = blockStart + kBlockHeaderBytes;
+    uint32_t numRecords = 0;
+    int64_t firstSequence = 0;
+    int64_t firstIndex = 0;
+
+    auto finishBlock = [&]
+    {
+        if (numRecords == 0)
+            return;
+
+        auto* header = put(blockStart, kBlockMagic);
+        auto* const counted = header + 4;
+        put(put(put(counted, numRecords), firstSequence), firstIndex);
+        put(header, crc32(counted, static_cast<size_t>(out - counted)));
+
+        if (stream->write(blockStart, static_cast<size_t>(out - blockStart)))
+            needsSync = true;
+
+        out = blockStart + kBlockHeaderBytes;
+        numRecords = 0;
+    };
+
+    auto addRecords = [&](int start, int size)
+    {
+        for (int i = start; i < start + size; ++i)
+        {
+            const auto& record = queue[static_cast<size_t>(i)];
+
+            // Offsets are 32 bits and never negative, and sequence numbers follow on; anything
+            // else starts a new block
+            if (numRecords > 0 && (record.index < firstIndex
+                                   || record.index - firstIndex > std::numeric_limits<uint32_t>::max()
+                                   || record.sequence != firstSequence + numRecords))
+                finishBlock();
+
+            if (numRecords == 0)
+            {
+                firstSequence = record.sequence;
+                firstIndex = record.index;
+            }
+
+            out = put(out, static_cast<uint32_t>(record.index - firstIndex));
+            out = put(out, record.momentary);
+            out = put(out, record.shortTerm);
+            out = put(out, record.truePeak);
+            ++numRecords;
+        }
+    };
+
+    addRecords(start1, size1);
+    addRecords(start2, size2);
+    finishBlock();
+
+    fifo.finishedRead(size1 + size2);
+}
+
+juce::int64 MeasurementJournal::replay(const juce::File& file, Header& header,
+                                       const std::function<void(const Record&)>& onRecord)
+{
+    juce::MemoryBlock data;
+    if (!file.existsAsFile() || !file.loadFileAsData(data) || data.getSize() < kHeaderBytes)
+        return -1;
+
+    const auto* const bytes = static_cast<const uint8_t*>(data.getData());
+    const size_t size = data.getSize();
+
+    if (get<uint32_t>(bytes) != kFileMagic || get<uint32_t>(bytes + 4) != kVersion
+        || get<uint32_t>(bytes + kHeaderBytes - 4) != crc32(bytes, kHeaderBytes - 4))
+        return -1;
+
+    header.historyId = get<uint64_t>(bytes + 8);
+    header.updateRate = get<double>(bytes + 16);
+
+    size_t position = kHeaderBytes;
+
+    while (size - position >= kBlockHeaderBytes)
+    {
+        const auto* const blockStart = bytes + position;
+        const auto numRecords = get<uint32_t>(blockStart + 8);
+
+        if (get<uint32_t>(blockStart) != kBlockMagic
+            || numRecords > (size - position - kBlockHeaderBytes) / kRecordBytes)
+            break;
+
+        const size_t blockBytes = kBlockHeaderBytes + numRecords * kRecordBytes;
+        if (get<uint32_t>(blockStart + 4) != crc32(blockStart + 8, blockBytes - 8))
+            break;
+
+        const auto firstSequence = get<int64_t>(blockStart + 12);
+        const auto firstIndex = get<int64_t>(blockStart + 20);
+        const auto* in = blockStart + kBlockHeaderBytes;
+
+        for (uint32_t i = 0; i < numRecords; ++i, in += kRecordBytes)
+        {
+            Record record;
+            record.sequence = firstSequence + i;
+            record.index = firstIndex + get<uint32_t>(in);
+            record.momentary = get<float>(in + 4);
+            record.shortTerm = get<float>(in + 8);
+            record.truePeak = get<float>(in + 12);
+            onRecord(record);
+        }
+
+        position += blockBytes;
+    }
+
+    return static_cast<juce::int64>(position);
+}
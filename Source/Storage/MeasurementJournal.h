@@ -0,0 +1,127 @@
+#pragma once
+
+#include <juce_core/juce_core.h>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+ * Append-only file of every measurement point, for getting a history back after a crash
+ *
+ * The owner hands points to append() through a wait-free single-producer queue; a
+ * background thread drains it every 100ms and appends what it found as one block with
+ * a CRC-32, so a crash loses at most the last block or two. The file is synced to disk
+ * at most once a second, however many blocks were written.
+ *
+ * replay() reads the points back in order and stops at the first block that is torn or
+ * fails its checksum, so a crash in the middle of a write only costs that block. A
+ * point may replace one recorded before it, so records carry a sequence number as
+ * well as their index; the owner uses it to tell which records it already holds.
+ * Integers and floats are stored in native byte order: a journal is read back on the
+ * machine that wrote it.
+ *
+ * An open journal holds an inter-process lock named after its path, so no other
+ * journal, in this process or another, writes to the same file. Journals only outlive
+ * their owner after a crash; removeStale() clears out the ones nobody came back for.
+ */
+class MeasurementJournal : private juce::Thread
+{
+public:
+    struct Record
+    {
+        int64_t sequence{0};    // order in which the history received its points
+        int64_t index{0};       // point index in the history
+        float momentary{-100.0f};
+        float shortTerm{-100.0f};
+        float truePeak{-100.0f};
+    };
+
+    // Identifies the history the records belong to
+    struct Header
+    {
+        uint64_t historyId{0};
+        double updateRate{0.0};
+    };
+
+    MeasurementJournal();
+    ~MeasurementJournal() override;
+
+    // Start a new journal in file, replacing what it held. Both fail if another journal
+    // has the file open.
+    bool start(const juce::File& file, const Header& header);
+
+    // Carry on appending to a journal replay() accepted, cutting it back to its intact length
+    bool resume(const juce::File& file, juce::int64 intactLength);
+
+    // Write what is queued, then close the file (deleting it if asked)
+    void stop(bool deleteFile);
+
+    // True while any journal, in this process or another, has file open; two journals
+    // never share one
+    static bool isInUse(const juce::File& file);
+    
+    // Delete the journals (*.journal) in directory that no journal has open and that
+    // were last written before maxAge ago; returns how many went
+    static int removeStale(const juce::File& directory, juce::RelativeTime maxAge);
+
+    bool isActive() const { return active.load(std::memory_order_acquire); }
+    juce::File getFile() const { return file; }
+
+    // Producer thread only; wait-free. Returns false (and drops the record) if the
+    // journal isn't running or the queue is full.
+    bool append(const Record& record);
+
+    // Read a journal: header is filled in before the first record is passed on. Returns
+    // the length of the intact part of the file, or -1 if it has no valid header.
+    static juce::int64 replay(const juce::File& file, Header& header,
+                              const std::function<void(const Record&)>& onRecord);
+
+private:
+    void run() override;
+
+    // Append everything queued as blocks (writer, under writerMutex)
+    void writePending();
+
+    // Consumer side of the queue (writer, under writerMutex)
+    void discardPending();
+
+    bool openStream(const juce::File& newFile);
+    void closeStream();
+
+    static constexpr uint32_t kFileMagic = 0x314a444c;    // "LDJ1"
+    static constexpr uint32_t kBlockMagic = 0x4b4c424a;   // "JBLK"
+    static constexpr uint32_t kVersion = 2;
+
+    // magic, version, history id, update rate, CRC of the rest
+    static constexpr size_t kHeaderBytes = 4 + 4 + 8 + 8 + 4;
+
+    // magic, CRC of the rest, record count, sequence and index of the first record. The
+    // records of a block have consecutive sequence numbers; each is its index offset from
+    // the first and the three values.
+    static constexpr size_t kBlockHeaderBytes = 4 + 4 + 4 + 8 + 8;
+    static constexpr size_t kRecordBytes = 4 + 3 * 4;
+
+    // ~40s of points at the finest (10ms) hop, drained every 100ms
+    static constexpr int kQueueCapacity = 4096;
+    static constexpr int kWriteIntervalMs = 100;
+    static constexpr uint32_t kSyncIntervalMs = 1000;
+
+    juce::AbstractFifo fifo{kQueueCapacity};
+    std::array<Record, kQueueCapacity> queue;
+
+    // Serialises the writer thread with start/resume/stop; the producer never takes it
+    std::mutex writerMutex;
+    juce::File file;
+    std::unique_ptr<juce::InterProcessLock> fileLock;
+    std::unique_ptr<juce::FileOutputStream> stream;
+    std::vector<uint8_t> block;
+    std::atomic<bool> active{false};
+    bool needsSync{false};
+    uint32_t lastSyncTime{0};
+
+    JUCE_DECLARE_NON_COPYABLE(MeasurementJournal)
+};
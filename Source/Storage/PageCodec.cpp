@@ -0,0 +1,308 @@
+#include "PageCodec.h"
+#include <juce_core/juce_core.h>
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+namespace
+{
+    constexpr size_t kBlockSize = 64;
+    constexpr int kWidthBits = 6;
+
+    // Bits go out least significant first; a single write takes at most 57 bits
+    class BitWriter
+    {
+    public:
+        explicit BitWriter(std::vector<uint8_t>& destination) : out(destination) {}
+
+        void write(uint64_t value, int width)
+        {
+            bits |= value << numBits;
+            numBits += width;
+
+            while (numBits >= 8)
+            {
+                out.push_back(static_cast<uint8_t>(bits));
+                bits >>= 8;
+                numBits -= 8;
+            }
+        }
+
+        void writeWide(uint64_t value, int width)
+        {
+            if (width > 32)
+            {
+                write(value & 0xffffffffu, 32);
+                write(value >> 32, width - 32);
+            }
+            else
+            {
+                write(value, width);
+            }
+        }
+
+        void finish()
+        {
+            if (numBits > 0)
+                out.push_back(static_cast<uint8_t>(bits));
+        }
+
+    private:
+        std::vector<uint8_t>& out;
+        uint64_t bits{0};
+        int numBits{0};
+    };
+
+    // Reads past the end return zeros
+    class BitReader
+    {
+    public:
+        BitReader(const uint8_t* source, size_t sourceBytes) : data(source), numBytes(sourceBytes) {}
+
+        uint64_t read(int width)
+        {
+            if (numBits < width)
+                refill();
+
+            const uint64_t value = bits & ((uint64_t{1} << width) - 1);
+            bits >>= width;
+            numBits -= width;
+            return value;
+        }
+
+        uint64_t readWide(int width)
+        {
+            if (width > 32)
+            {
+                const uint64_t low = read(32);
+                return low | (read(width - 32) << 32);
+            }
+
+            return read(width);
+        }
+
+    private:
+        // Top up to at least 56 bits (no read takes more than 33), a whole word at a time
+        // away from the end
+        void refill()
+        {
+            if (position + 8 <= numBytes)
+            {
+                bits |= juce::ByteOrder::littleEndianInt64(data + position) << numBits;
+                const int bytesTaken = (63 - numBits) >> 3;
+                position += static_cast<size_t>(bytesTaken);
+                numBits += bytesTaken * 8;
+                return;
+            }
+
+            while (numBits <= 56)
+            {
+                const uint64_t byte = position < numBytes ? data[position] : 0;
+                bits |= byte << numBits;
+                ++position;
+                numBits += 8;
+            }
+        }
+
+        const uint8_t* data;
+        size_t numBytes;
+        size_t position{0};
+        uint64_t bits{0};
+        int numBits{0};
+    };
+
+    uint64_t zigzag(int64_t value) { return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63); }
+    int64_t unzigzag(uint64_t value) { return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1); }
+
+    // Both need a non-zero value
+    int countLeadingZeros(uint64_t value)
+    {
+        const auto high = static_cast<uint32_t>(value >> 32);
+        return high != 0 ? 31 - juce::findHighestSetBit(high)
+                         : 63 - juce::findHighestSetBit(static_cast<uint32_t>(value));
+    }
+
+    int countTrailingZeros(uint64_t value)
+    {
+        return juce::countNumberOfBits(static_cast<juce::uint64>((value & (~value + 1)) - 1));
+    }
+
+    // The first value is stored whole, so a page that holds one value throughout packs
+    // every block at width 0
+    template <typename T>
+    void encodeIntegers(const T* values, size_t numValues, std::vector<uint8_t>& out)
+    {
+        BitWriter writer(out);
+        std::array<uint64_t, kBlockSize> deltas;
+        int64_t previous = numValues > 0 ? static_cast<int64_t>(values[0]) : 0;
+        writer.write(zigzag(previous), sizeof(T) * 8 + 1);
+
+        for (size_t start = 0; start < numValues; start += kBlockSize)
+        {
+            const size_t count = std::min(kBlockSize, numValues - start);
+            uint64_t combined = 0;
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                const auto value = static_cast<int64_t>(values[start + i]);
+                deltas[i] = zigzag(value - previous);
+                combined |= deltas[i];
+                previous = value;
+            }
+
+            const int width = combined == 0 ? 0 : 64 - countLeadingZeros(combined);
+            writer.write(static_cast<uint64_t>(width), kWidthBits);
+
+            if (width > 0)
+                for (size_t i = 0; i < count; ++i)
+                    writer.write(deltas[i], width);
+        }
+
+        writer.finish();
+    }
+
+    template <typename T>
+    void decodeIntegers(const uint8_t* data, size_t numBytes, T* values, size_t numValues)
+    {
+        BitReader reader(data, numBytes);
+        int64_t previous = unzigzag(reader.read(sizeof(T) * 8 + 1));
+
+        for (size_t start = 0; start < numValues; start += kBlockSize)
+        {
+            const size_t count = std::min(kBlockSize, numValues - start);
+            // No delta of a T takes more bits than this, however damaged the page is
+            const int width = std::min(static_cast<int>(reader.read(kWidthBits)), static_cast<int>(sizeof(T) * 8 + 1));
+
+            if (width == 0)
+            {
+                std::fill(values + start, values + start + count, static_cast<T>(previous));
+                continue;
+            }
+
+            for (size_t i = 0; i < count; ++i)
+            {
+                previous += unzigzag(reader.read(width));
+                values[start + i] = static_cast<T>(previous);
+            }
+        }
+    }
+}
+
+void PageCodec::encode(const int16_t* values, size_t numValues, std::vector<uint8_t>& out)
+{
+    encodeIntegers(values, numValues, out);
+}
+
+void PageCodec::encode(const uint32_t* values, size_t numValues, std::vector<uint8_t>& out)
+{
+    encodeIntegers(values, numValues, out);
+}
+
+void PageCodec::decode(const uint8_t* data, size_t numBytes, int16_t* values, size_t numValues)
+{
+    decodeIntegers(data, numBytes, values, numValues);
+}
+
+void PageCodec::decode(const uint8_t* data, size_t numBytes, uint32_t* values, size_t numValues)
+{
+    decodeIntegers(data, numBytes, values, numValues);
+}
+
+void PageCodec::encode(const double* values, size_t numValues, std::vector<uint8_t>& out)
+{
+    BitWriter writer(out);
+    uint64_t previous = 0;
+    int leading = -1;
+    int trailing = 0;
+
+    for (size_t i = 0; i < numValues; ++i)
+    {
+        uint64_t bits;
+        std::memcpy(&bits, &values[i], sizeof(bits));
+
+        // Each block starts with a bit telling whether it only repeats the previous value
+        if (i % kBlockSize == 0)
+        {
+            const size_t end = std::min(numValues, i + kBlockSize);
+            const bool repeats = std::all_of(values + i, values + end, [previous](double value)
+            {
+                uint64_t valueBits;
+                std::memcpy(&valueBits, &value, sizeof(valueBits));
+                return valueBits == previous;
+            });
+
+            writer.write(repeats ? 0 : 1, 1);
+
+            if (repeats)
+            {
+                i = end - 1;
+                continue;
+            }
+        }
+
+        const uint64_t difference = bits ^ previous;
+        previous = bits;
+
+        if (difference == 0)
+        {
+            writer.write(0, 1);
+            continue;
+        }
+
+        const int newLeading = countLeadingZeros(difference);
+        const int newTrailing = countTrailingZeros(difference);
+
+        // 1 then 0: the changed bits fit the previous window; 1 then 1: a new window follows
+        if (leading >= 0 && newLeading >= leading && newTrailing >= trailing)
+        {
+            writer.write(1, 2);
+        }
+        else
+        {
+            leading = newLeading;
+            trailing = newTrailing;
+            writer.write(3, 2);
+            writer.write(static_cast<uint64_t>(leading), kWidthBits);
+            writer.write(static_cast<uint64_t>(63 - leading - trailing), kWidthBits);
+        }
+
+        writer.writeWide(difference >> trailing, 64 - leading - trailing);
+    }
+
+    writer.finish();
+}
+
+void PageCodec::decode(const uint8_t* data, size_t numBytes, double* values, size_t numValues)
+{
+    BitReader reader(data, numBytes);
+    uint64_t previous = 0;
+    int leading = 0;
+    int trailing = 0;
+
+    for (size_t i = 0; i < numValues; ++i)
+    {
+        if (i % kBlockSize == 0 && reader.read(1) == 0)
+        {
+            const size_t end = std::min(numValues, i + kBlockSize);
+            for (; i < end; ++i)
+                std::memcpy(&values[i], &previous, sizeof(previous));
+
+            --i;
+            continue;
+        }
+
+        if (reader.read(1) != 0)
+        {
+            if (reader.read(1) != 0)
+            {
+                leading = static_cast<int>(reader.read(kWidthBits));
+                trailing = 63 - leading - static_cast<int>(reader.read(kWidthBits));
+                trailing = std::max(0, trailing);
+            }
+
+            previous ^= reader.readWide(64 - leading - trailing) << trailing;
+        }
+
+        std::memcpy(&values[i], &previous, sizeof(previous));
+    }
+}
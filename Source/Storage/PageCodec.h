@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Lossless compression of sealed history pages
+ *
+ * Integer pages (quantised columns, gating block counts) are cut into blocks of 64
+ * values, each stored as zigzag deltas packed at the width of the block's largest
+ * delta. A block that doesn't change at all (silence, a steady level, full block
+ * counts) packs at width 0 and costs 6 bits, so long runs come almost for free.
+ *
+ * Gated energy is XOR-coded against the previous value in the style of Gorilla
+ * time-series compression: a repeated value costs one bit and any other value only the
+ * bits that changed, with their position reused while it still fits. A block of 64
+ * values that only repeats the previous one (silence) costs a single bit.
+ *
+ * Decoding fills exactly numValues values and never reads past the encoded bytes.
+ */
+class PageCodec
+{
+public:
+    // Append the encoding of values[0, numValues) to out
+    static void encode(const int16_t* values, size_t numValues, std::vector<uint8_t>& out);
+    static void encode(const uint32_t* values, size_t numValues, std::vector<uint8_t>& out);
+    static void encode(const double* values, size_t numValues, std::vector<uint8_t>& out);
+
+    static void decode(const uint8_t* data, size_t numBytes, int16_t* values, size_t numValues);
+    static void decode(const uint8_t* data, size_t numBytes, uint32_t* values, size_t numValues);
+    static void decode(const uint8_t* data, size_t numBytes, double* values, size_t numValues);
+};
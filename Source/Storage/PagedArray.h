@@ -0,0 +1,720 @@
+#pragma once
+
+#include "MappedPageFile.h"
+#include "PageCodec.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * Pool of fixed-size pages shared by several PagedArrays
+ *
+ * Pages are allocated up front; when the pool runs dry a new page is allocated on its
+ * own, so growing never copies existing data. Released pages are reused. Not thread-safe:
+ * the owner serialises access.
+ *
+ * With a backing file, pages come from the file instead (it grows a segment at a time),
+ * and a page's number in the file identifies it across sessions. Should the file fail to
+ * grow, pages fall back to the heap and have no page number. A released page may still
+ * be listed by the index its owner saved last, so it is held back until the owner has
+ * saved a newer one and calls reuseReleasedPages().
+ */
+template <typename T, size_t PageSize>
+class PagePool
+{
+public:
+    explicit PagePool(size_t initialPages)
+    {
+        pages.reserve(initialPages);
+        freePages.reserve(initialPages);
+
+        for (size_t i = 0; i < initialPages; ++i)
+        {
+            pages.push_back(std::make_unique<T[]>(PageSize));
+            freePages.push_back(pages.back().get());
+        }
+    }
+
+    T* acquire()
+    {
+        if (freePages.empty())
+        {
+            if (backing != nullptr)
+                if (auto* page = static_cast<T*>(backing->addPage()))
+                    return page;
+            
+            pages.push_back(std::make_unique<T[]>(PageSize));
+            return pages.back().get();
+        }
+
+        T* page = freePages.back();
+        freePages.pop_back();
+        return page;
+    }
+
+    void release(T* page) { (backing != nullptr ? releasedPages : freePages).push_back(page); }
+
+    // The owner's saved index no longer lists the pages released so far
+    void reuseReleasedPages()
+    {
+        freePages.insert(freePages.end(), releasedPages.begin(), releasedPages.end());
+        releasedPages.clear();
+    }
+
+    size_t getNumPages() const { return pages.size() + (backing != nullptr ? backing->getNumPages() : 0); }
+    size_t getNumFreePages() const { return freePages.size(); }
+
+    // Switch to (or, with nullptr, away from) a backing file. Every page must be back in
+    // the pool: heap pages are freed, and file pages not listed in pagesInUse become free.
+    void setBacking(MappedPageFile* newBacking, const std::vector<size_t>& pagesInUse)
+    {
+        pages.clear();
+        freePages.clear();
+        releasedPages.clear();
+        backing = newBacking;
+
+        if (backing == nullptr)
+            return;
+
+        std::vector<bool> inUse(backing->getNumPages(), false);
+        for (auto page : pagesInUse)
+            if (page < inUse.size())
+                inUse[page] = true;
+
+        for (size_t page = inUse.size(); page-- > 0;)
+            if (!inUse[page])
+                freePages.push_back(static_cast<T*>(backing->getPage(page)));
+    }
+
+    // File page by number, and the number of a page (SIZE_MAX for a heap page)
+    T* getPage(size_t pageNumber) const
+    {
+        return backing != nullptr ? static_cast<T*>(backing->getPage(pageNumber)) : nullptr;
+    }
+
+    size_t getPageNumber(const T* page) const
+    {
+        return backing != nullptr ? backing->getPageNumber(page) : SIZE_MAX;
+    }
+
+private:
+    std::vector<std::unique_ptr<T[]>> pages;
+    std::vector<T*> freePages;
+    std::vector<T*> releasedPages;
+    MappedPageFile* backing{nullptr};
+};
+
+/**
+ * Array stored in pool pages, appended to by one writer and readable from other threads
+ * through Views
+ *
+ * push_back is O(1) and never moves existing elements. Elements keep an absolute index
+ * for the lifetime of the array (dropping or clearing only advances the first index)
+ * and page pointers live in a ring directory, so a View handed out by the writer stays
+ * valid until the pages and directory it refers to are reclaimed.
+ *
+ * Elements readers may already see are changed copy-on-write: set() copies the page on
+ * its first write, and commitWrites() puts the copies in a copy of the directory. A View
+ * taken before the commit goes on seeing every page as it was, one taken after sees all
+ * the writes, and none sees a page being written.
+ *
+ * Pages dropped from the front and directories replaced by a bigger ring or a commit
+ * are retired with the writer's epoch and only go back to the pool (or the heap) once
+ * reclaim() is told that every reader has moved past it, as are pages replaced by a
+ * copy. A directory slot is reused for a new page only after the page it held has been
+ * reclaimed.
+ *
+ * With compression on, every full page but the newest is encoded with PageCodec when
+ * the array moves on to a new page, and its slot switches to the encoded copy; the page
+ * itself is retired like a dropped one. The hot tail (the page being written and the one
+ * before) is always read in place. A View decodes older pages into the DecodeCache its
+ * reader gave it, so a reader pays one decode per page it touches, and nothing for pages
+ * a cache it keeps across queries still holds. Decoding is not free: queries over old
+ * ranges cost 10-40% more than in place, and statistics split down to single points
+ * across a long range about twice as much.
+ *
+ * All modifying calls belong to a single writer.
+ */
+template <typename T, size_t PageSize = 1024>
+class PagedArray
+{
+public:
+    static_assert((PageSize & (PageSize - 1)) == 0, "PageSize must be a power of two");
+
+    using Pool = PagePool<T, PageSize>;
+
+    // A directory slot holds a page or, with the low bit set, a compressed page
+    using Slot = std::atomic<uintptr_t>;
+
+    class DecodeCache;
+
+    // Immutable window onto the array as it was when the View was taken. Elements are
+    // read by value; compressed pages are decoded into cache, which the reader owns and
+    // must set before reading one.
+    struct View
+    {
+        const Slot* directory{nullptr};
+        size_t directoryMask{0};
+        size_t firstIndex{0};
+        size_t endIndex{0};
+        DecodeCache* cache{nullptr};
+
+        size_t size() const { return endIndex - firstIndex; }
+        bool empty() const { return endIndex == firstIndex; }
+
+        // i counts from the first retained element
+        T operator[](size_t i) const
+        {
+            const size_t index = firstIndex + i;
+            return readPage(directory[(index >> kPageShift) & directoryMask], cache)[index & kPageMask];
+        }
+
+        T front() const { return (*this)[0]; }
+        T back() const { return (*this)[size() - 1]; }
+
+        // Visit elements [first, last) as contiguous runs of at most a page each, calling
+        // visit(const T* run, size_t runLength). A run of a compressed page lives in the
+        // cache, so it is only valid during the call, which must not read through the
+        // same cache.
+        template <typename Visitor>
+        void forEachRun(size_t first, size_t last, Visitor&& visit) const
+        {
+            const size_t end = firstIndex + last;
+
+            for (size_t index = firstIndex + first; index < end;)
+            {
+                const size_t runLength = std::min(PageSize - (index & kPageMask), end - index);
+                visit(readPage(directory[(index >> kPageShift) & directoryMask], cache) + (index & kPageMask), runLength);
+                index += runLength;
+            }
+        }
+    };
+
+    class const_iterator
+    {
+    public:
+        using iterator_category = std::random_access_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = T;
+
+        const_iterator() = default;
+        const_iterator(const View* v, size_t i) : view(v), index(i) {}
+
+        reference operator*() const { return (*view)[index]; }
+        reference operator[](difference_type n) const { return (*view)[offset(n)]; }
+
+        const_iterator& operator++() { ++index; return *this; }
+        const_iterator& operator--() { --index; return *this; }
+        const_iterator operator++(int) { auto old = *this; ++index; return old; }
+        const_iterator operator--(int) { auto old = *this; --index; return old; }
+        const_iterator& operator+=(difference_type n) { index = offset(n); return *this; }
+        const_iterator& operator-=(difference_type n) { index = offset(-n); return *this; }
+        const_iterator operator+(difference_type n) const { return { view, offset(n) }; }
+        const_iterator operator-(difference_type n) const { return { view, offset(-n) }; }
+        difference_type operator-(const const_iterator& other) const
+        {
+            return static_cast<difference_type>(index) - static_cast<difference_type>(other.index);
+        }
+
+        bool operator==(const const_iterator& other) const { return index == other.index; }
+        bool operator!=(const const_iterator& other) const { return index != other.index; }
+        bool operator<(const const_iterator& other) const { return index < other.index; }
+        bool operator>(const const_iterator& other) const { return index > other.index; }
+        bool operator<=(const const_iterator& other) const { return index <= other.index; }
+        bool operator>=(const const_iterator& other) const { return index >= other.index; }
+
+    private:
+        size_t offset(difference_type n) const { return static_cast<size_t>(static_cast<difference_type>(index) + n); }
+
+        const View* view{nullptr};
+        size_t index{0};
+    };
+
+    PagedArray() = default;
+
+    ~PagedArray()
+    {
+        clear(0);
+        reclaim(UINT64_MAX);
+    }
+
+    PagedArray(const PagedArray&) = delete;
+    PagedArray& operator=(const PagedArray&) = delete;
+
+    // Must be set before the first push_back; directoryPages is the initial ring size
+    void setPool(Pool* newPool, size_t directoryPages)
+    {
+        pool = newPool;
+
+        size_t capacity = 1;
+        while (capacity < directoryPages)
+            capacity <<= 1;
+
+        directory = std::make_unique<Slot[]>(capacity);
+        directoryMask = capacity - 1;
+    }
+
+    // Compress full pages from now on (pages already compressed stay so)
+    void setCompression(bool enabled) { compressionEnabled = enabled; }
+
+    void push_back(const T& value, uint64_t epoch)
+    {
+        if ((endIndex & kPageMask) == 0)
+            addPage(epoch);
+
+        getWritablePage(endIndex >> kPageShift)[endIndex & kPageMask] = value;
+        ++endIndex;
+    }
+
+    // Append count copies of value, a page at a time
+    void append(const T& value, size_t count, uint64_t epoch)
+    {
+        while (count > 0)
+        {
+            if ((endIndex & kPageMask) == 0)
+                addPage(epoch);
+
+            const size_t runLength = std::min(count, PageSize - (endIndex & kPageMask));
+            std::fill_n(getWritablePage(endIndex >> kPageShift) + (endIndex & kPageMask), runLength, value);
+            endIndex += runLength;
+            count -= runLength;
+        }
+    }
+
+    // Element index (absolute) as the writer last set it, committed or not (writer)
+    T get(size_t index) const
+    {
+        const size_t page = index >> kPageShift;
+        const T* values = findPendingPage(page);
+        return (values != nullptr ? values : readPage(directory[page & directoryMask], &writerCache))[index & kPageMask];
+    }
+
+    // Change element index (absolute, in use). Readers go on seeing the old value until
+    // commitWrites(); only the first write to a page since then copies it.
+    void set(size_t index, const T& value)
+    {
+        const size_t page = index >> kPageShift;
+        T* values = findPendingPage(page);
+
+        if (values == nullptr)
+        {
+            values = pool->acquire();
+            std::copy_n(readPage(directory[page & directoryMask], &writerCache), PageSize, values);
+            pendingPages.push_back({ values, page });
+        }
+
+        values[index & kPageMask] = value;
+    }
+
+    // Publish every page set() has copied in place of the one readers see, retiring the
+    // old one. Pages behind the hot tail go back in compressed if compression is on.
+    void commitWrites(uint64_t epoch)
+    {
+        if (pendingPages.empty())
+            return;
+
+        // Views already handed out keep the current directory, which must not change
+        // under them, so the copies go into a new one
+        const size_t capacity = directoryMask + 1;
+        auto copy = std::make_unique<Slot[]>(capacity);
+
+        for (size_t p = firstIndex >> kPageShift; p < (endIndex + kPageMask) >> kPageShift; ++p)
+            copy[p & directoryMask].store(directory[p & directoryMask].load(std::memory_order_relaxed),
+                                          std::memory_order_relaxed);
+
+        retiredDirectories.push_back({ std::move(directory), epoch });
+        directory = std::move(copy);
+
+        const size_t newestPage = (endIndex - 1) >> kPageShift;
+
+        for (const auto& pending : pendingPages)
+        {
+            auto& slot = directory[pending.pageNumber & directoryMask];
+            const uintptr_t oldSlot = slot.load(std::memory_order_relaxed);
+
+            forgetSlot(oldSlot);
+            replacedSlots.push_back({ oldSlot, epoch });
+
+            if (compressionEnabled && pending.pageNumber + 2 <= newestPage)
+            {
+                // The copy was never visible, so it can go straight back to the pool
+                slot.store(makeCompressedSlot(pending.page), std::memory_order_release);
+                pool->release(pending.page);
+            }
+            else
+            {
+                slot.store(reinterpret_cast<uintptr_t>(pending.page), std::memory_order_release);
+            }
+        }
+
+        pendingPages.clear();
+    }
+
+    // Retire the oldest numPages pages
+    void dropFrontPages(size_t numPages, uint64_t epoch)
+    {
+        for (size_t i = 0; i < numPages && firstIndex < endIndex; ++i)
+        {
+            const size_t page = firstIndex >> kPageShift;
+            const uintptr_t slot = directory[page & directoryMask].load(std::memory_order_relaxed);
+
+            forgetSlot(slot);
+            retiredPages.push_back({ slot, page, epoch });
+            discardPendingPage(page);
+            firstIndex = std::min((page + 1) << kPageShift, endIndex);
+        }
+    }
+
+    // Retire every page; new elements start on a fresh page
+    void clear(uint64_t epoch)
+    {
+        dropFrontPages(getNumPages(), epoch);
+
+        endIndex = (endIndex + kPageMask) & ~kPageMask;
+        firstIndex = endIndex;
+    }
+
+    // Hand pages and directories retired before safeEpoch back to the pool / the heap
+    void reclaim(uint64_t safeEpoch)
+    {
+        size_t reclaimed = 0;
+        while (reclaimed < retiredPages.size() && retiredPages[reclaimed].epoch < safeEpoch)
+        {
+            releaseSlot(retiredPages[reclaimed].slot);
+            reclaimedPageLimit = retiredPages[reclaimed].pageNumber + 1;
+            ++reclaimed;
+        }
+
+        retiredPages.erase(retiredPages.begin(), retiredPages.begin() + static_cast<std::ptrdiff_t>(reclaimed));
+
+        // Pages replaced by a compressed or changed copy; their slots stay in use
+        reclaimed = 0;
+        while (reclaimed < replacedSlots.size() && replacedSlots[reclaimed].epoch < safeEpoch)
+            releaseSlot(replacedSlots[reclaimed++].slot);
+
+        replacedSlots.erase(replacedSlots.begin(), replacedSlots.begin() + static_cast<std::ptrdiff_t>(reclaimed));
+
+        retiredDirectories.erase(std::remove_if(retiredDirectories.begin(), retiredDirectories.end(),
+                                                [safeEpoch](const RetiredDirectory& d) { return d.epoch < safeEpoch; }),
+                                 retiredDirectories.end());
+    }
+
+    // Rebuild an empty array from pages listed in order, the first holding firstIndex
+    void restore(const std::vector<T*>& pagesInOrder, size_t newFirstIndex, size_t newEndIndex, uint64_t epoch)
+    {
+        size_t capacity = directoryMask + 1;
+        while (capacity < pagesInOrder.size())
+            capacity <<= 1;
+
+        if (capacity != directoryMask + 1)
+        {
+            retiredDirectories.push_back({ std::move(directory), epoch });
+            directory = std::make_unique<Slot[]>(capacity);
+            directoryMask = capacity - 1;
+        }
+
+        const size_t firstPage = newFirstIndex >> kPageShift;
+        for (size_t i = 0; i < pagesInOrder.size(); ++i)
+            directory[(firstPage + i) & directoryMask].store(reinterpret_cast<uintptr_t>(pagesInOrder[i]),
+                                                             std::memory_order_release);
+
+        firstIndex = newFirstIndex;
+        endIndex = newEndIndex;
+        reclaimedPageLimit = firstPage;
+    }
+
+    // Page holding element index (absolute), for walking the pages in use; nullptr for a
+    // compressed page. Writes not yet committed are not in it.
+    const T* getPageFor(size_t index) const
+    {
+        const uintptr_t slot = directory[(index >> kPageShift) & directoryMask].load(std::memory_order_relaxed);
+        return (slot & kCompressedTag) == 0 ? reinterpret_cast<const T*>(slot) : nullptr;
+    }
+
+    // For the writer's own reads, decoding through the array's cache; a reader sets the
+    // view's cache to one of its own before reading
+    View getView() const { return { directory.get(), directoryMask, firstIndex, endIndex, &writerCache }; }
+
+    size_t size() const { return endIndex - firstIndex; }
+    bool empty() const { return endIndex == firstIndex; }
+
+    // Absolute index of the first element, and the one the next push_back will get
+    size_t getFirstIndex() const { return firstIndex; }
+    size_t getEndIndex() const { return endIndex; }
+
+    size_t getNumPages() const
+    {
+        return empty() ? 0 : ((endIndex - 1) >> kPageShift) - (firstIndex >> kPageShift) + 1;
+    }
+
+    size_t getNumCompressedPages() const { return numCompressedPages; }
+
+    // Memory held by the pages in use: whole pages, or their compressed size
+    size_t getNumBytes() const
+    {
+        return (getNumPages() - numCompressedPages) * PageSize * sizeof(T) + compressedBytes;
+    }
+
+private:
+    static constexpr size_t getShift(size_t value) { return value <= 1 ? 0 : 1 + getShift(value >> 1); }
+
+    static constexpr size_t kPageShift = getShift(PageSize);
+    static constexpr size_t kPageMask = PageSize - 1;
+
+    static constexpr uintptr_t kCompressedTag = 1;
+
+    // Encoded page, followed by its bytes. The serial tells the decode cache apart from
+    // an earlier page that happened to live at the same address.
+    struct CompressedPage
+    {
+        uint64_t serial;
+        size_t numBytes;
+
+        const uint8_t* getBytes() const { return reinterpret_cast<const uint8_t*>(this + 1); }
+    };
+
+public:
+    // Pages of one or more arrays decoded for one reader, direct-mapped by serial so that
+    // pages compressed one after the other (the columns of a level, neighbouring pages)
+    // land in different entries. A compressed page never changes, so a cache may be kept
+    // across views and queries to skip decoding what it still holds. Entries are allocated
+    // as they are first used and freed with the cache. One thread at a time; a copy
+    // starts out empty.
+    class DecodeCache
+    {
+    public:
+        // numPages is rounded up to a power of two
+        explicit DecodeCache(size_t numPages)
+        {
+            while (capacity < numPages)
+                capacity <<= 1;
+        }
+
+        DecodeCache(const DecodeCache& other) : capacity(other.capacity) {}
+        DecodeCache& operator=(const DecodeCache& other)
+        {
+            capacity = other.capacity;
+            entries.clear();
+            return *this;
+        }
+
+        DecodeCache(DecodeCache&&) = default;
+        DecodeCache& operator=(DecodeCache&&) = default;
+
+        const T* decode(const CompressedPage* page)
+        {
+            if (entries.empty())
+                entries.resize(capacity);
+
+            auto& entry = entries[static_cast<size_t>(page->serial) & (capacity - 1)];
+
+            if (entry.values == nullptr)
+                entry.values = std::make_unique<T[]>(PageSize);
+
+            if (entry.serial != page->serial)
+            {
+                entry.serial = page->serial;
+                PageCodec::decode(page->getBytes(), page->numBytes, entry.values.get(), PageSize);
+            }
+
+            return entry.values.get();
+        }
+
+    private:
+        // Serials start at 1, so 0 marks an empty entry
+        struct Entry
+        {
+            uint64_t serial{0};
+            std::unique_ptr<T[]> values;
+        };
+
+        size_t capacity{1};
+        std::vector<Entry> entries;
+    };
+
+private:
+    struct RetiredPage
+    {
+        uintptr_t slot;
+        size_t pageNumber;
+        uint64_t epoch;
+    };
+
+    struct ReplacedSlot
+    {
+        uintptr_t slot;
+        uint64_t epoch;
+    };
+
+    // Copy of a page that set() has written to, not yet visible to readers
+    struct PendingPage
+    {
+        T* page;
+        size_t pageNumber;
+    };
+
+    struct RetiredDirectory
+    {
+        std::unique_ptr<Slot[]> directory;
+        uint64_t epoch;
+    };
+
+    // The writer reads old pages one at a time (a rewind, a save), so one page will do
+    static constexpr size_t kWriterCachedPages = 1;
+
+    // The pending copy of a page, if set() has made one. A replay writes its pages in
+    // order, so the newest copy is looked at first.
+    T* findPendingPage(size_t pageNumber) const
+    {
+        for (auto pending = pendingPages.rbegin(); pending != pendingPages.rend(); ++pending)
+            if (pending->pageNumber == pageNumber)
+                return pending->page;
+
+        return nullptr;
+    }
+
+    T* getWritablePage(size_t pageNumber) const
+    {
+        if (T* pending = findPendingPage(pageNumber))
+            return pending;
+
+        return reinterpret_cast<T*>(directory[pageNumber & directoryMask].load(std::memory_order_relaxed));
+    }
+
+    void discardPendingPage(size_t pageNumber)
+    {
+        for (size_t i = 0; i < pendingPages.size(); ++i)
+        {
+            if (pendingPages[i].pageNumber == pageNumber)
+            {
+                pool->release(pendingPages[i].page);
+                pendingPages.erase(pendingPages.begin() + static_cast<std::ptrdiff_t>(i));
+                return;
+            }
+        }
+    }
+
+    static const CompressedPage* getCompressedPage(uintptr_t slot)
+    {
+        return reinterpret_cast<const CompressedPage*>(slot & ~kCompressedTag);
+    }
+
+    static const T* readPage(const Slot& slot, DecodeCache* cache)
+    {
+        const uintptr_t value = slot.load(std::memory_order_acquire);
+        if ((value & kCompressedTag) == 0)
+            return reinterpret_cast<const T*>(value);
+
+        jassert(cache != nullptr);
+        return cache->decode(getCompressedPage(value));
+    }
+
+    // Swap a full page for its compressed copy and retire the page (writer). A page with
+    // a pending copy is left to commitWrites().
+    void compressPage(size_t page, uint64_t epoch)
+    {
+        auto& slot = directory[page & directoryMask];
+        const uintptr_t value = slot.load(std::memory_order_relaxed);
+        if ((value & kCompressedTag) != 0 || findPendingPage(page) != nullptr)
+            return;
+
+        slot.store(makeCompressedSlot(reinterpret_cast<const T*>(value)), std::memory_order_release);
+        replacedSlots.push_back({ value, epoch });
+    }
+
+    // Encode a full page into a new compressed page, returned as a tagged slot value
+    uintptr_t makeCompressedSlot(const T* values)
+    {
+        encodeBuffer.clear();
+        PageCodec::encode(values, PageSize, encodeBuffer);
+
+        auto* storage = new uint8_t[sizeof(CompressedPage) + encodeBuffer.size()];
+        auto* compressed = new (storage) CompressedPage{ nextSerial.fetch_add(1, std::memory_order_relaxed),
+                                                         encodeBuffer.size() };
+        std::memcpy(storage + sizeof(CompressedPage), encodeBuffer.data(), encodeBuffer.size());
+
+        compressedBytes += sizeof(CompressedPage) + encodeBuffer.size();
+        ++numCompressedPages;
+        return reinterpret_cast<uintptr_t>(compressed) | kCompressedTag;
+    }
+
+    // Take a slot's page out of the counts as it leaves the array
+    void forgetSlot(uintptr_t slot)
+    {
+        if ((slot & kCompressedTag) != 0)
+        {
+            compressedBytes -= sizeof(CompressedPage) + getCompressedPage(slot)->numBytes;
+            --numCompressedPages;
+        }
+    }
+
+    void releaseSlot(uintptr_t slot)
+    {
+        if ((slot & kCompressedTag) != 0)
+            delete[] reinterpret_cast<const uint8_t*>(getCompressedPage(slot));
+        else
+            pool->release(reinterpret_cast<T*>(slot));
+    }
+
+    void addPage(uint64_t epoch)
+    {
+        const size_t page = endIndex >> kPageShift;
+        const size_t capacity = directoryMask + 1;
+
+        // The slot is free once the page it held (page - capacity) is back in the pool;
+        // otherwise a reader may still look at it, so move to a ring twice the size
+        if (page >= capacity && page - capacity >= reclaimedPageLimit)
+        {
+            auto bigger = std::make_unique<Slot[]>(capacity * 2);
+            const size_t biggerMask = capacity * 2 - 1;
+
+            for (size_t p = firstIndex >> kPageShift; p < page; ++p)
+                bigger[p & biggerMask].store(directory[p & directoryMask].load(std::memory_order_relaxed),
+                                             std::memory_order_relaxed);
+
+            retiredDirectories.push_back({ std::move(directory), epoch });
+            directory = std::move(bigger);
+            directoryMask = biggerMask;
+        }
+
+        directory[page & directoryMask].store(reinterpret_cast<uintptr_t>(pool->acquire()), std::memory_order_release);
+
+        // The page before this one stays as it is, for readers following the newest data
+        if (compressionEnabled && page >= 2 && page - 2 >= (firstIndex >> kPageShift))
+            compressPage(page - 2, epoch);
+    }
+
+    Pool* pool{nullptr};
+    std::unique_ptr<Slot[]> directory;
+    size_t directoryMask{0};
+
+    // Absolute element indices
+    size_t firstIndex{0};
+    size_t endIndex{0};
+
+    // Pages below this absolute page number are back in the pool
+    size_t reclaimedPageLimit{0};
+
+    std::vector<RetiredPage> retiredPages;
+    std::vector<RetiredDirectory> retiredDirectories;
+
+    bool compressionEnabled{false};
+    std::vector<ReplacedSlot> replacedSlots;
+    std::vector<PendingPage> pendingPages;
+    std::vector<uint8_t> encodeBuffer;
+    size_t numCompressedPages{0};
+    size_t compressedBytes{0};
+    mutable DecodeCache writerCache{kWriterCachedPages};
+
+    inline static std::atomic<uint64_t> nextSerial{1};
+};
+
@@ -0,0 +1,39 @@
+#include "SnapshotEpochs.h"
+#include <algorithm>
+#include <thread>
+
+int SnapshotEpochs::enter()
+{
+    for (;;)
+    {
+        for (int slot = 0; slot < kMaxReaders; ++slot)
+        {
+            // The claim and the announcement are one sequentially consistent step, so the
+            // writer either sees this reader or the reader sees the writer's latest publish
+            uint64_t expected = 0;
+            if (readerEpochs[static_cast<size_t>(slot)].compare_exchange_strong(expected, globalEpoch.load()))
+                return slot;
+        }
+
+        std::this_thread::yield();
+    }
+}
+
+void SnapshotEpochs::exit(int slot)
+{
+    readerEpochs[static_cast<size_t>(slot)].store(0);
+}
+
+uint64_t SnapshotEpochs::getOldestActiveEpoch() const
+{
+    uint64_t oldest = globalEpoch.load();
+
+    for (const auto& epoch : readerEpochs)
+    {
+        const uint64_t value = epoch.load();
+        if (value != 0)
+            oldest = std::min(oldest, value);
+    }
+
+    return oldest;
+}
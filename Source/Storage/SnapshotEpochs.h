@@ -0,0 +1,35 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Epoch-based reclamation for data shared by one writer with lock-free readers
+ *
+ * A reader announces the epoch it entered in (enter/exit), then loads whatever the
+ * writer has published. The writer retires replaced data with getEpoch(), calls
+ * advance() after publishing, and may free anything retired before
+ * getOldestActiveEpoch(): no reader that entered since can still reach it.
+ */
+class SnapshotEpochs
+{
+public:
+    static constexpr int kMaxReaders = 16;
+
+    // Claim a reader slot and announce the current epoch; returns the slot for exit().
+    // Only waits if kMaxReaders readers are inside at the same moment.
+    int enter();
+    void exit(int slot);
+
+    // Writer side
+    uint64_t getEpoch() const { return globalEpoch.load(); }
+    void advance() { globalEpoch.fetch_add(1); }
+    uint64_t getOldestActiveEpoch() const;
+
+private:
+    std::atomic<uint64_t> globalEpoch{1};
+
+    // Epoch each reader entered in, 0 when the slot is free
+    std::array<std::atomic<uint64_t>, kMaxReaders> readerEpochs{};
+};
@@ -19,10 +19,27 @@ void LoudnessHistoryDisplay::timerCallback()
     repaint();
 }
 
-void LoudnessHistoryDisplay::setCurrentLoudness(float momentary, float shortTerm)
+void LoudnessHistoryDisplay::setCurrentLoudness(float momentary, float shortTerm, float integrated,
+                                                float range, float truePeak)
 {
     currentMomentary = momentary;
     currentShortTerm = shortTerm;
+    currentIntegrated = integrated;
+    currentRange = range;
+    currentTruePeak = truePeak;
+}
+
+void LoudnessHistoryDisplay::setViewRange(double timeRange, float minLufs, float maxLufs)
+{
+    viewTimeRange = juce::jlimit(kMinTimeRange, kMaxTimeRange, timeRange);
+    
+    const float range = juce::jlimit(kMinLufsRange, kMaxLufsRange, maxLufs - minLufs);
+    viewMaxLufs = juce::jlimit(kAbsoluteMinLufs + range, 0.0f, maxLufs);
+    viewMinLufs = viewMaxLufs - range;
+    
+    lastViewTimeRange = -1.0;
+    pathsNeedRebuild = true;
+    repaint();
 }
 
 void LoudnessHistoryDisplay::updateDisplayTimes()
@@ -38,6 +55,11 @@ float LoudnessHistoryDisplay::timeToX(double time) const
     return static_cast<float>(normalized * getWidth());
 }
 
+double LoudnessHistoryDisplay::xToTime(float x) const
+{
+    return displayStartTime + static_cast<double>(x) / getWidth() * viewTimeRange;
+}
+
 float LoudnessHistoryDisplay::lufsToY(float lufs) const
 {
     float normalized = (viewMaxLufs - lufs) / (viewMaxLufs - viewMinLufs);
@@ -68,22 +90,28 @@ bool LoudnessHistoryDisplay::needsCacheUpdate() const
 
 void LoudnessHistoryDisplay::updateCache()
 {
-    double queryStart = std::max(0.0, displayStartTime);
-    double queryEnd = std::max(0.0, displayEndTime);
+    // One column per pixel; times before the session start just give empty columns
+    const int numColumns = getWidth();
     
-    if (queryEnd > queryStart)
+    if (displayEndTime > displayStartTime && numColumns > 0)
     {
-        cachedData = dataStore.getDataForDisplay(queryStart, queryEnd, kTargetPoints);
+        // Fills the cached points in place, reusing their storage from the last query
+        dataStore.getDataForDisplay(displayStartTime, displayEndTime, numColumns, cachedData);
     }
     else
     {
-        cachedData = LoudnessDataStore::QueryResult();
+        cachedData.points.clear();
+        cachedData.lodLevel = 0;
     }
     
     lastQueryTime = dataStore.getCurrentTime();
     lastViewTimeRange = viewTimeRange;
     lastWidth = getWidth();
     pathsNeedRebuild = true;
+    
+    // Refreshed along with the curves, so a selection reaching into live data keeps up
+    if (selectionStatsValid && dataStore.getSnapshotEpoch() != selectionStatsEpoch)
+        updateSelectionStats();
 }
 
 void LoudnessHistoryDisplay::buildSmoothPath(juce::Path& path, 
@@ -189,20 +217,12 @@ void LoudnessHistoryDisplay::buildPaths()
         return;
     }
     
-    std::vector<juce::Point<float>> mTopPts;
-    std::vector<juce::Point<float>> mBotPts;
-    std::vector<juce::Point<float>> mMidPts;
-    
-    std::vector<juce::Point<float>> sTopPts;
-    std::vector<juce::Point<float>> sBotPts;
-    std::vector<juce::Point<float>> sMidPts;
-    
-    mTopPts.reserve(cachedData.points.size());
-    mBotPts.reserve(cachedData.points.size());
-    mMidPts.reserve(cachedData.points.size());
-    sTopPts.reserve(cachedData.points.size());
-    sBotPts.reserve(cachedData.points.size());
-    sMidPts.reserve(cachedData.points.size());
+    mTopPts.clear();
+    mBotPts.clear();
+    mMidPts.clear();
+    sTopPts.clear();
+    sBotPts.clear();
+    sMidPts.clear();
     
     float height = static_cast<float>(getHeight());
     float width = static_cast<float>(getWidth());
@@ -275,10 +295,12 @@ void LoudnessHistoryDisplay::paint(juce::Graphics& g)
     }
     
     drawBackground(g);
+    drawSelection(g);
     drawCurves(g);
     drawGrid(g);
     drawCurrentValues(g);
     drawZoomInfo(g);
+    drawSelectionStats(g);
 }
 
 void LoudnessHistoryDisplay::drawBackground(juce::Graphics& g)
@@ -313,6 +335,65 @@ void LoudnessHistoryDisplay::drawCurves(juce::Graphics& g)
     }
 }
 
+void LoudnessHistoryDisplay::drawSelection(juce::Graphics& g)
+{
+    if (!hasSelection)
+        return;
+    
+    float x1 = timeToX(std::min(selectionStart, selectionEnd));
+    float x2 = timeToX(std::max(selectionStart, selectionEnd));
+    
+    g.setColour(juce::Colours::white.withAlpha(0.07f));
+    g.fillRect(x1, 0.0f, std::max(1.0f, x2 - x1), static_cast<float>(getHeight()));
+    g.setColour(juce::Colours::white.withAlpha(0.25f));
+    g.drawVerticalLine(static_cast<int>(x1), 0.0f, static_cast<float>(getHeight()));
+    g.drawVerticalLine(static_cast<int>(x2), 0.0f, static_cast<float>(getHeight()));
+}
+
+void LoudnessHistoryDisplay::updateSelectionStats()
+{
+    selectionStatsEpoch = dataStore.getSnapshotEpoch();
+    selectionStats = dataStore.getRangeStats(std::min(selectionStart, selectionEnd),
+                                             std::max(selectionStart, selectionEnd));
+    selectionStatsValid = true;
+}
+
+void LoudnessHistoryDisplay::drawSelectionStats(juce::Graphics& g)
+{
+    if (!hasSelection || !selectionStatsValid)
+        return;
+    
+    const double start = std::min(selectionStart, selectionEnd);
+    const double end = std::max(selectionStart, selectionEnd);
+    const auto& stats = selectionStats;
+    
+    auto formatLufs = [](float lufs, const char* unit)
+    {
+        return lufs > -99.0f ? juce::String(lufs, 1) + unit : juce::String("-inf") + unit;
+    };
+    
+    const juce::String lines[] = {
+        "Selection " + juce::String(end - start, 1) + "s",
+        "Integrated " + formatLufs(stats.integrated, " LUFS"),
+        "Mean " + formatLufs(stats.meanLoudness, " LUFS"),
+        "Max M " + formatLufs(stats.momentaryMax, " LUFS"),
+        "Max S " + formatLufs(stats.shortTermMax, " LUFS"),
+        "Max TP " + formatLufs(stats.truePeakMax, " dBTP")
+    };
+    
+    const int lineHeight = 14;
+    juce::Rectangle<int> box(getWidth() - 160, 76, 150, lineHeight * 6 + 8);
+    
+    g.setColour(bgColour.brighter(0.15f).withAlpha(0.9f));
+    g.fillRoundedRectangle(box.toFloat(), 5.0f);
+    
+    g.setFont(11.0f);
+    g.setColour(textColour);
+    auto text = box.reduced(6, 4);
+    for (const auto& line : lines)
+        g.drawText(line, text.removeFromTop(lineHeight), juce::Justification::left);
+}
+
 void LoudnessHistoryDisplay::drawGrid(juce::Graphics& g)
 {
     int w = getWidth();
@@ -346,6 +427,9 @@ void LoudnessHistoryDisplay::drawGrid(juce::Graphics& g)
     if (viewTimeRange > 900.0) timeStep = 300.0;
     if (viewTimeRange > 3600.0) timeStep = 600.0;
     if (viewTimeRange > 7200.0) timeStep = 1800.0;
+    if (viewTimeRange > 21600.0) timeStep = 3600.0;
+    if (viewTimeRange > 86400.0) timeStep = 21600.0;
+    if (viewTimeRange > 259200.0) timeStep = 86400.0;
     if (viewTimeRange < 5.0) timeStep = 0.5;
     if (viewTimeRange < 2.0) timeStep = 0.25;
     
@@ -364,7 +448,14 @@ void LoudnessHistoryDisplay::drawGrid(juce::Graphics& g)
         g.setColour(textColour.withAlpha(0.7f));
         
         juce::String label;
-        if (t >= 3600.0)
+        if (t >= 86400.0)
+        {
+            int days = static_cast<int>(t) / 86400;
+            int hrs = (static_cast<int>(t) % 86400) / 3600;
+            int mins = (static_cast<int>(t) % 3600) / 60;
+            label = juce::String::formatted("%dd %02d:%02d", days, hrs, mins);
+        }
+        else if (t >= 3600.0)
         {
             int hrs = static_cast<int>(t) / 3600;
             int mins = (static_cast<int>(t) % 3600) / 60;
@@ -390,33 +481,39 @@ void LoudnessHistoryDisplay::drawGrid(juce::Graphics& g)
     }
 }
 
-void LoudnessHistoryDisplay::drawCurrentValues(juce::Graphics& g)
+void LoudnessHistoryDisplay::drawValueBox(juce::Graphics& g, juce::Rectangle<int> box, juce::Colour colour,
+                                          const juce::String& title, const juce::String& value)
 {
-    int boxW = 120, boxH = 40, margin = 10;
-    
-    juce::Rectangle<int> mBox(margin, margin, boxW, boxH);
-    g.setColour(momentaryColour.withAlpha(0.85f));
-    g.fillRoundedRectangle(mBox.toFloat(), 5.0f);
-    g.setColour(juce::Colours::white);
-    g.setFont(10.0f);
-    g.drawText("Momentary", mBox.removeFromTop(14).reduced(5, 0), juce::Justification::left);
-    g.setFont(18.0f);
-    juce::String mStr = currentMomentary > -100.0f
-        ? juce::String(currentMomentary, 1) + " LUFS"
-        : "-inf LUFS";
-    g.drawText(mStr, mBox.reduced(5, 0), juce::Justification::left);
-    
-    juce::Rectangle<int> sBox(margin + boxW + margin, margin, boxW, boxH);
-    g.setColour(shortTermColour.withAlpha(0.85f));
-    g.fillRoundedRectangle(sBox.toFloat(), 5.0f);
+    g.setColour(colour);
+    g.fillRoundedRectangle(box.toFloat(), 5.0f);
     g.setColour(juce::Colours::white);
     g.setFont(10.0f);
-    g.drawText("Short-term", sBox.removeFromTop(14).reduced(5, 0), juce::Justification::left);
+    g.drawText(title, box.removeFromTop(14).reduced(5, 0), juce::Justification::left);
     g.setFont(18.0f);
-    juce::String sStr = currentShortTerm > -100.0f
-        ? juce::String(currentShortTerm, 1) + " LUFS"
-        : "-inf LUFS";
-    g.drawText(sStr, sBox.reduced(5, 0), juce::Justification::left);
+    g.drawText(value, box.reduced(5, 0), juce::Justification::left);
+}
+
+void LoudnessHistoryDisplay::drawCurrentValues(juce::Graphics& g)
+{
+    int boxW = 120, boxH = 40, margin = 10;
+    
+    auto formatLufs = [](float lufs)
+    {
+        return lufs > -100.0f ? juce::String(lufs, 1) + " LUFS" : juce::String("-inf LUFS");
+    };
+    
+    const int step = boxW + margin;
+    juce::Rectangle<int> box(margin, margin, boxW, boxH);
+    
+    drawValueBox(g, box, momentaryColour.withAlpha(0.85f), "Momentary", formatLufs(currentMomentary));
+    drawValueBox(g, box.translated(step, 0), shortTermColour.withAlpha(0.85f), "Short-term",
+                 formatLufs(currentShortTerm));
+    drawValueBox(g, box.translated(2 * step, 0), integratedColour.withAlpha(0.85f), "Integrated",
+                 formatLufs(currentIntegrated));
+    drawValueBox(g, box.translated(3 * step, 0), integratedColour.withAlpha(0.6f), "Loudness Range",
+                 juce::String(currentRange, 1) + " LU");
+    drawValueBox(g, box.translated(4 * step, 0), truePeakColour.withAlpha(0.85f), "True Peak (max)",
+                 currentTruePeak > -100.0f ? juce::String(currentTruePeak, 1) + " dBTP" : juce::String("-inf dBTP"));
     
     int legendY = getHeight() - 25;
     g.setFont(11.0f);
@@ -437,7 +534,9 @@ void LoudnessHistoryDisplay::drawZoomInfo(juce::Graphics& g)
     int w = getWidth();
     
     juce::String timeStr;
-    if (viewTimeRange >= 3600.0)
+    if (viewTimeRange >= 86400.0)
+        timeStr = juce::String(viewTimeRange / 86400.0, 2) + " days";
+    else if (viewTimeRange >= 3600.0)
         timeStr = juce::String(viewTimeRange / 3600.0, 2) + " hrs";
     else if (viewTimeRange >= 60.0)
         timeStr = juce::String(viewTimeRange / 60.0, 1) + " min";
@@ -463,7 +562,8 @@ void LoudnessHistoryDisplay::drawZoomInfo(juce::Graphics& g)
     
     g.setFont(10.0f);
     g.setColour(textColour.withAlpha(0.6f));
-    g.drawText(info, w - 380, 10, 370, 14, juce::Justification::right);
+    // Sits below the row of value boxes
+    g.drawText(info, w - 380, 56, 370, 14, juce::Justification::right);
 }
 
 void LoudnessHistoryDisplay::resized()
@@ -516,11 +616,121 @@ void LoudnessHistoryDisplay::mouseWheelMove(const juce::MouseEvent& event,
 void LoudnessHistoryDisplay::mouseDown(const juce::MouseEvent& event)
 {
     lastMousePos = event.position;
+    
+    if (event.mods.isPopupMenu())
+    {
+        showHistoryMenu();
+        return;
+    }
+    
+    // Shift-drag selects a time range; a plain click clears it and drags the LUFS axis
+    if (event.mods.isShiftDown())
+    {
+        isSelecting = true;
+        hasSelection = true;
+        selectionStatsValid = false;
+        selectionStart = selectionEnd = xToTime(event.position.x);
+        repaint();
+        return;
+    }
+    
+    hasSelection = false;
+    selectionStatsValid = false;
     isDragging = true;
+    repaint();
+}
+
+void LoudnessHistoryDisplay::showHistoryMenu()
+{
+    const int numLevels = dataStore.getNumLevels();
+    const int fanOut = dataStore.getFanOut();
+    const auto finestRetention = dataStore.getLevelRetention(0);
+    const double finestDuration = dataStore.getLevelStats(0).bucketDuration;
+    
+    juce::Component::SafePointer<LoudnessHistoryDisplay> safeThis(this);
+    
+    // A new shape starts an empty history, so the view lets go of the old one
+    auto setLayout = [safeThis](int levels, int factor)
+    {
+        if (safeThis == nullptr)
+            return;
+        
+        safeThis->dataStore.setLodLayout(levels, factor);
+        safeThis->hasSelection = false;
+        safeThis->selectionStatsValid = false;
+        safeThis->lastViewTimeRange = -1.0;
+        safeThis->repaint();
+    };
+    
+    juce::PopupMenu levelsMenu;
+    for (int levels : { 6, 8, 10, 12, 16 })
+        levelsMenu.addItem(juce::String(levels) + " levels", true, levels == numLevels,
+                           [setLayout, levels, fanOut] { setLayout(levels, fanOut); });
+    
+    juce::PopupMenu fanOutMenu;
+    for (int factor : { 2, 4, 8 })
+        fanOutMenu.addItem("x" + juce::String(factor) + " per level", true, factor == fanOut,
+                           [setLayout, numLevels, factor] { setLayout(numLevels, factor); });
+    
+    // Retention of the finest level, in time; coarser levels keep the older history
+    juce::PopupMenu retentionMenu;
+    retentionMenu.addItem("Keep everything", true, finestRetention == 0,
+                          [safeThis] { if (safeThis != nullptr) safeThis->dataStore.setLevelRetention(0, 0); });
+    
+    for (int hours : { 1, 6, 24 })
+    {
+        const auto maxBuckets = finestDuration > 0.0
+                                  ? static_cast<size_t>(std::lround(hours * 3600.0 / finestDuration))
+                                  : size_t{0};
+        
+        retentionMenu.addItem("Last " + juce::String(hours) + (hours == 1 ? " hour" : " hours"),
+                              maxBuckets > 0, maxBuckets == finestRetention,
+                              [safeThis, maxBuckets]
+                              {
+                                  if (safeThis != nullptr)
+                                      safeThis->dataStore.setLevelRetention(0, maxBuckets);
+                              });
+    }
+    
+    juce::PopupMenu menu;
+    menu.addSectionHeader("History (changing the shape clears it)");
+    menu.addSubMenu("Levels", levelsMenu);
+    menu.addSubMenu("Fan-out", fanOutMenu);
+    menu.addSubMenu("Finest level", retentionMenu);
+    
+    menu.addSectionHeader("Memory");
+    size_t totalBytes = 0;
+    
+    for (int level = 0; level < numLevels; ++level)
+    {
+        const auto stats = dataStore.getLevelStats(level);
+        totalBytes += stats.bytes;
+        
+        const auto duration = stats.bucketDuration >= 1.0
+                                ? juce::String(stats.bucketDuration, 1) + "s"
+                                : juce::String(static_cast<int>(std::lround(stats.bucketDuration * 1000.0))) + "ms";
+        
+        menu.addItem("LOD " + juce::String(level) + " (" + duration + "): "
+                         + juce::String(static_cast<juce::int64>(stats.numBuckets)) + " buckets, "
+                         + juce::File::descriptionOfSizeInBytes(static_cast<juce::int64>(stats.bytes)),
+                     false, false, nullptr);
+    }
+    
+    menu.addItem("Total: " + juce::File::descriptionOfSizeInBytes(static_cast<juce::int64>(totalBytes)),
+                 false, false, nullptr);
+    
+    menu.showMenuAsync(juce::PopupMenu::Options().withMousePosition());
 }
 
 void LoudnessHistoryDisplay::mouseDrag(const juce::MouseEvent& event)
 {
+    if (isSelecting)
+    {
+        selectionEnd = xToTime(event.position.x);
+        repaint();
+        return;
+    }
+    
     if (!isDragging)
         return;
     
@@ -550,5 +760,12 @@ void LoudnessHistoryDisplay::mouseDrag(const juce::MouseEvent& event)
 
 void LoudnessHistoryDisplay::mouseUp(const juce::MouseEvent&)
 {
+    if (isSelecting)
+    {
+        updateSelectionStats();
+        repaint();
+    }
+    
     isDragging = false;
+    isSelecting = false;
 }
\ No newline at end of file
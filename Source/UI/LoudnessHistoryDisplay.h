@@ -19,7 +19,13 @@ public:
     void mouseDrag(const juce::MouseEvent& event) override;
     void mouseUp(const juce::MouseEvent& event) override;
 
-    void setCurrentLoudness(float momentary, float shortTerm);
+    void setCurrentLoudness(float momentary, float shortTerm, float integrated, float range, float truePeak);
+    
+    // Zoom of the view, for keeping it with the plugin state (clamped to the usual limits)
+    void setViewRange(double timeRange, float minLufs, float maxLufs);
+    double getViewTimeRange() const { return viewTimeRange; }
+    float getViewMinLufs() const { return viewMinLufs; }
+    float getViewMaxLufs() const { return viewMaxLufs; }
 
 private:
     void timerCallback() override;
@@ -33,9 +39,18 @@ private:
     void drawCurves(juce::Graphics& g);
     void drawGrid(juce::Graphics& g);
     void drawCurrentValues(juce::Graphics& g);
+    void drawValueBox(juce::Graphics& g, juce::Rectangle<int> box, juce::Colour colour,
+                      const juce::String& title, const juce::String& value);
     void drawZoomInfo(juce::Graphics& g);
+    void drawSelection(juce::Graphics& g);
+    void drawSelectionStats(juce::Graphics& g);
+    void updateSelectionStats();
+    
+    // Right-click menu: pyramid shape, finest-level retention and memory per level
+    void showHistoryMenu();
     
     float timeToX(double time) const;
+    double xToTime(float x) const;
     float lufsToY(float lufs) const;
     
     void buildSmoothPath(juce::Path& path, const std::vector<juce::Point<float>>& points);
@@ -46,7 +61,6 @@ private:
     LoudnessDataStore& dataStore;
     
     static constexpr double kDisplayDelay = 0.3;
-    static constexpr int kTargetPoints = 500;
     
     // View parameters
     double viewTimeRange{10.0};
@@ -59,7 +73,7 @@ private:
     
     // Limits
     static constexpr double kMinTimeRange = 0.5;
-    static constexpr double kMaxTimeRange = 18000.0;
+    static constexpr double kMaxTimeRange = 7.0 * 86400.0;
     static constexpr float kMinLufsRange = 6.0f;
     static constexpr float kMaxLufsRange = 90.0f;
     static constexpr float kAbsoluteMinLufs = -90.0f;
@@ -67,6 +81,9 @@ private:
     // Current meter values
     float currentMomentary{-100.0f};
     float currentShortTerm{-100.0f};
+    float currentIntegrated{-100.0f};
+    float currentRange{0.0f};
+    float currentTruePeak{-100.0f};
     
     // Cached data and state
     LoudnessDataStore::QueryResult cachedData;
@@ -81,14 +98,36 @@ private:
     juce::Path shortTermLinePath;
     bool pathsNeedRebuild{true};
     
+    // Path vertices, kept between rebuilds so their storage is reused
+    std::vector<juce::Point<float>> mTopPts;
+    std::vector<juce::Point<float>> mBotPts;
+    std::vector<juce::Point<float>> mMidPts;
+    std::vector<juce::Point<float>> sTopPts;
+    std::vector<juce::Point<float>> sBotPts;
+    std::vector<juce::Point<float>> sMidPts;
+    
     // Mouse state
     juce::Point<float> lastMousePos;
     bool isDragging{false};
     
+    // Selected time range (shift-drag), in history time
+    bool isSelecting{false};
+    bool hasSelection{false};
+    double selectionStart{0.0};
+    double selectionEnd{0.0};
+    
+    // Statistics of the finished selection, redone only when the selection or the
+    // history it was taken from changes
+    LoudnessDataStore::RangeStats selectionStats;
+    uint64_t selectionStatsEpoch{0};
+    bool selectionStatsValid{false};
+    
     // Colors
     const juce::Colour bgColour{16, 30, 50};
     const juce::Colour momentaryColour{45, 132, 107};
     const juce::Colour shortTermColour{146, 173, 196};
+    const juce::Colour integratedColour{196, 160, 92};
+    const juce::Colour truePeakColour{178, 84, 84};
     const juce::Colour gridColour = juce::Colour(255, 255, 255).withAlpha(0.12f);
     const juce::Colour textColour{200, 200, 200};
     
@@ -0,0 +1,145 @@
+#include <juce_core/juce_core.h>
+#include "../Source/Storage/DeltaCodec.h"
+#include <limits>
+#include <vector>
+
+namespace
+{
+    // Varints at every width, the signed extremes, raw values and two runs of deltas
+    // whose previous value carries from one to the next
+    struct Written
+    {
+        std::vector<uint8_t> bytes;
+        std::vector<uint64_t> varints;
+        std::vector<int64_t> signedValues;
+        std::vector<int16_t> deltas;
+    };
+    
+    Written write()
+    {
+        Written written;
+        
+        for (int shift = 0; shift < 64; shift += 7)
+            written.varints.push_back(uint64_t{1} << shift);
+        
+        written.varints.push_back(0);
+        written.varints.push_back(std::numeric_limits<uint64_t>::max());
+        written.signedValues = { 0, -1, 1, -64, 64, std::numeric_limits<int64_t>::min(), std::numeric_limits<int64_t>::max() };
+        
+        for (int i = 0; i < 300; ++i)
+            written.deltas.push_back(static_cast<int16_t>(i % 50 == 0 ? -32768 : -2300 + (i * 13) % 400));
+        
+        for (auto value : written.varints)
+            DeltaCodec::writeVarint(written.bytes, value);
+        
+        for (auto value : written.signedValues)
+            DeltaCodec::writeSigned(written.bytes, value);
+        
+        DeltaCodec::writeRaw(written.bytes, -23.5f);
+        DeltaCodec::writeRaw(written.bytes, 1.0e-9);
+        
+        int64_t previous = 0;
+        DeltaCodec::writeDeltas(written.bytes, written.deltas.data(), 100, previous);
+        DeltaCodec::writeDeltas(written.bytes, written.deltas.data() + 100, 200, previous);
+        return written;
+    }
+}
+
+class DeltaCodecTests : public juce::UnitTest
+{
+public:
+    DeltaCodecTests() : juce::UnitTest("Delta codec", "LoudnessMeter") {}
+    
+    void runTest() override
+    {
+        const auto written = write();
+        
+        beginTest("Round trip");
+        {
+            DeltaCodec::Reader reader(written.bytes.data(), written.bytes.size());
+            
+            bool allVarints = true;
+            for (auto value : written.varints)
+                allVarints = allVarints && reader.readVarint() == value;
+            
+            bool allSigned = true;
+            for (auto value : written.signedValues)
+                allSigned = allSigned && reader.readSigned() == value;
+            
+            expect(allVarints, "varints");
+            expect(allSigned, "signed");
+            expectEquals(reader.readRaw<float>(), -23.5f);
+            expectEquals(reader.readRaw<double>(), 1.0e-9);
+            
+            std::vector<int16_t> deltas(written.deltas.size());
+            int64_t previous = 0;
+            reader.readDeltas(deltas.data(), 150, previous);
+            reader.readDeltas(deltas.data() + 150, 150, previous);
+            
+            expect(deltas == written.deltas, "deltas");
+            expect(!reader.hasFailed());
+            expect(reader.isExhausted());
+        }
+        
+        beginTest("Truncation");
+        {
+            // A reader cut short fails once it runs out and reads zeros from then on,
+            // never anything past its end
+            bool allFailed = true;
+            bool allZero = true;
+            
+            for (size_t length = 0; length < written.bytes.size(); ++length)
+            {
+                const std::vector<uint8_t> bytes(written.bytes.begin(), written.bytes.begin() + static_cast<std::ptrdiff_t>(length));
+                DeltaCodec::Reader reader(bytes.data(), bytes.size());
+                
+                for (size_t i = 0; i < written.varints.size() + written.signedValues.size(); ++i)
+                    reader.readVarint();
+                
+                reader.readRaw<float>();
+                reader.readRaw<double>();
+                
+                std::vector<int16_t> deltas(written.deltas.size());
+                int64_t previous = 0;
+                reader.readDeltas(deltas.data(), deltas.size(), previous);
+                
+                allFailed = allFailed && reader.hasFailed() && reader.getNumRemaining() <= bytes.size();
+                allZero = allZero && reader.readVarint() == 0 && reader.readRaw<double>() == 0.0;
+            }
+            
+            expect(allFailed, "cut-off reader fails");
+            expect(allZero, "failed reader reads zeros");
+        }
+        
+        beginTest("Corruption");
+        {
+            // Eleven continuation bytes make a varint longer than 64 bits
+            const std::vector<uint8_t> overlong(11, 0x80);
+            DeltaCodec::Reader reader(overlong.data(), overlong.size());
+            
+            expectEquals(reader.readVarint(), uint64_t{0});
+            expect(reader.hasFailed());
+            expectEquals(reader.readSigned(), int64_t{0});
+            
+            // A flipped bit changes values but never the bounds of the reader
+            bool allInBounds = true;
+            auto bytes = written.bytes;
+            
+            for (size_t position = 0; position < bytes.size(); ++position)
+            {
+                bytes[position] ^= 0x80;
+                DeltaCodec::Reader damaged(bytes.data(), bytes.size());
+                
+                while (!damaged.hasFailed() && !damaged.isExhausted())
+                    damaged.readVarint();
+                
+                allInBounds = allInBounds && damaged.getNumRemaining() <= bytes.size();
+                bytes[position] ^= 0x80;
+            }
+            
+            expect(allInBounds);
+        }
+    }
+};
+
+static DeltaCodecTests deltaCodecTests;
@@ -0,0 +1,247 @@
+#include <juce_core/juce_core.h>
+#include "../Source/Storage/LoudnessDataStore.h"
+#include "../Source/Storage/MappedPageFile.h"
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    constexpr double kUpdateRate = 100.0;
+    
+    float momentaryAt(int index)
+    {
+        return -30.0f + static_cast<float>((index * 37) % 200) * 0.1f;
+    }
+    
+    // Queue points as the audio thread would and wait until the ingestion thread has them
+    bool addPoints(LoudnessDataStore& store, int first, int numPoints)
+    {
+        for (int i = first; i < first + numPoints; ++i)
+        {
+            store.addPoint(momentaryAt(i), -20.0f, -3.0f);
+            
+            // Stay well inside the pending ring
+            if ((i - first) % 1000 == 999)
+                juce::Thread::sleep(50);
+        }
+        
+        const double lastTime = (first + numPoints - 1) / kUpdateRate;
+        for (int wait = 0; wait < 500 && store.getCurrentTime() < lastTime - 1.0e-6; ++wait)
+            juce::Thread::sleep(10);
+        
+        return store.getCurrentTime() >= lastTime - 1.0e-6;
+    }
+    
+    // LOD0 momentary maxima as the store holds them
+    std::vector<int16_t> getFinestLevel(const LoudnessDataStore& store, int64_t& firstBucket)
+    {
+        LoudnessDataStore::ReadView view(store);
+        const auto& level = view.getLevel(0);
+        
+        std::vector<int16_t> values;
+        for (size_t i = 0; i < level.getNumSealed(); ++i)
+            values.push_back(level.columns[LoudnessDataStore::momentaryMaxColumn][i]);
+        
+        firstBucket = level.firstBucketIndex;
+        return values;
+    }
+}
+
+class HistoryIndexTests : public juce::UnitTest
+{
+public:
+    HistoryIndexTests() : juce::UnitTest("History index", "LoudnessMeter") {}
+    
+    void runTest() override
+    {
+        const auto directory = juce::File::getSpecialLocation(juce::File::tempDirectory)
+                                   .getChildFile("LoudnessMeterTests")
+                                   .getChildFile(juce::Uuid().toString());
+        const auto indexFile = directory.getChildFile("history.index");
+        
+        std::vector<int16_t> saved;
+        int64_t savedFirstBucket = 0;
+        float savedIntegrated = 0.0f;
+        
+        beginTest("Round trip");
+        {
+            LoudnessDataStore store;
+            store.prepare(kUpdateRate);
+            expect(store.setBackingDirectory(directory));
+            expect(addPoints(store, 0, kNumPoints));
+            
+            saved = getFinestLevel(store, savedFirstBucket);
+            savedIntegrated = store.getRangeStats(0.0, 1.0e9).integrated;
+        }
+        
+        expect(indexFile.existsAsFile());
+        expectEquals(static_cast<int>(saved.size()), kNumPoints);
+        
+        {
+            LoudnessDataStore store;
+            store.prepare(kUpdateRate);
+            expect(store.setBackingDirectory(directory));
+            
+            int64_t firstBucket = -1;
+            expect(getFinestLevel(store, firstBucket) == saved);
+            expectEquals(firstBucket, savedFirstBucket);
+            expectEquals(store.getRangeStats(0.0, 1.0e9).integrated, savedIntegrated);
+            expectWithinAbsoluteError(store.getCurrentTime(), (kNumPoints - 1) / kUpdateRate, 1.0e-9, "restored time");
+            
+            // The history carries on where it left off
+            expect(addPoints(store, kNumPoints, 500), "continued");
+            expectEquals(static_cast<int>(getFinestLevel(store, firstBucket).size()), kNumPoints + 500, "continued size");
+        }
+        
+        beginTest("State");
+        {
+            const auto root = directory.getParentDirectory();
+            const auto name = directory.getFileName();
+            juce::MemoryBlock state;
+            
+            {
+                LoudnessDataStore store;
+                store.prepare(kUpdateRate);
+                store.setBackingRoot(root);
+                expect(store.setBackingDirectory(directory));
+                
+                juce::MemoryOutputStream out(state, false);
+                store.writeState(out);
+            }
+            
+            auto restore = [&](const juce::File& backingRoot, const juce::MemoryBlock& blob)
+            {
+                LoudnessDataStore store;
+                store.prepare(kUpdateRate);
+                store.setBackingRoot(backingRoot);
+                
+                juce::MemoryInputStream in(blob, false);
+                const bool restored = store.readState(in);
+                return restored ? store.getBackingDirectory() : juce::File();
+            };
+            
+            expect(restore(root, state) == directory, "restored");
+            
+            // The blob names the directory relative to the root, so under another root it
+            // finds no history and creates nothing
+            const auto otherRoot = root.getChildFile("other");
+            expect(restore(otherRoot, state) == juce::File(), "other root");
+            expect(!otherRoot.exists());
+            
+            // Nor can the name lead out of the root; it is the last thing in the blob
+            juce::MemoryBlock escaping(state.getData(), state.getSize() - static_cast<size_t>(name.length()) - 1);
+            juce::MemoryOutputStream(escaping, true).writeString("../" + name);
+            expect(restore(otherRoot, escaping) == juce::File(), "outside the root");
+        }
+        
+        juce::MemoryBlock index;
+        expect(indexFile.loadFileAsData(index));
+        
+        beginTest("Truncated index");
+        {
+            expectRejected(directory, juce::MemoryBlock(index.getData(), index.getSize() / 2));
+            expectRejected(directory, juce::MemoryBlock(index.getData(), index.getSize() - 1));
+            expectRejected(directory, juce::MemoryBlock(index.getData(), 12));
+        }
+        
+        beginTest("Corrupt page numbers");
+        {
+            // The first column's second page claims the file page of its first
+            auto duplicate = index;
+            auto* pages = static_cast<char*>(duplicate.getData()) + kFirstPageListOffset;
+            std::memcpy(pages + sizeof(juce::int64), pages, sizeof(juce::int64));
+            expectRejected(directory, duplicate);
+            
+            auto outOfRange = index;
+            const juce::int64 page = juce::int64{1} << 40;
+            std::memcpy(static_cast<char*>(outOfRange.getData()) + kFirstPageListOffset, &page, sizeof(page));
+            expectRejected(directory, outOfRange);
+        }
+        
+        beginTest("Wrong magic");
+        {
+            auto wrongMagic = index;
+            static_cast<char*>(wrongMagic.getData())[0] ^= 0x20;
+            expectRejected(directory, wrongMagic);
+        }
+        
+        beginTest("Partial segment");
+        {
+            // A crash while the file grew leaves part of a segment at its end; reopening
+            // cuts it off, so the next segment is mapped where its pages are written
+            const auto pageFile = directory.getChildFile("test.pages");
+            constexpr size_t pageBytes = 16;
+            juce::int64 segmentBytes = 0;
+            
+            {
+                MappedPageFile pages;
+                expect(pages.open(pageFile, pageBytes));
+                expect(pages.addPage() != nullptr);
+                segmentBytes = pageFile.getSize();
+            }
+            
+            {
+                juce::FileOutputStream out(pageFile);
+                out.write("torn", 4);
+            }
+            
+            const auto pagesPerSegment = static_cast<size_t>(segmentBytes) / pageBytes;
+            const auto numPages = pagesPerSegment * 2 + 1;
+            
+            {
+                MappedPageFile pages;
+                expect(pages.open(pageFile, pageBytes));
+                expectEquals(pageFile.getSize(), segmentBytes, "cut back");
+                
+                while (pages.getNumPages() < numPages)
+                    expect(pages.addPage() != nullptr);
+                
+                bool numbersMatch = true;
+                for (size_t page = 0; page < numPages; ++page)
+                {
+                    *static_cast<size_t*>(pages.getPage(page)) = page;
+                    numbersMatch = numbersMatch && pages.getPageNumber(pages.getPage(page)) == page;
+                }
+                
+                expect(numbersMatch, "page numbers");
+                expect(pages.getPageNumber(&segmentBytes) == SIZE_MAX, "not a page");
+            }
+            
+            MappedPageFile pages;
+            expect(pages.open(pageFile, pageBytes));
+            expectEquals(pageFile.getSize(), static_cast<juce::int64>(pagesPerSegment * 3 * pageBytes));
+            
+            bool contentsMatch = true;
+            for (size_t page = 0; page < numPages; ++page)
+                contentsMatch = contentsMatch && *static_cast<const size_t*>(pages.getPage(page)) == page;
+            
+            expect(contentsMatch, "pages where they were written");
+        }
+        
+        directory.getParentDirectory().deleteRecursively();
+    }
+    
+private:
+    // Enough for three pages of every LOD0 array
+    static constexpr int kNumPoints = 3000;
+    
+    // history.index: a 48-byte header, 60 bytes of level 0 state, then the extent and page
+    // count of level 0's first column ahead of its page numbers
+    static constexpr size_t kFirstPageListOffset = 48 + 60 + 20;
+    
+    // An index that doesn't fit is ignored and the directory starts an empty history
+    void expectRejected(const juce::File& directory, const juce::MemoryBlock& index)
+    {
+        expect(directory.getChildFile("history.index").replaceWithData(index.getData(), index.getSize()));
+        
+        LoudnessDataStore store;
+        store.prepare(kUpdateRate);
+        expect(store.setBackingDirectory(directory));
+        
+        int64_t firstBucket = -1;
+        expect(getFinestLevel(store, firstBucket).empty(), "history left empty");
+        expectEquals(store.getCurrentTime(), 0.0, "time reset");
+    }
+};
+
+static HistoryIndexTests historyIndexTests;
@@ -0,0 +1,114 @@
+#include <juce_core/juce_core.h>
+#include "../Source/DSP/EBU128LoudnessMeter.h"
+#include "../Source/DSP/LoudnessMeterBank.h"
+#include <cmath>
+#include <memory>
+#include <vector>
+
+namespace
+{
+    constexpr double kSampleRate = 48000.0;
+    constexpr int kChannels = 2;
+    constexpr int kBlockSize = 1000;   // deliberately not a multiple of the 4800-sample hop
+    
+    // A tone per stream and channel whose level swells slowly, so the loudness range is not zero
+    void fillStream(juce::AudioBuffer<float>& buffer, int stream, juce::int64 firstSample)
+    {
+        const double frequency = 100.0 + 450.0 * stream;
+        const double gain = std::pow(10.0, (-6.0 - 4.0 * stream) / 20.0);
+        
+        for (int ch = 0; ch < buffer.getNumChannels(); ++ch)
+        {
+            auto* data = buffer.getWritePointer(ch);
+            for (int i = 0; i < buffer.getNumSamples(); ++i)
+            {
+                const double t = static_cast<double>(firstSample + i) / kSampleRate;
+                const double swell = 0.55 + 0.45 * std::sin(2.0 * juce::MathConstants<double>::pi * 0.07 * t);
+                data[i] = static_cast<float>(gain * swell * std::sin(2.0 * juce::MathConstants<double>::pi * frequency * t + ch));
+            }
+        }
+    }
+}
+
+class LoudnessMeterBankTests : public juce::UnitTest
+{
+public:
+    LoudnessMeterBankTests() : juce::UnitTest("Loudness meter bank", "LoudnessMeter") {}
+    
+    void runTest() override
+    {
+        beginTest("Matches one meter per stream");
+        {
+            // An odd stream count leaves a padding lane in the last group
+            constexpr int kStreams = 3;
+            
+            LoudnessMeterBank bank;
+            bank.prepare(kSampleRate, kStreams, kChannels);
+            
+            std::vector<std::unique_ptr<EBU128LoudnessMeter>> meters;
+            std::vector<juce::AudioBuffer<float>> buffers;
+            for (int s = 0; s < kStreams; ++s)
+            {
+                meters.push_back(std::make_unique<EBU128LoudnessMeter>());
+                meters.back()->prepare(kSampleRate, kBlockSize, kChannels);
+                buffers.emplace_back(kChannels, kBlockSize);
+            }
+            
+            std::vector<const float*> streamData(static_cast<size_t>(kStreams * kChannels));
+            
+            // 20 seconds: long enough for short-term, gating and the range to settle
+            for (juce::int64 position = 0; position < 20 * static_cast<juce::int64>(kSampleRate); position += kBlockSize)
+            {
+                for (int s = 0; s < kStreams; ++s)
+                {
+                    auto& buffer = buffers[static_cast<size_t>(s)];
+                    fillStream(buffer, s, position);
+                    meters[static_cast<size_t>(s)]->processBlock(buffer);
+                    
+                    for (int ch = 0; ch < kChannels; ++ch)
+                        streamData[static_cast<size_t>(s * kChannels + ch)] = buffer.getReadPointer(ch);
+                }
+                
+                bank.processBlock(streamData.data(), kBlockSize);
+            }
+            
+            for (int s = 0; s < kStreams; ++s)
+            {
+                const auto& meter = *meters[static_cast<size_t>(s)];
+                const auto stream = juce::String(s);
+                
+                expect(meter.getIntegratedLoudness() > -60.0f, "stream " + stream + " measured");
+                expectWithinAbsoluteError(bank.getMomentaryLoudness(s), meter.getMomentaryLoudness(), 0.01f, "momentary " + stream);
+                expectWithinAbsoluteError(bank.getShortTermLoudness(s), meter.getShortTermLoudness(), 0.01f, "short-term " + stream);
+                expectWithinAbsoluteError(bank.getIntegratedLoudness(s), meter.getIntegratedLoudness(), 0.01f, "integrated " + stream);
+                expectWithinAbsoluteError(bank.getLoudnessRange(s), meter.getLoudnessRange(), 0.01f, "range " + stream);
+            }
+            
+            // Streams are independent: louder streams come first
+            expect(bank.getIntegratedLoudness(0) > bank.getIntegratedLoudness(1));
+            expect(bank.getIntegratedLoudness(1) > bank.getIntegratedLoudness(2));
+            
+            // Out-of-range streams read as silence
+            expectEquals(bank.getIntegratedLoudness(kStreams), -100.0f);
+            expectEquals(bank.getIntegratedLoudness(-1), -100.0f);
+            
+            beginTest("Reset");
+            bank.reset();
+            
+            // Applied at the start of the next block, which is shorter than one hop
+            std::vector<float> silence(static_cast<size_t>(kBlockSize), 0.0f);
+            for (auto& data : streamData)
+                data = silence.data();
+            bank.processBlock(streamData.data(), kBlockSize);
+            
+            for (int s = 0; s < kStreams; ++s)
+            {
+                expectEquals(bank.getMomentaryLoudness(s), -100.0f);
+                expectEquals(bank.getIntegratedLoudness(s), -100.0f);
+                expectEquals(bank.getLoudnessRange(s), 0.0f);
+            }
+        }
+    }
+};
+
+static LoudnessMeterBankTests loudnessMeterBankTests;
@@ -0,0 +1,338 @@
+#include <juce_core/juce_core.h>
+#include "../Source/Storage/LoudnessDataStore.h"
+#include "../Source/Storage/MeasurementJournal.h"
+#include <algorithm>
+#include <vector>
+
+namespace
+{
+    constexpr double kUpdateRate = 100.0;
+    
+    // Magic, version, history id, update rate and CRC
+    constexpr juce::int64 kJournalHeaderBytes = 28;
+    
+    // Three runs of points, the last one a rewind over the first, so the file holds
+    // several blocks
+    std::vector<MeasurementJournal::Record> makeRecords()
+    {
+        std::vector<MeasurementJournal::Record> records;
+        
+        auto addRun = [&records](int64_t firstSequence, int64_t firstIndex, int numRecords)
+        {
+            for (int i = 0; i < numRecords; ++i)
+            {
+                MeasurementJournal::Record record;
+                record.sequence = firstSequence + i;
+                record.index = firstIndex + i;
+                record.momentary = -23.0f + static_cast<float>(i % 17) * 0.25f;
+                record.shortTerm = -20.0f - static_cast<float>(i % 5);
+                record.truePeak = -1.0f - static_cast<float>(i % 3) * 0.5f;
+                records.push_back(record);
+            }
+        };
+        
+        addRun(0, 0, 40);
+        addRun(40, 40, 25);
+        addRun(65, 10, 30);
+        return records;
+    }
+    
+    bool isSameRecord(const MeasurementJournal::Record& a, const MeasurementJournal::Record& b)
+    {
+        return a.sequence == b.sequence && a.index == b.index && a.momentary == b.momentary
+            && a.shortTerm == b.shortTerm && a.truePeak == b.truePeak;
+    }
+    
+    bool areSameRecords(const std::vector<MeasurementJournal::Record>& a, const std::vector<MeasurementJournal::Record>& b)
+    {
+        return std::equal(a.begin(), a.end(), b.begin(), b.end(), isSameRecord);
+    }
+    
+    // Write records to a new journal in file and close it, keeping the file
+    bool writeJournal(const juce::File& file, const std::vector<MeasurementJournal::Record>& records)
+    {
+        MeasurementJournal journal;
+        if (!journal.start(file, { 42, kUpdateRate }))
+            return false;
+        
+        for (const auto& record : records)
+            if (!journal.append(record))
+                return false;
+        
+        journal.stop(false);
+        return true;
+    }
+    
+    struct Replayed
+    {
+        juce::int64 intactLength{-1};
+        MeasurementJournal::Header header;
+        std::vector<MeasurementJournal::Record> records;
+    };
+    
+    Replayed replay(const juce::File& file)
+    {
+        Replayed result;
+        result.intactLength = MeasurementJournal::replay(file, result.header, [&result](const MeasurementJournal::Record& record)
+        {
+            result.records.push_back(record);
+        });
+        
+        return result;
+    }
+    
+    // Whether replayed holds the first replayed.records.size() records, unchanged
+    bool isPrefix(const Replayed& replayed, const std::vector<MeasurementJournal::Record>& records)
+    {
+        if (replayed.records.size() > records.size())
+            return false;
+        
+        return std::equal(replayed.records.begin(), replayed.records.end(), records.begin(), isSameRecord);
+    }
+    
+    // Queue points as the audio thread would and wait until the ingestion thread has them
+    bool addPoints(LoudnessDataStore& store, int first, int numPoints)
+    {
+        for (int i = first; i < first + numPoints; ++i)
+            store.addPoint(-30.0f + static_cast<float>((i * 37) % 200) * 0.1f, -20.0f, -3.0f);
+        
+        const double lastTime = (first + numPoints - 1) / kUpdateRate;
+        for (int wait = 0; wait < 500 && store.getCurrentTime() < lastTime - 1.0e-6; ++wait)
+            juce::Thread::sleep(10);
+        
+        return store.getCurrentTime() >= lastTime - 1.0e-6;
+    }
+    
+    juce::MemoryBlock saveState(const LoudnessDataStore& store)
+    {
+        juce::MemoryBlock state;
+        juce::MemoryOutputStream out(state, false);
+        store.writeState(out);
+        return state;
+    }
+}
+
+class MeasurementJournalTests : public juce::UnitTest
+{
+public:
+    MeasurementJournalTests() : juce::UnitTest("Measurement journal", "LoudnessMeter") {}
+    
+    void runTest() override
+    {
+        const auto directory = juce::File::getSpecialLocation(juce::File::tempDirectory)
+                                   .getChildFile("LoudnessMeterTests")
+                                   .getChildFile(juce::Uuid().toString());
+        const auto file = directory.getChildFile("test.journal");
+        const auto records = makeRecords();
+        
+        beginTest("Round trip");
+        {
+            expect(writeJournal(file, records));
+            
+            const auto replayed = replay(file);
+            expectEquals(replayed.intactLength, file.getSize());
+            expect(replayed.header.historyId == 42);
+            expectEquals(replayed.header.updateRate, kUpdateRate);
+            expect(areSameRecords(replayed.records, records));
+        }
+        
+        juce::MemoryBlock journal;
+        expect(file.loadFileAsData(journal));
+        const auto* const bytes = static_cast<const char*>(journal.getData());
+        
+        beginTest("Truncation");
+        {
+            // Every cut gives back whole blocks only, and cutting at the intact length
+            // gives back the same
+            bool allPrefixes = true;
+            bool allStable = true;
+            
+            for (size_t length = 0; length < journal.getSize(); ++length)
+            {
+                expect(file.replaceWithData(bytes, length));
+                const auto replayed = replay(file);
+                
+                allPrefixes = allPrefixes && isPrefix(replayed, records) && replayed.intactLength <= static_cast<juce::int64>(length);
+                
+                if (replayed.intactLength >= 0)
+                {
+                    expect(file.replaceWithData(bytes, static_cast<size_t>(replayed.intactLength)));
+                    const auto again = replay(file);
+                    allStable = allStable && again.intactLength == replayed.intactLength
+                                          && again.records.size() == replayed.records.size();
+                }
+            }
+            
+            expect(allPrefixes, "truncated journal replays whole blocks");
+            expect(allStable, "intact length replays the same");
+            
+            expect(file.replaceWithData(bytes, journal.getSize() - 1));
+            expect(replay(file).records.size() < records.size(), "torn last block dropped");
+            
+            expect(file.replaceWithData(bytes, 12));
+            expectEquals(replay(file).intactLength, juce::int64{-1}, "torn header");
+        }
+        
+        beginTest("Corruption");
+        {
+            // A flipped bit anywhere never yields a wrong record: the block it hits and
+            // everything after it is dropped, and a damaged header drops the lot
+            bool allPrefixes = true;
+            bool allCut = true;
+            
+            for (size_t position = 0; position < journal.getSize(); ++position)
+            {
+                auto damaged = journal;
+                static_cast<char*>(damaged.getData())[position] ^= 0x10;
+                expect(file.replaceWithData(damaged.getData(), damaged.getSize()));
+                
+                const auto replayed = replay(file);
+                allPrefixes = allPrefixes && isPrefix(replayed, records);
+                allCut = allCut && replayed.intactLength <= static_cast<juce::int64>(position)
+                                && replayed.records.size() < records.size();
+            }
+            
+            expect(allPrefixes, "no damaged record replayed");
+            expect(allCut, "replay stops before the damage");
+        }
+        
+        beginTest("Resume after a torn block");
+        {
+            expect(file.replaceWithData(bytes, journal.getSize() - 5));
+            const auto torn = replay(file);
+            expect(torn.intactLength > 0);
+            
+            std::vector<MeasurementJournal::Record> more(3);
+            for (size_t i = 0; i < more.size(); ++i)
+                more[i] = { 1000 + static_cast<int64_t>(i), 500 + static_cast<int64_t>(i), -18.0f, -19.0f, -2.0f };
+            
+            {
+                MeasurementJournal resumed;
+                expect(resumed.resume(file, torn.intactLength));
+                
+                for (const auto& record : more)
+                    expect(resumed.append(record));
+                
+                resumed.stop(false);
+            }
+            
+            auto expected = torn.records;
+            expected.insert(expected.end(), more.begin(), more.end());
+            expect(areSameRecords(replay(file).records, expected));
+        }
+        
+        beginTest("Locking");
+        {
+            MeasurementJournal first;
+            MeasurementJournal second;
+            
+            expect(first.start(file, { 1, kUpdateRate }));
+            expect(MeasurementJournal::isInUse(file));
+            expect(!second.start(file, { 2, kUpdateRate }), "file shared");
+            
+            first.stop(false);
+            expect(!MeasurementJournal::isInUse(file));
+            expect(second.start(file, { 2, kUpdateRate }));
+            second.stop(true);
+            expect(!file.existsAsFile());
+        }
+        
+        beginTest("Stale journals");
+        {
+            const auto staleDirectory = directory.getChildFile("Journals");
+            const auto old = staleDirectory.getChildFile("old.journal");
+            const auto recent = staleDirectory.getChildFile("recent.journal");
+            const auto open = staleDirectory.getChildFile("open.journal");
+            const auto monthAgo = juce::Time::getCurrentTime() - juce::RelativeTime::days(31.0);
+            
+            expect(writeJournal(old, records) && writeJournal(recent, records));
+            
+            MeasurementJournal openJournal;
+            expect(openJournal.start(open, { 3, kUpdateRate }));
+            expect(old.setLastModificationTime(monthAgo) && open.setLastModificationTime(monthAgo));
+            
+            expectEquals(MeasurementJournal::removeStale(staleDirectory, juce::RelativeTime::days(30.0)), 1);
+            expect(!old.existsAsFile());
+            expect(recent.existsAsFile());
+            expect(open.existsAsFile(), "journal in use kept");
+        }
+        
+        beginTest("Store recovery");
+        {
+            const auto storeJournal = directory.getChildFile("store.journal");
+            const auto crashed = directory.getChildFile("crashed.journal");
+            juce::MemoryBlock earlierState;
+            juce::MemoryBlock laterState;
+            
+            {
+                LoudnessDataStore store;
+                store.prepare(kUpdateRate);
+                store.setJournalDirectory(directory);
+                expect(store.setJournalFile(storeJournal));
+                
+                expect(addPoints(store, 0, 1000));
+                earlierState = saveState(store);
+                expect(addPoints(store, 1000, 1000));
+                laterState = saveState(store);
+                
+                // Restoring a state saved this session replays the journal in use
+                {
+                    juce::MemoryInputStream in(earlierState, false);
+                    expect(store.readState(in));
+                    expectWithinAbsoluteError(store.getCurrentTime(), 1999 / kUpdateRate, 1.0e-9, "journal in use");
+                }
+                
+                expect(storeJournal.getSize() > kJournalHeaderBytes, "journal kept");
+                
+                expect(addPoints(store, 2000, 1000));
+                
+                // What a crash would leave: the journal as written so far
+                juce::Thread::sleep(500);
+                expect(storeJournal.copyFileTo(crashed));
+                
+                // A new history moves to a new journal; the states saved so far still name the old one
+                store.reset();
+                expect(store.getJournalFile() != storeJournal);
+                expect(storeJournal.existsAsFile(), "named journal kept");
+            }
+            
+            expect(!storeJournal.existsAsFile(), "journals go with the store");
+            
+            auto restore = [&](const juce::MemoryBlock& state)
+            {
+                expect(crashed.copyFileTo(storeJournal));
+                
+                LoudnessDataStore store;
+                store.prepare(kUpdateRate);
+                store.setJournalDirectory(directory);
+                juce::MemoryInputStream in(state, false);
+                expect(store.readState(in));
+                return store.getCurrentTime();
+            };
+            
+            // Saves leave the journal alone, so it carries every save on to the crash
+            expectWithinAbsoluteError(restore(laterState), 2999 / kUpdateRate, 1.0e-9, "recovered");
+            expectWithinAbsoluteError(restore(earlierState), 2999 / kUpdateRate, 1.0e-9, "earlier save");
+            
+            // A journal some other history left under that name is neither replayed nor touched
+            expect(writeJournal(storeJournal, makeRecords()));
+            const auto foreignSize = storeJournal.getSize();
+            
+            {
+                LoudnessDataStore store;
+                store.prepare(kUpdateRate);
+                store.setJournalDirectory(directory);
+                juce::MemoryInputStream in(laterState, false);
+                expect(store.readState(in));
+                expectWithinAbsoluteError(store.getCurrentTime(), 1999 / kUpdateRate, 1.0e-9, "foreign journal");
+                expect(store.getJournalFile() != storeJournal);
+            }
+            
+            expectEquals(storeJournal.getSize(), foreignSize, "foreign journal kept");
+        }
+        
+        directory.getParentDirectory().deleteRecursively();
+    }
+};
+
+static MeasurementJournalTests measurementJournalTests;
@@ -0,0 +1,166 @@
+#include <juce_core/juce_core.h>
+#include "../Source/Storage/PageCodec.h"
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+namespace
+{
+    constexpr size_t kPageSize = 1024;
+    
+    // Values past the end of a decoded page must never be written
+    constexpr size_t kGuardValues = 16;
+    
+    // Pages shaped like the history: silence, a steady level, slow drift, noise and the
+    // extremes of the type, cut off at a length that is not a whole number of blocks
+    template <typename T>
+    std::vector<std::vector<T>> makeIntegerPages(juce::Random& random)
+    {
+        using Limits = std::numeric_limits<T>;
+        std::vector<std::vector<T>> pages(5, std::vector<T>(kPageSize));
+        
+        for (size_t i = 0; i < kPageSize; ++i)
+        {
+            pages[0][i] = 0;
+            pages[1][i] = static_cast<T>(static_cast<int64_t>(i / 100) * 3);
+            pages[2][i] = static_cast<T>(static_cast<uint64_t>(random.nextInt64()));
+            pages[3][i] = i % 2 == 0 ? Limits::min() : Limits::max();
+        }
+        
+        pages[4].assign(pages[1].begin(), pages[1].begin() + 1000);
+        return pages;
+    }
+    
+    std::vector<std::vector<double>> makeEnergyPages(juce::Random& random)
+    {
+        std::vector<std::vector<double>> pages(4, std::vector<double>(kPageSize));
+        
+        for (size_t i = 0; i < kPageSize; ++i)
+        {
+            pages[0][i] = 0.0;
+            pages[1][i] = i < 500 ? 0.0 : 1.0e-3 * static_cast<double>(i % 7 + 1);
+            pages[2][i] = std::ldexp(static_cast<double>(random.nextFloat()), random.nextInt(200) - 100);
+        }
+        
+        pages[3] = { -0.0, 1.0, std::numeric_limits<double>::max(), std::numeric_limits<double>::denorm_min(),
+                     std::numeric_limits<double>::infinity(), 1.0, 1.0, 2.0 };
+        return pages;
+    }
+    
+    // Compare bit patterns, so -0.0 and infinities count as themselves
+    template <typename T>
+    bool isSamePage(const std::vector<T>& a, const T* b)
+    {
+        return std::memcmp(a.data(), b, a.size() * sizeof(T)) == 0;
+    }
+    
+    template <typename T>
+    std::vector<uint8_t> encode(const std::vector<T>& values)
+    {
+        std::vector<uint8_t> bytes;
+        PageCodec::encode(values.data(), values.size(), bytes);
+        return bytes;
+    }
+    
+    // Decode from a copy of exactly numBytes, into a page followed by guard values.
+    // Returns whether the guard values survived.
+    template <typename T>
+    bool decodeGuarded(const uint8_t* data, size_t numBytes, size_t numValues, std::vector<T>& decoded)
+    {
+        const std::vector<uint8_t> bytes(data, data + numBytes);
+        decoded.assign(numValues + kGuardValues, T(42));
+        PageCodec::decode(bytes.data(), bytes.size(), decoded.data(), numValues);
+        
+        for (size_t i = numValues; i < decoded.size(); ++i)
+            if (decoded[i] != T(42))
+                return false;
+        
+        return true;
+    }
+}
+
+class PageCodecTests : public juce::UnitTest
+{
+public:
+    PageCodecTests() : juce::UnitTest("Page codec", "LoudnessMeter") {}
+    
+    void runTest() override
+    {
+        juce::Random random(1770);
+        
+        beginTest("Round trip");
+        {
+            expect(roundTrips(makeIntegerPages<int16_t>(random)), "int16");
+            expect(roundTrips(makeIntegerPages<uint32_t>(random)), "uint32");
+            expect(roundTrips(makeEnergyPages(random)), "energy");
+            
+            // Silence packs down to a few bytes per block
+            expect(encode(std::vector<int16_t>(kPageSize)).size() < 16);
+            expect(encode(std::vector<double>(kPageSize)).size() < 16);
+        }
+        
+        beginTest("Corruption");
+        {
+            // Damaged or cut-off pages decode to something, but never outside the page
+            // or the encoded bytes
+            expect(staysInBounds(makeIntegerPages<int16_t>(random)), "int16");
+            expect(staysInBounds(makeIntegerPages<uint32_t>(random)), "uint32");
+            expect(staysInBounds(makeEnergyPages(random)), "energy");
+            
+            std::vector<uint8_t> noise(64);
+            for (auto& byte : noise)
+                byte = static_cast<uint8_t>(random.nextInt(256));
+            
+            std::vector<int16_t> decoded;
+            expect(decodeGuarded(noise.data(), noise.size(), kPageSize, decoded), "noise");
+            expect(decodeGuarded<int16_t>(nullptr, 0, kPageSize, decoded), "no bytes");
+        }
+    }
+
+private:
+    template <typename T>
+    bool roundTrips(const std::vector<std::vector<T>>& pages)
+    {
+        for (const auto& page : pages)
+        {
+            const auto bytes = encode(page);
+            
+            std::vector<T> decoded;
+            if (!decodeGuarded(bytes.data(), bytes.size(), page.size(), decoded) || !isSamePage(page, decoded.data()))
+                return false;
+        }
+        
+        return true;
+    }
+    
+    // Every truncation, and a flipped bit at every byte
+    template <typename T>
+    bool staysInBounds(const std::vector<std::vector<T>>& pages)
+    {
+        std::vector<T> decoded;
+        
+        for (const auto& page : pages)
+        {
+            auto bytes = encode(page);
+            
+            for (size_t length = 0; length < bytes.size(); ++length)
+                if (!decodeGuarded(bytes.data(), length, page.size(), decoded))
+                    return false;
+            
+            for (size_t position = 0; position < bytes.size(); ++position)
+            {
+                bytes[position] ^= 0x10;
+                const bool inBounds = decodeGuarded(bytes.data(), bytes.size(), page.size(), decoded);
+                bytes[position] ^= 0x10;
+                
+                if (!inBounds)
+                    return false;
+            }
+        }
+        
+        return true;
+    }
+};
+
+static PageCodecTests pageCodecTests;
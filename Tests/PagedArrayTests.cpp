@@ -0,0 +1,105 @@
+#include <juce_core/juce_core.h>
+#include "../Source/Storage/PagedArray.h"
+#include <vector>
+
+namespace
+{
+    constexpr size_t kPageSize = 1024;
+    constexpr size_t kPeriod = 3000;
+    
+    using Pool = PagePool<int16_t, kPageSize>;
+    using Array = PagedArray<int16_t, kPageSize>;
+    
+    // A compressed array holding i % kPeriod at index i
+    void fill(Array& array, Pool& pool, size_t numValues)
+    {
+        array.setPool(&pool, 8);
+        array.setCompression(true);
+        
+        for (size_t i = 0; i < numValues; ++i)
+            array.push_back(static_cast<int16_t>(i % kPeriod), 1);
+    }
+    
+    // Whether every value of view is i % kPeriod + offset
+    bool holds(const Array::View& view, int offset)
+    {
+        for (size_t i = 0; i < view.size(); ++i)
+            if (view[i] != static_cast<int16_t>(static_cast<int>(i % kPeriod) + offset))
+                return false;
+        
+        return true;
+    }
+}
+
+class PagedArrayTests : public juce::UnitTest
+{
+public:
+    PagedArrayTests() : juce::UnitTest("Paged array", "LoudnessMeter") {}
+    
+    void runTest() override
+    {
+        beginTest("Decode cache");
+        {
+            Pool pool(8);
+            Array array;
+            fill(array, pool, 5 * kPageSize + 100);
+            expect(array.getNumCompressedPages() > 0);
+            
+            // A single-page cache thrashes between pages but still reads right
+            Array::DecodeCache cache(1);
+            auto view = array.getView();
+            view.cache = &cache;
+            const size_t numValues = view.size();
+            
+            bool allValues = true;
+            for (size_t i = 0; i < numValues; i += 7)
+                allValues = allValues && view[i] == static_cast<int16_t>(i % kPeriod);
+            
+            expect(allValues, "values");
+            expectEquals(static_cast<int>(view.back()), static_cast<int>((numValues - 1) % kPeriod));
+            
+            size_t next = 10;
+            bool allRuns = true;
+            view.forEachRun(10, numValues - 10, [&](const int16_t* run, size_t runLength)
+            {
+                allRuns = allRuns && runLength > 0 && runLength <= kPageSize;
+                for (size_t i = 0; i < runLength; ++i, ++next)
+                    allRuns = allRuns && run[i] == static_cast<int16_t>(next % kPeriod);
+            });
+            
+            expect(allRuns, "runs");
+            expectEquals(static_cast<int>(next), static_cast<int>(numValues - 10));
+        }
+        
+        beginTest("Copy on write");
+        {
+            Pool pool(8);
+            Array array;
+            const size_t numPages = 12;
+            fill(array, pool, numPages * kPageSize);
+            
+            Array::DecodeCache before(4);
+            auto viewBefore = array.getView();
+            viewBefore.cache = &before;
+            
+            // One write to every page, more pages than a batch used to hold
+            for (size_t i = 0; i < array.size(); ++i)
+                array.set(i, static_cast<int16_t>(i % kPeriod + 1));
+            
+            expectEquals(static_cast<int>(array.get(5)), 6, "writer sees its writes");
+            expect(holds(viewBefore, 0), "nothing visible before the commit");
+            
+            array.commitWrites(2);
+            
+            Array::DecodeCache after(4);
+            auto viewAfter = array.getView();
+            viewAfter.cache = &after;
+            
+            expect(holds(viewBefore, 0), "earlier view unchanged");
+            expect(holds(viewAfter, 1), "later view sees every write");
+            expectEquals(static_cast<int>(array.getNumCompressedPages()), static_cast<int>(numPages - 2));
+        }
+    }
+};
+
+static PagedArrayTests pagedArrayTests;